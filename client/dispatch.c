@@ -33,22 +33,38 @@ print_trace(struct CpuState* cpu_state, uintptr_t addr) {
     }
 }
 
-#define QUICK_TLB_BITS 10
-#define QUICK_TLB_BITOFF 4 // must be either 1, 2, 3, or 4
+// Sets are 16 * QUICK_TLB_WAYS bytes large. The set mask selects address bits
+// from QUICK_TLB_BITOFF on, which are scaled to the set offset in assembly.
 // Clang's inline assembly doesn't support expressions for index scale.
-// #define QUICK_TLB_IDXSCALE (1 << (4-QUICK_TLB_BITOFF))
+// #define QUICK_TLB_IDXSCALE ((16 * QUICK_TLB_WAYS) >> QUICK_TLB_BITOFF)
+#if QUICK_TLB_WAYS != 2
+#error "dispatchers only implement two ways"
+#endif
 #if QUICK_TLB_BITOFF == 4
-#define QUICK_TLB_IDXSCALE 1
-#elif QUICK_TLB_BITOFF == 3
 #define QUICK_TLB_IDXSCALE 2
-#elif QUICK_TLB_BITOFF == 2
+#elif QUICK_TLB_BITOFF == 3
 #define QUICK_TLB_IDXSCALE 4
-#elif QUICK_TLB_BITOFF == 1
+#elif QUICK_TLB_BITOFF == 2
 #define QUICK_TLB_IDXSCALE 8
 #else
 #error "invalid QUICK_TLB_BITOFF"
 #endif
-#define QUICK_TLB_HASH(addr) (((addr) >> QUICK_TLB_BITOFF) & ((1 << QUICK_TLB_BITS) - 1))
+#define QUICK_TLB_SET(cpu_state, addr) \
+        ((cpu_state)->quick_tlb[((addr) & (cpu_state)->quick_tlb_mask) >> QUICK_TLB_BITOFF])
+
+unsigned
+dispatch_quick_tlb_bits(unsigned config_bits) {
+    if (!config_bits)
+        return QUICK_TLB_DEFAULT_BITS;
+    if (config_bits > QUICK_TLB_MAX_BITS)
+        return QUICK_TLB_MAX_BITS;
+    return config_bits;
+}
+
+void
+dispatch_init_quick_tlb(struct CpuState* cpu_state, unsigned bits) {
+    cpu_state->quick_tlb_mask = (((uintptr_t) 1 << bits) - 1) << QUICK_TLB_BITOFF;
+}
 
 GNU_FORCE_EXTERN
 uintptr_t
@@ -56,7 +72,8 @@ resolve_func(struct CpuState* cpu_state, uintptr_t addr,
              struct RtldPatchData* patch_data) {
     struct State* state = cpu_state->state;
 
-    if (patch_data)
+    // Stubs of inline caches pass the actual target.
+    if (patch_data && patch_data->sym_addr)
         addr = patch_data->sym_addr;
 
     void* func;
@@ -93,12 +110,17 @@ resolve_func(struct CpuState* cpu_state, uintptr_t addr,
     // don't care about performance when tracing is active.
     if (LIKELY(!state->tc.tc_print_trace)) {
         // If possible, patch code which caused us to get here.
-        rtld_patch(patch_data, func);
-
-        // Update quick TLB
-        uintptr_t hash = QUICK_TLB_HASH(addr);
-        cpu_state->quick_tlb[hash][0] = addr;
-        cpu_state->quick_tlb[hash][1] = (uintptr_t) func;
+        rtld_patch(patch_data, addr, func);
+
+        // Update quick TLB; the most recent entry is in the first way, which
+        // the dispatchers check first.
+        uint64_t* set = QUICK_TLB_SET(cpu_state, addr);
+        if (set[0] != addr) {
+            set[2] = set[0];
+            set[3] = set[1];
+        }
+        set[0] = addr;
+        set[1] = (uintptr_t) func;
     } else {
         print_trace(cpu_state, addr);
     }
@@ -110,6 +132,85 @@ error:
     _exit(retval);
 }
 
+// Called from tier-0 code once its execution counter expired.
+void
+dispatch_tier_up(uintptr_t addr, uint64_t* profile, size_t profile_count) {
+    struct CpuState* cpu_state = get_thread_area();
+    struct State* state = cpu_state->state;
+
+    struct timespec start_time;
+    struct timespec end_time;
+    if (UNLIKELY(state->tc.tc_profile))
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    void* obj_base;
+    size_t obj_size;
+    void* func;
+    int retval;
+    if (profile_count) {
+        retval = translator_send_profile(&state->translator, addr, profile,
+                                         profile_count);
+        if (retval < 0)
+            goto error;
+    }
+    retval = translator_tier_up(&state->translator, addr, &obj_base, &obj_size);
+    if (retval < 0)
+        goto error;
+    if (obj_size == 0) // server declined, keep running the tier-0 code
+        return;
+
+    retval = rtld_replace_object(&state->rtld, obj_base, obj_size, addr);
+    if (retval < 0)
+        goto error;
+    retval = rtld_resolve(&state->rtld, addr, &func);
+    if (retval < 0)
+        goto error;
+
+    uint64_t* set = QUICK_TLB_SET(cpu_state, addr);
+    for (size_t way = 0; way < QUICK_TLB_WAYS; way++)
+        if (set[2 * way] == addr)
+            set[2 * way + 1] = (uintptr_t) func;
+
+    if (UNLIKELY(state->tc.tc_profile)) {
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        size_t time_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000
+                         + (end_time.tv_nsec - start_time.tv_nsec);
+        state->rew_time += time_ns;
+    }
+    return;
+
+error:
+    dprintf(2, "error recompiling address %lx: %u\n", addr, -retval);
+    _exit(retval);
+}
+
+// Called from profiled tier-0 code before calling the dispatcher. The slot has
+// nslots pairs of target and count, followed by the count of other targets.
+void
+dispatch_profile_target(uint64_t* slot, uintptr_t target, size_t nslots) {
+    for (size_t i = 0; i < nslots; i++) {
+        if (slot[2 * i] == target || !slot[2 * i]) {
+            slot[2 * i] = target;
+            slot[2 * i + 1]++;
+            return;
+        }
+    }
+    slot[2 * nslots]++;
+}
+
+int
+dispatch_link_speculative(void* arg, uintptr_t addr, void* obj,
+                          size_t obj_size) {
+    struct State* state = arg;
+
+    // The server doesn't know whether we got the code from elsewhere already.
+    // Objects linked by the server are added anyway, see rtld_object_linked.
+    void* func;
+    if (!rtld_object_linked(obj, obj_size) && !rtld_resolve(&state->rtld, addr, &func))
+        return 0;
+    return rtld_add_object(&state->rtld, obj, obj_size, addr);
+}
+
 // Used for PLT.
 void dispatch_cdecl(uint64_t*);
 
@@ -117,11 +218,14 @@ inline void dispatch_cdecl(uint64_t* cpu_regs) {
     struct CpuState* cpu_state = CPU_STATE_FROM_REGS(cpu_regs);
 
     uintptr_t addr = cpu_regs[0];
-    uintptr_t hash = QUICK_TLB_HASH(addr);
+    const uint64_t* set = QUICK_TLB_SET(cpu_state, addr);
 
-    uintptr_t func = cpu_state->quick_tlb[hash][1];
-    if (UNLIKELY(cpu_state->quick_tlb[hash][0] != addr))
-        func = resolve_func(cpu_state, addr, NULL);
+    uintptr_t func = set[1];
+    if (UNLIKELY(set[0] != addr)) {
+        func = set[3];
+        if (UNLIKELY(set[2] != addr))
+            func = resolve_func(cpu_state, addr, NULL);
+    }
 
     void(* func_p)(void*);
     *((void**) &func_p) = (void*) func;
@@ -144,10 +248,6 @@ __attribute__((noreturn)) extern void dispatch_regcall(uint64_t* cpu_state);
 void dispatch_regcall_tail();
 void dispatch_regcall_fullresolve();
 
-#define QUICK_TLB_OFFSET_ASM(dest_reg, addr_reg) \
-        lea dest_reg, [addr_reg * 4]; \
-        and dest_reg, ((1 << QUICK_TLB_BITS) - 1) << (2 + QUICK_TLB_BITOFF);
-
 ASM_BLOCK(
     .intel_syntax noprefix;
 
@@ -188,12 +288,15 @@ dispatch_hhvm_fullresolve: // stack alignment: cdecl
     .type dispatch_hhvm_tail, @function;
 dispatch_hhvm_tail: // stack alignment: cdecl
     mov r14, rbx;
-    and r14, ((1 << QUICK_TLB_BITS) - 1) << QUICK_TLB_BITOFF;
+    and r14, [r12 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_MASK_OFFSET];
     cmp rbx, [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET];
     jne 1f;
     jmp [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 8];
     .align 16;
-1:  xor r14, r14; // zero patch data
+1:  cmp rbx, [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 16];
+    jne 2f;
+    jmp [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 24];
+2:  xor r14, r14; // zero patch data
     jmp dispatch_hhvm_fullresolve;
     .size dispatch_hhvm_tail, .-dispatch_hhvm_tail;
 
@@ -202,13 +305,17 @@ dispatch_hhvm_tail: // stack alignment: cdecl
     .type dispatch_hhvm_call, @function;
 dispatch_hhvm_call: // stack alignment: hhvm
     mov r14, rbx;
-    and r14, ((1 << QUICK_TLB_BITS) - 1) << QUICK_TLB_BITOFF;
+    and r14, [r12 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_MASK_OFFSET];
     cmp rbx, [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET];
     jne 1f;
     call [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 8];
     ret;
     .align 16;
-1:  xor r14, r14; // zero patch data
+1:  cmp rbx, [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 16];
+    jne 2f;
+    call [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 24];
+    ret;
+2:  xor r14, r14; // zero patch data
     call dispatch_hhvm_fullresolve;
     ret;
     .size dispatch_hhvm_call, .-dispatch_hhvm_call;
@@ -239,12 +346,17 @@ dispatch_hhvm:
     // This is the quick_tlb hot loop.
 2:  call [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 8];
 3:  mov r14, rbx;
-    and r14, ((1 << QUICK_TLB_BITS) - 1) << QUICK_TLB_BITOFF;
+    and r14, [r12 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_MASK_OFFSET];
     cmp rbx, [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET];
     je 2b;
 
     // This code isn't exactly cold, but should be executed not that often.
-    // If we don't have addr in the quick_tlb, do a full resolve.
+    // Try the second way, and if we don't have addr in the quick_tlb, do a
+    // full resolve.
+    cmp rbx, [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 16];
+    jne 4f;
+    call [r12 + QUICK_TLB_IDXSCALE*r14 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 24];
+    jmp 3b;
 4:  xor r14, r14; // zero patch data
     call dispatch_hhvm_fullresolve;
     jmp 3b;
@@ -289,12 +401,15 @@ dispatch_regcall_fullresolve:
     .type dispatch_regcall_tail, @function;
 dispatch_regcall_tail:
     mov r10, rcx;
-    and r10, ((1 << QUICK_TLB_BITS) - 1) << QUICK_TLB_BITOFF;
+    and r10, [rax - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_MASK_OFFSET];
     cmp rcx, [rax + QUICK_TLB_IDXSCALE*r10 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET];
     jne 1f;
     jmp [rax + QUICK_TLB_IDXSCALE*r10 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 8];
     .align 16;
-1:  xor r10, r10; // zero patch data
+1:  cmp rcx, [rax + QUICK_TLB_IDXSCALE*r10 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 16];
+    jne 2f;
+    jmp [rax + QUICK_TLB_IDXSCALE*r10 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 24];
+2:  xor r10, r10; // zero patch data
     jmp dispatch_regcall_fullresolve;
     .size dispatch_regcall_tail, .-dispatch_regcall_tail;
 
@@ -321,12 +436,17 @@ dispatch_regcall:
     // This is the quick_tlb hot loop.
 2:  call [rax + QUICK_TLB_IDXSCALE*r10 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 8];
 3:  mov r10, rcx;
-    and r10, ((1 << QUICK_TLB_BITS) - 1) << QUICK_TLB_BITOFF;
+    and r10, [rax - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_MASK_OFFSET];
     cmp rcx, [rax + QUICK_TLB_IDXSCALE*r10 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET];
     je 2b;
 
     // This code isn't exactly cold, but should be executed not that often.
-    // If we don't have addr in the quick_tlb, do a full resolve.
+    // Try the second way, and if we don't have addr in the quick_tlb, do a
+    // full resolve.
+    cmp rcx, [rax + QUICK_TLB_IDXSCALE*r10 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 16];
+    jne 4f;
+    call [rax + QUICK_TLB_IDXSCALE*r10 - CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET + 24];
+    jmp 3b;
 4:  xor r10, r10; // zero patch data
     call dispatch_regcall_fullresolve;
     jmp 3b;
@@ -348,14 +468,25 @@ ASM_BLOCK(
     .global dispatch_aapcsx;
     .type dispatch_aapcsx, @function;
 dispatch_aapcsx:
+    ldr x16, [x20, -CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_MASK_OFFSET];
     add x17, x20, -CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET;
-    and x16, x0, ((1 << QUICK_TLB_BITS) - 1) << QUICK_TLB_BITOFF;
-    add x17, x17, x16, lsl (4-QUICK_TLB_BITOFF);
+    and x16, x0, x16;
+    add x17, x17, x16, lsl (5-QUICK_TLB_BITOFF);
     ldp x16, x17, [x17];
     cmp x16, x0;
     b.ne 1f;
     br x17;
-1:  mov x16, xzr; // zero dispatch data
+    // Try the second way, the set address needs to be computed again.
+1:
+    ldr x16, [x20, -CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_MASK_OFFSET];
+    add x17, x20, -CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET;
+    and x16, x0, x16;
+    add x17, x17, x16, lsl (5-QUICK_TLB_BITOFF);
+    ldp x16, x17, [x17, 16];
+    cmp x16, x0;
+    b.ne 2f;
+    br x17;
+2:  mov x16, xzr; // zero dispatch data
     b dispatch_aapcsx_fullresolve;
     .size dispatch_aapcsx, .-dispatch_aapcsx;
 
@@ -375,13 +506,23 @@ dispatch_aapcsx_loop:
 
     .align 16;
 1:  blr x17;
-2:  add x17, x20, -CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET;
-    and x16, x0, ((1 << QUICK_TLB_BITS) - 1) << QUICK_TLB_BITOFF;
-    add x17, x17, x16, lsl (4-QUICK_TLB_BITOFF);
+2:
+    ldr x16, [x20, -CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_MASK_OFFSET];
+    add x17, x20, -CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET;
+    and x16, x0, x16;
+    add x17, x17, x16, lsl (5-QUICK_TLB_BITOFF);
     ldp x16, x17, [x17];
     cmp x16, x0;
     b.eq 1b;
 
+    ldr x16, [x20, -CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_MASK_OFFSET];
+    add x17, x20, -CPU_STATE_REGDATA_OFFSET + CPU_STATE_QTLB_OFFSET;
+    and x16, x0, x16;
+    add x17, x17, x16, lsl (5-QUICK_TLB_BITOFF);
+    ldp x16, x17, [x17, 16];
+    cmp x16, x0;
+    b.eq 1b;
+
     mov x16, xzr; // zero patch data
     bl dispatch_aapcsx_fullresolve;
     b 2b;
@@ -7,5 +7,19 @@
 #include <state.h>
 
 const struct DispatcherInfo* dispatch_get(struct State* state);
+// Log2 of the number of quick TLB sets for the configured value, where zero
+// selects the default; the CpuState is allocated with CPU_STATE_SIZE(bits).
+unsigned dispatch_quick_tlb_bits(unsigned config_bits);
+// Set the number of quick TLB sets to 2^bits.
+void dispatch_init_quick_tlb(struct CpuState* cpu_state, unsigned bits);
+
+// Link an object that the server translated ahead of demand, arg is the State.
+int dispatch_link_speculative(void* arg, uintptr_t addr, void* obj,
+                              size_t obj_size);
+
+// Replace tier-0 code at addr with optimized code, called from translated code.
+void dispatch_tier_up(uintptr_t addr, uint64_t* profile, size_t profile_count);
+// Record the target of an indirect jump or call in profiled tier-0 code.
+void dispatch_profile_target(uint64_t* slot, uintptr_t target, size_t nslots);
 
 #endif
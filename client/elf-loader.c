@@ -318,6 +318,8 @@ int load_elf_binary(const char* filename, BinaryInfo* out_info) {
         out_info->phdr = (Elf_Phdr*) (load_addr + elfhdr_ex.e_phoff);
         out_info->phnum = elfhdr_ex.e_phnum;
         out_info->phent = elfhdr_ex.e_phentsize;
+        out_info->load_bias = load_bias;
+        out_info->has_interp = interp_fd >= 0;
     }
 
     retval = 0;
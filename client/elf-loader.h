@@ -3,7 +3,9 @@
 #define _INSTREW_ELF_LOADER_H
 
 #include <elf.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 
 #define Elf_Half Elf64_Half
@@ -19,6 +21,9 @@ struct BinaryInfo {
     Elf_Phdr* phdr;
     size_t phnum;
     size_t phent;
+    // Offset to the link-time addresses, non-zero for relocated binaries.
+    uintptr_t load_bias;
+    bool has_interp;
 };
 
 typedef struct BinaryInfo BinaryInfo;
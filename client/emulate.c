@@ -653,8 +653,15 @@ emulate_syscall(uint64_t* cpu_regs) {
             dprintf(2, "Rewriting %u bytes took %u ms\n",
                     (uint32_t) state->translator.written_bytes,
                     (uint32_t) (state->rew_time / 1000000));
+            const Rtld* rtld = &state->rtld;
+            dprintf(2, "Function table: %u entries, %u lookups, %u probes (max %u)\n",
+                    (uint32_t) (rtld->table.count), (uint32_t) rtld->lookups,
+                    (uint32_t) rtld->lookup_probes, (uint32_t) rtld->max_probes);
+            dprintf(2, "Patched %u references to new functions eagerly\n",
+                    (uint32_t) rtld->pending_patched);
         }
         // dprintf(2, "counter value: 0x%lx\n", cpu_regs[-2]);
+        rtld_snapshot_save(&state->rtld);
 
         nr = __NR_exit_group;
         goto native;
@@ -830,7 +837,10 @@ emulate_syscall_generic(struct CpuState* cpu_state, uint64_t* resp, uint64_t nr,
         break;
 
     case 93: nr = __NR_exit; goto native;
-    case 94: nr = __NR_exit_group; goto native;
+    case 94:
+        rtld_snapshot_save(&cpu_state->state->rtld);
+        nr = __NR_exit_group;
+        goto native;
     case 96: nr = __NR_set_tid_address; goto native;
     case 98: nr = __NR_futex; goto native;
     case 99: nr = __NR_set_robust_list; goto native;
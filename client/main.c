@@ -14,6 +14,51 @@
 
 #define PLATFORM_STRING "x86_64"
 
+// Restore the code of an earlier run from the snapshot directory. Snapshots
+// are keyed by a hash of the bytes and addresses of the executable segments,
+// which the server computes, so only static binaries at their link-time
+// address can use them.
+static int
+snapshot_load(struct State* state, const BinaryInfo* info, int dir_fd) {
+    if (info->load_bias || info->has_interp) {
+        close(dir_fd);
+        return 0;
+    }
+
+    uint64_t ranges[16][2];
+    size_t range_count = 0;
+    uintptr_t start = UINTPTR_MAX, end = 0;
+    for (size_t i = 0; i < info->phnum; i++) {
+        const Elf_Phdr* phdr = &info->phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X))
+            continue;
+        if (range_count == sizeof(ranges) / sizeof(ranges[0])) {
+            close(dir_fd);
+            return 0;
+        }
+        ranges[range_count][0] = phdr->p_vaddr;
+        ranges[range_count][1] = phdr->p_vaddr + phdr->p_memsz;
+        range_count++;
+        if (start > phdr->p_vaddr)
+            start = phdr->p_vaddr;
+        if (end < phdr->p_vaddr + phdr->p_memsz)
+            end = phdr->p_vaddr + phdr->p_memsz;
+    }
+    if (start >= end) {
+        close(dir_fd);
+        return 0;
+    }
+
+    uint8_t key[RTLD_SNAPSHOT_KEY_SIZE];
+    int retval = translator_snapshot_key(&state->translator, &ranges[0][0],
+                                         range_count, key, sizeof(key));
+    if (retval <= 0) {
+        close(dir_fd);
+        return retval;
+    }
+    return rtld_snapshot_load(&state->rtld, dir_fd, key, start, end);
+}
+
 
 int main(int argc, char** argv) {
     int i;
@@ -49,6 +94,7 @@ int main(int argc, char** argv) {
     }
 
     state.tsc.tsc_guest_arch = info.machine;
+    state.tsc.tsc_server_mode = TRANSLATOR_SERVER_MODE_SHM;
 #ifdef __x86_64__
     state.tsc.tsc_host_arch = EM_X86_64;
     state.tsc.tsc_stack_alignment = 8;
@@ -129,17 +175,25 @@ int main(int argc, char** argv) {
         stack_top[i] = (size_t) argv[i];
     *(--stack_top) = argc; // Argument Count
 
-    retval = rtld_init(&state.rtld, disp_info);
+    retval = rtld_init(&state.rtld, disp_info, state.tc.tc_table_bits,
+                       state.tc.tc_profile);
     if (retval < 0) {
         puts("error: could not initialize runtime linker");
         return retval;
     }
+    // Traces need all calls to go through the dispatcher.
+    state.rtld.patch_pending = !state.tc.tc_print_trace;
+    // Recompiled code replaces entries, references are then patched again.
+    state.rtld.track_refs = state.tc.tc_tiered;
 
     retval = rtld_perf_init(&state.rtld, state.tc.tc_perf);
     if (retval < 0) {
         puts("warning: could not initialize perf support");
     }
 
+    translator_set_spec_handler(&state.translator, dispatch_link_speculative,
+                                &state);
+
     void* initobj;
     size_t initobj_size;
     retval = translator_get_object(&state.translator, &initobj, &initobj_size);
@@ -147,7 +201,29 @@ int main(int argc, char** argv) {
         puts("error: could not get initial object");
         return retval;
     }
-    if (initobj_size > 0) {
+    // The snapshot includes the initial object.
+    bool restored = false;
+    if (state.tc.tc_snapshot) {
+        int snapshot_dir = translator_get_snapshot_dir(&state.translator);
+        if (snapshot_dir >= 0 && !state.tc.tc_profile) {
+            retval = snapshot_load(&state, &info, snapshot_dir);
+            if (retval < 0) {
+                puts("error: could not restore snapshot");
+                return retval;
+            }
+            restored = retval > 0;
+        } else if (snapshot_dir >= 0) {
+            close(snapshot_dir);
+        }
+    }
+    if (state.tc.tc_client_index) {
+        retval = translator_load_index(&state.translator);
+        if (retval < 0) {
+            puts("error: could not load object index");
+            return retval;
+        }
+    }
+    if (initobj_size > 0 && !restored) {
         retval = rtld_add_object(&state.rtld, initobj, initobj_size, 0);
         if (retval < 0) {
             puts("error: could not get initial object");
@@ -155,12 +231,27 @@ int main(int argc, char** argv) {
         }
     }
 
-    struct CpuState* cpu_state = mem_alloc_data(sizeof(struct CpuState),
+    if (state.tc.tc_server_link) {
+        char link_info[1024];
+        retval = rtld_link_info(&state.rtld, link_info, sizeof(link_info));
+        if (retval >= 0)
+            retval = translator_send_link_info(&state.translator, link_info,
+                                               retval);
+        if (retval < 0) {
+            puts("error: could not set up server-side linking");
+            return retval;
+        }
+    }
+
+    unsigned quick_tlb_bits = dispatch_quick_tlb_bits(state.tc.tc_quick_tlb_bits);
+    size_t cpu_state_size = CPU_STATE_SIZE(quick_tlb_bits);
+    struct CpuState* cpu_state = mem_alloc_data(cpu_state_size,
                                                 _Alignof(struct CpuState));
     // TODO: check for BAD_ADDR(cpu_state)
-    memset(cpu_state, 0, sizeof(*cpu_state));
+    memset(cpu_state, 0, cpu_state_size);
     cpu_state->self = cpu_state;
     cpu_state->state = &state;
+    dispatch_init_quick_tlb(cpu_state, quick_tlb_bits);
 
     retval = set_thread_area(cpu_state);
     if (retval) {
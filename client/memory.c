@@ -10,7 +10,7 @@
 
 #define MEM_BASE ((void*) 0x0000400000000000ull)
 #define MEM_CODE_SIZE 0x40000000
-#define MEM_DATA_SIZE 0x01000000
+#define MEM_DATA_SIZE 0x02000000
 
 typedef struct Arena Arena;
 struct Arena {
@@ -78,6 +78,14 @@ mem_alloc_data(size_t size, size_t alignment) {
     return arena_alloc(&main_arena_data, size, alignment, /*exec=*/false);
 }
 
+void*
+mem_map_shared(int fd, size_t size) {
+    void* mem = mem_alloc_data(size, getpagesize());
+    if (BAD_ADDR(mem))
+        return mem;
+    return mmap(mem, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0);
+}
+
 void*
 mem_alloc_code(size_t size, size_t alignment) {
     return arena_alloc(&main_arena_code, size, alignment, /*exec=*/true);
@@ -88,10 +96,42 @@ mem_write_code(void* dst, const void* src, size_t size) {
     // Note: if W^X is enforced, the pages need to be mapped somewhere else for
     // writing (e.g., using memfd).
     memcpy(dst, src, size);
+    mem_flush_code(dst, size);
+    return 0;
+}
+
+void*
+mem_code_used(size_t* out_size) {
+    *out_size = main_arena_code.brk - main_arena_code.start;
+    return main_arena_code.start;
+}
+
+int
+mem_map_code(int fd, off_t offset, size_t size, size_t used) {
+    Arena* arena = &main_arena_code;
+    if (used > size || size & (getpagesize() - 1))
+        return -EINVAL;
+    if (size > (size_t) (arena->end - arena->start))
+        return -ENOMEM;
+    if (arena->brk > arena->start + used)
+        return -EBUSY;
+    void* mem = mmap(arena->start, size, PROT_READ|PROT_WRITE|PROT_EXEC,
+                     MAP_PRIVATE|MAP_FIXED, fd, offset);
+    if (BAD_ADDR(mem))
+        return (int) (uintptr_t) mem;
+    arena->brk = arena->start + used;
+    if (arena->brkp < arena->start + size)
+        arena->brkp = arena->start + size;
+    return 0;
+}
 
+void
+mem_flush_code(void* dst, size_t size) {
     // Flush ICache, except for x86-64.
 #if defined(__x86_64__)
     // Do nothing; x86-64 flushes ICache automatically.
+    (void) dst;
+    (void) size;
 #elif defined(__aarch64__)
     uintptr_t dstu = (uintptr_t) dst;
     // Procedure from AArch64 Manual, B2.4.4
@@ -115,5 +155,4 @@ mem_write_code(void* dst, const void* src, size_t size) {
 #else
 #error "Implement ICache flush for unknown target"
 #endif
-    return 0;
 }
@@ -8,7 +8,18 @@ int mem_init(void);
 
 void* mem_alloc_data(size_t size, size_t alignment);
 
+// Map a shared memory file into the data arena.
+void* mem_map_shared(int fd, size_t size);
+
 void* mem_alloc_code(size_t size, size_t alignment);
 int mem_write_code(void* dst, const void* src, size_t size);
+// Make code written by other means (e.g., by the server) visible for execution.
+void mem_flush_code(void* dst, size_t size);
+
+// Start and used size of the code arena, e.g. to save it in a file.
+void* mem_code_used(size_t* out_size);
+// Map size bytes of fd at offset to the start of the code arena, replacing
+// the used part, which must not exceed used bytes; used bytes remain in use.
+int mem_map_code(int fd, off_t offset, size_t size, size_t used);
 
 #endif
@@ -11,6 +11,9 @@
 
 #include <memory.h>
 
+#include "instrew-hash.h"
+#include "instrew-link.h"
+
 
 // Old elf.h don't include unwind sections
 #if !defined(SHT_X86_64_UNWIND)
@@ -58,9 +61,13 @@ rtld_blend(void* tgt, uint64_t mask, uint64_t data) {
         *(uint8_t*) tgt = (data & mask) | (*(uint8_t*) tgt & ~mask);
 }
 
-#define RTLD_HASH_BITS 17
-#define RTLD_HASH_MASK ((1 << RTLD_HASH_BITS) - 1)
-#define RTLD_HASH(addr) (((addr >> 2)) & RTLD_HASH_MASK)
+// Initial size of the function table, which grows when it is 3/4 full. Each
+// new entry moves RTLD_REHASH_STEP slots of the previous table.
+#define RTLD_TABLE_BITS 14
+#define RTLD_TABLE_MAX_BITS 24
+#define RTLD_REHASH_STEP 64
+// Initial size of the table of patch stubs, which grows when it is 3/4 full.
+#define RTLD_PENDING_BITS 10
 
 struct PltEntry {
     const char* name;
@@ -90,15 +97,17 @@ static const struct PltEntry plt_entries[] = {
 #error "currently unsupported architecture"
 #endif
 
+#define PLT_ENTRY_COUNT (sizeof(plt_entries) / sizeof(plt_entries[0]) - 1)
+#define PLT_DATA_OFFSET ALIGN_UP(PLT_ENTRY_COUNT * PLT_FUNC_SIZE, 0x40u)
+#define PLT_SIZE (PLT_DATA_OFFSET + PLT_ENTRY_COUNT * sizeof(uintptr_t))
+
+// Write the PLT code and the addresses of this process to pltcode.
 static int
-plt_create(const struct DispatcherInfo* disp_info, void** out_plt) {
-    size_t plt_entry_count = sizeof(plt_entries) / sizeof(plt_entries[0]) - 1;
-    size_t code_size = plt_entry_count * PLT_FUNC_SIZE;
-    size_t data_offset = ALIGN_UP(code_size, 0x40u);
-    size_t data_size = plt_entry_count * sizeof(uintptr_t);
-    size_t plt_size = data_offset + data_size;
+plt_write(const struct DispatcherInfo* disp_info, void* pltcode) {
+    size_t plt_entry_count = PLT_ENTRY_COUNT;
+    size_t data_offset = PLT_DATA_OFFSET;
 
-    uintptr_t plt[ALIGN_UP(plt_size, sizeof(uintptr_t)) / sizeof(uintptr_t)];
+    uintptr_t plt[ALIGN_UP(PLT_SIZE, sizeof(uintptr_t)) / sizeof(uintptr_t)];
 
     for (size_t i = 0; i < plt_entry_count; i++) {
         void* code_ptr = (uint8_t*) plt + i * PLT_FUNC_SIZE;
@@ -122,10 +131,15 @@ plt_create(const struct DispatcherInfo* disp_info, void** out_plt) {
 #endif // defined(__x86_64__)
     }
 
-    void* pltcode = mem_alloc_code(sizeof(plt), 0x40);
+    return mem_write_code(pltcode, plt, sizeof(plt));
+}
+
+static int
+plt_create(const struct DispatcherInfo* disp_info, void** out_plt) {
+    void* pltcode = mem_alloc_code(ALIGN_UP(PLT_SIZE, sizeof(uintptr_t)), 0x40);
     if (BAD_ADDR(pltcode))
         return (int) (uintptr_t) pltcode;
-    int ret = mem_write_code(pltcode, plt, sizeof(plt));
+    int ret = plt_write(disp_info, pltcode);
     if (ret < 0)
         return ret;
     *out_plt = pltcode;
@@ -133,6 +147,21 @@ plt_create(const struct DispatcherInfo* disp_info, void** out_plt) {
     return 0;
 }
 
+static int rtld_pending_add(Rtld* r, struct RtldPatchData* stub_data);
+
+// Record a reference that was resolved directly. The patch data is placed in
+// the code arena like that of stubs, so that snapshots include it.
+static int
+rtld_ref_add(Rtld* rtld, const struct RtldPatchData* patch_data) {
+    struct RtldPatchData* ref = mem_alloc_code(sizeof(*ref), _Alignof(struct RtldPatchData));
+    if (BAD_ADDR(ref))
+        return (int) (uintptr_t) ref;
+    int ret = mem_write_code(ref, patch_data, sizeof(*ref));
+    if (ret < 0)
+        return ret;
+    return rtld_pending_add(rtld, ref);
+}
+
 static int
 rtld_patch_create_stub(Rtld* rtld, const struct RtldPatchData* patch_data,
                        uintptr_t* out_stub) {
@@ -171,19 +200,19 @@ rtld_patch_create_stub(Rtld* rtld, const struct RtldPatchData* patch_data,
     int ret = mem_write_code(stub, stcode, sizeof(stcode));
     if (ret < 0)
         return ret;
+    // Stubs of inline caches have no address and are filled at the first miss.
+    if (patch_data->sym_addr) {
+        ret = rtld_pending_add(rtld, (struct RtldPatchData*)
+                ((uint8_t*) stub + sizeof(stcode) - sizeof(*patch_data)));
+        if (ret < 0)
+            return ret;
+    }
 
     *out_stub = (uintptr_t) stub;
     return 0;
 }
 
 
-struct RtldObject {
-    _Atomic uintptr_t addr;
-    void* entry;
-    void* base;
-    size_t size;
-};
-
 struct RtldElf {
     uint8_t* base;
     size_t size;
@@ -284,11 +313,20 @@ rtld_elf_resolve_sym(RtldElf* re, size_t symtab_idx, size_t sym_idx,
         } else if (!strcmp(name, "instrew_baseaddr")) {
             *out_addr = re->skew;
             return 0;
+        } else if (!strcmp(name, "instrew_ic_miss")) {
+            patch_data->sym_addr = 0;
+            return rtld_patch_create_stub(re->rtld, patch_data, out_addr);
         } else {
             uintptr_t addr = 0;
             if (!rtld_elf_decode_name(re, name, &addr)) {
-                if (!rtld_resolve(re->rtld, addr, (void**) out_addr))
-                    return 0; // we got it already
+                if (!rtld_resolve(re->rtld, addr, (void**) out_addr)) {
+                    // We got it already; keep the reference if the entry may
+                    // be replaced.
+                    if (!re->rtld->track_refs)
+                        return 0;
+                    patch_data->sym_addr = addr;
+                    return rtld_ref_add(re->rtld, patch_data);
+                }
                 // Create a stub. We cannot use the normal dispatcher, as the
                 // target address is not necessarily set.
                 patch_data->sym_addr = addr;
@@ -495,31 +533,203 @@ rtld_elf_process_rela(RtldElf* re, int rela_idx) {
     return 0;
 }
 
-static int rtld_set(Rtld* r, uintptr_t addr, void* entry, void* obj_base,
-                    size_t obj_size) {
-    // Note: not thread-safe. We first find a spot, then populate the data, and
-    // then write the address, so that concurrent readers only ever see valid
-    // data. However, a concurrent call to add an entry might cause them to
-    // write to the same spot.
+static int rtld_redirect(void* old_entry, void* new_entry) {
+    uint8_t code[16];
+    size_t code_size;
+    ptrdiff_t diff = (uintptr_t) new_entry - (uintptr_t) old_entry;
+#if defined(__x86_64__)
+    if (!rtld_elf_signed_range(diff - 5, 32, "redirect"))
+        return -EINVAL;
+    code[0] = 0xe9; // jmp rel32
+    *(uint32_t*) (code + 1) = diff - 5;
+    code_size = 5;
+#elif defined(__aarch64__)
+    if (CHECK_SIGNED_BITS(diff, 28)) {
+        *(uint32_t*) code = 0x14000000 | ((diff >> 2) & 0x03ffffff); // B ...
+        code_size = 4;
+    } else {
+        *(uint32_t*) (code + 0) = 0x58000050; // ldr x16, [pc+8]
+        *(uint32_t*) (code + 4) = 0xd61f0200; // br x16
+        *(uint64_t*) (code + 8) = (uintptr_t) new_entry;
+        code_size = 16;
+    }
+#else
+#error "missing redirect"
+#endif
+    return mem_write_code(old_entry, code, code_size);
+}
+
+static int rtld_table_alloc(struct RtldTable* t, unsigned bits) {
+    size_t size = (size_t) 1 << bits;
+    // Tables are replaced when growing, so they don't use the data arena.
+    void* mem = mmap(NULL, size * (sizeof(*t->keys) + sizeof(*t->entries)),
+                     PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (BAD_ADDR(mem))
+        return (int) (uintptr_t) mem;
+    t->keys = mem;
+    t->entries = (void**) ((char*) mem + size * sizeof(*t->keys));
+    t->mask = size - 1;
+    t->shift = 64 - bits;
+    t->count = 0;
+    return 0;
+}
+
+static void rtld_table_free(struct RtldTable* t) {
+    size_t size = t->mask + 1;
+    munmap((void*) t->keys, size * (sizeof(*t->keys) + sizeof(*t->entries)));
+    t->keys = NULL;
+}
+
+static size_t rtld_table_hash(const struct RtldTable* t, uintptr_t addr) {
+    return (addr * 0x9e3779b97f4a7c15ull) >> t->shift;
+}
+
+// Find the slot of addr or the free slot where it belongs. The table always
+// has free slots.
+static size_t rtld_table_find(const struct RtldTable* t, uintptr_t addr,
+                              size_t* out_probes) {
+    size_t idx = rtld_table_hash(t, addr);
+    size_t probes = 1;
+    while (true) {
+        uintptr_t key = atomic_load_explicit(&t->keys[idx], memory_order_acquire);
+        if (key == addr || !key)
+            break;
+        idx = (idx + 1) & t->mask;
+        probes++;
+    }
+    if (out_probes)
+        *out_probes = probes;
+    return idx;
+}
+
+// Populate the entry before the key, so that readers only ever see valid
+// data. Not thread-safe with respect to other writers.
+static void rtld_table_insert(struct RtldTable* t, size_t idx, uintptr_t addr,
+                              void* entry) {
+    t->entries[idx] = entry;
+    atomic_store_explicit(&t->keys[idx], addr, memory_order_release);
+    t->count++;
+}
+
+// Move up to count slots of the old table. Old slots are not cleared, so that
+// probing there still works; moved keys are found in the new table first.
+static void rtld_rehash(Rtld* r, size_t count) {
+    struct RtldTable* old = &r->old_table;
+    if (!old->keys)
+        return;
+    for (; count && r->rehash_idx <= old->mask; count--, r->rehash_idx++) {
+        uintptr_t key = atomic_load_explicit(&old->keys[r->rehash_idx],
+                                             memory_order_relaxed);
+        if (!key)
+            continue;
+        size_t idx = rtld_table_find(&r->table, key, NULL);
+        if (!r->table.keys[idx])
+            rtld_table_insert(&r->table, idx, key, old->entries[r->rehash_idx]);
+    }
+    if (r->rehash_idx > old->mask)
+        rtld_table_free(old);
+}
+
+// Make room for one more address in the pending table.
+static int rtld_pending_reserve(struct RtldTable* t) {
+    if (t->count + 1 <= t->mask / 4 * 3)
+        return 0;
+    // Only keep addresses that still have stubs.
+    struct RtldTable new_table;
+    int ret = rtld_table_alloc(&new_table, 64 - t->shift + 1);
+    if (ret < 0)
+        return ret;
+    for (size_t i = 0; i <= t->mask; i++) {
+        if (!t->keys[i] || !t->entries[i])
+            continue;
+        size_t idx = rtld_table_find(&new_table, t->keys[i], NULL);
+        rtld_table_insert(&new_table, idx, t->keys[i], t->entries[i]);
+    }
+    rtld_table_free(t);
+    *t = new_table;
+    return 0;
+}
 
+static int rtld_pending_add(Rtld* r, struct RtldPatchData* stub_data) {
+    if (!r->patch_pending)
+        return 0;
+
+    struct RtldTable* t = &r->pending;
+    int ret = rtld_pending_reserve(t);
+    if (ret < 0)
+        return ret;
+
+    uintptr_t addr = stub_data->sym_addr;
+    size_t idx = rtld_table_find(t, addr, NULL);
+    struct RtldPatchData* next = t->keys[idx] ? t->entries[idx] : NULL;
+    ret = mem_write_code(&stub_data->next_pending, &next, sizeof(next));
+    if (ret < 0)
+        return ret;
+    if (t->keys[idx])
+        t->entries[idx] = stub_data;
+    else
+        rtld_table_insert(t, idx, addr, stub_data);
+    return 0;
+}
+
+// Patch all references to addr which still go through a stub.
+static void rtld_pending_patch(Rtld* r, uintptr_t addr, void* entry) {
+    struct RtldTable* t = &r->pending;
+    if (!t->count)
+        return;
+    size_t idx = rtld_table_find(t, addr, NULL);
+    if (!t->keys[idx])
+        return;
+    for (struct RtldPatchData* pd = t->entries[idx]; pd; pd = pd->next_pending) {
+        rtld_patch(pd, addr, entry);
+        r->pending_patched++;
+    }
+    if (!r->track_refs)
+        t->entries[idx] = NULL;
+}
+
+static int rtld_set(Rtld* r, uintptr_t addr, void* entry, bool replace) {
     if (!addr) // 0 is reserved for "empty"
         return -EINVAL;
-    size_t hash = RTLD_HASH(addr);
-    for (size_t i = 0; i <= RTLD_HASH_MASK; i++) {
-        RtldObject* obj = &r->objects[(hash + i) & RTLD_HASH_MASK];
-        uintptr_t obj_addr = atomic_load_explicit(&obj->addr, memory_order_relaxed);
-        if (obj_addr == addr)
-            return -EEXIST;
-        if (!obj_addr) {
-            obj->entry = entry;
-            obj->base = obj_base;
-            obj->size = obj_size;
-            atomic_store_explicit(&obj->addr, addr, memory_order_release);
-            return 0;
+
+    struct RtldTable* t = &r->table;
+    size_t idx = rtld_table_find(t, addr, NULL);
+    if (!t->keys[idx] && r->old_table.keys) {
+        // Not moved yet, update it in place.
+        size_t old_idx = rtld_table_find(&r->old_table, addr, NULL);
+        if (r->old_table.keys[old_idx]) {
+            t = &r->old_table;
+            idx = old_idx;
         }
     }
+    if (t->keys[idx]) {
+        if (!replace)
+            return -EEXIST;
+        // Readers might still use the old entry; send them to the new code.
+        int ret = rtld_redirect(t->entries[idx], entry);
+        if (ret < 0)
+            return ret;
+        t->entries[idx] = entry;
+        rtld_pending_patch(r, addr, entry);
+        return 0;
+    }
 
-    return -ENOSPC;
+    if (r->table.count + 1 > r->table.mask / 4 * 3) {
+        if (r->old_table.keys) // moving can't keep up; finish it
+            rtld_rehash(r, SIZE_MAX);
+        struct RtldTable new_table;
+        int ret = rtld_table_alloc(&new_table, 64 - r->table.shift + 1);
+        if (ret < 0)
+            return ret;
+        r->old_table = r->table;
+        r->table = new_table;
+        r->rehash_idx = 0;
+        idx = rtld_table_find(&r->table, addr, NULL);
+    }
+    rtld_table_insert(&r->table, idx, addr, entry);
+    rtld_rehash(r, RTLD_REHASH_STEP);
+    rtld_pending_patch(r, addr, entry);
+    return 0;
 }
 
 // Perf support for simple maps and jitdump files.
@@ -643,8 +853,136 @@ rtld_perf_init(Rtld* r, int mode) {
     return 0;
 }
 
-int rtld_add_object(Rtld* r, void* obj_base, size_t obj_size, uint64_t skew) {
+#define RTLD_LINK_CODE_SIZE 0x10000000
+#define RTLD_LINK_DATA_SIZE 0x00400000
+
+int
+rtld_link_info(Rtld* r, void* buf, size_t buf_size) {
+    struct InstrewLinkInfo info = {
+        .code_size = RTLD_LINK_CODE_SIZE,
+        .data_size = RTLD_LINK_DATA_SIZE,
+        .plt_addr = (uintptr_t) r->plt,
+        .plt_entry_size = PLT_FUNC_SIZE,
+    };
+    size_t size = sizeof(info);
+    if (size > buf_size)
+        return -ENOSPC;
+    for (size_t i = 0; plt_entries[i].name; i++) {
+        size_t len = strlen(plt_entries[i].name) + 1;
+        if (size + len > buf_size)
+            return -ENOSPC;
+        memcpy((char*) buf + size, plt_entries[i].name, len);
+        size += len;
+    }
+
+    void* code = mem_alloc_code(RTLD_LINK_CODE_SIZE, getpagesize());
+    if (BAD_ADDR(code))
+        return (int) (uintptr_t) code;
+    void* data = mem_alloc_data(RTLD_LINK_DATA_SIZE, getpagesize());
+    if (BAD_ADDR(data))
+        return (int) (uintptr_t) data;
+    info.code_addr = (uintptr_t) code;
+    info.data_addr = (uintptr_t) data;
+    memcpy(buf, &info, sizeof(info));
+
+    r->link_code = code;
+    r->link_code_size = RTLD_LINK_CODE_SIZE;
+    r->link_data = data;
+    r->link_data_size = RTLD_LINK_DATA_SIZE;
+    return size;
+}
+
+static bool
+rtld_link_contains(uint64_t start, uint64_t size, uint64_t addr,
+                   uint64_t addr_size) {
+    return addr >= start && addr_size <= size && addr - start <= size - addr_size;
+}
+
+// Objects linked by the server only need fixups for references to code the
+// server didn't know about, everything else is already in its final form.
+static int
+rtld_add_linked(Rtld* r, void* obj_base, size_t obj_size, bool replace) {
+    const struct InstrewLinkHdr* hdr = obj_base;
+    if (obj_size < sizeof(*hdr))
+        return -EINVAL;
+    if (!rtld_link_contains((uintptr_t) r->link_code, r->link_code_size,
+                            hdr->code_addr, hdr->code_size))
+        return -EINVAL;
+    if (!rtld_link_contains((uintptr_t) r->link_data, r->link_data_size,
+                            hdr->data_addr, hdr->data_size))
+        return -EINVAL;
+    // Counts are 32-bit and region sizes are checked, so this can't overflow.
+    size_t size = sizeof(*hdr) +
+                  hdr->entry_count * sizeof(struct InstrewLinkEntry) +
+                  hdr->fixup_count * sizeof(struct InstrewLinkFixup);
+    if (!(hdr->flags & INSTREW_LINK_WRITTEN))
+        size += hdr->code_size + hdr->data_size;
+    if (size > obj_size)
+        return -EINVAL;
+
+    const struct InstrewLinkEntry* entries = (const void*) (hdr + 1);
+    const struct InstrewLinkFixup* fixups = (const void*) (entries + hdr->entry_count);
+    if (!(hdr->flags & INSTREW_LINK_WRITTEN)) {
+        const uint8_t* code = (const uint8_t*) (fixups + hdr->fixup_count);
+        memcpy((void*) hdr->code_addr, code, hdr->code_size);
+        memcpy((void*) hdr->data_addr, code + hdr->code_size, hdr->data_size);
+    }
+
     int retval;
+    for (uint32_t i = 0; i < hdr->fixup_count; i++) {
+        const struct InstrewLinkFixup* fixup = &fixups[i];
+        if (!rtld_link_contains(hdr->code_addr, hdr->code_size, fixup->patch_addr, 8) &&
+            !rtld_link_contains(hdr->data_addr, hdr->data_size, fixup->patch_addr, 8))
+            return -EINVAL;
+
+        struct RtldPatchData reloc_patch = {
+            .rel_type = fixup->rel_type,
+            .rel_size = 8, // TODO: be more accurate
+            .addend = fixup->addend,
+            .patch_addr = fixup->patch_addr,
+        };
+        uintptr_t sym;
+        if (!fixup->sym_addr || rtld_resolve(r, fixup->sym_addr, (void**) &sym) < 0) {
+            reloc_patch.sym_addr = fixup->sym_addr;
+            if ((retval = rtld_patch_create_stub(r, &reloc_patch, &sym)) < 0)
+                return retval;
+        }
+        retval = rtld_reloc_at(&reloc_patch, (void*) fixup->patch_addr, (void*) sym);
+        if (retval < 0)
+            return retval;
+    }
+    mem_flush_code((void*) hdr->code_addr, hdr->code_size);
+
+    for (uint32_t i = 0; i < hdr->entry_count; i++) {
+        const struct InstrewLinkEntry* entry = &entries[i];
+        if (!entry->addr || !rtld_link_contains(hdr->code_addr, hdr->code_size,
+                                                entry->entry, entry->size))
+            return -EINVAL;
+        retval = rtld_set(r, entry->addr, (void*) entry->entry, replace);
+        // The code is in place for references from objects linked later, but
+        // existing entries may already be patched into other code; keep them.
+        if (retval == -EEXIST)
+            continue;
+        if (retval < 0)
+            return retval;
+        rtld_perf_notify(r, entry->addr, (void*) entry->entry, entry->size,
+                         "linked");
+    }
+
+    return 0;
+}
+
+bool rtld_object_linked(const void* obj_base, size_t obj_size) {
+    return obj_size >= sizeof(uint32_t) && *(const uint32_t*) obj_base == INSTREW_LINK_MAGIC;
+}
+
+static int
+rtld_add_object_common(Rtld* r, void* obj_base, size_t obj_size, uint64_t skew,
+                       bool replace) {
+    int retval;
+
+    if (rtld_object_linked(obj_base, obj_size))
+        return rtld_add_linked(r, obj_base, obj_size, replace);
 
     RtldElf re;
     if ((retval = rtld_elf_init(&re, obj_base, obj_size, skew, r)) < 0)
@@ -653,31 +991,46 @@ int rtld_add_object(Rtld* r, void* obj_base, size_t obj_size, uint64_t skew) {
     int i;
     Elf64_Shdr* elf_shnt;
 
-    // First, check flags and determine total allocation size and alignment
-    size_t totsz = 0;
-    size_t totalign = 1;
+    // First, check flags and determine total allocation size and alignment.
+    // Writable sections (e.g., counters of tiered code) go to the data arena,
+    // unless the code arena is saved in a snapshot.
+    bool data_in_code = r->snapshot_dir >= 0;
+    size_t totsz = 0, datasz = 0;
+    size_t totalign = 1, dataalign = 1;
     for (i = 0, elf_shnt = re.re_shdr; i < re.re_ehdr->e_shnum; i++, elf_shnt++) {
         // We don't support more flags
-        if (elf_shnt->sh_flags & ~(SHF_ALLOC|SHF_EXECINSTR|SHF_MERGE|SHF_STRINGS|SHF_INFO_LINK)) {
+        if (elf_shnt->sh_flags & ~(SHF_ALLOC|SHF_WRITE|SHF_EXECINSTR|SHF_MERGE|SHF_STRINGS|SHF_INFO_LINK)) {
             dprintf(2, "unsupported section flags\n");
             return -EINVAL;
         }
-        if (elf_shnt->sh_flags & SHF_ALLOC) {
-            totsz = ALIGN_UP(totsz, elf_shnt->sh_addralign);
-            elf_shnt->sh_addr = totsz; // keep offset into allocation
-            totsz += elf_shnt->sh_size;
-            if (totalign < elf_shnt->sh_addralign)
-                totalign = elf_shnt->sh_addralign;
-        }
+        if (!(elf_shnt->sh_flags & SHF_ALLOC))
+            continue;
+        bool write = (elf_shnt->sh_flags & SHF_WRITE) && !data_in_code;
+        size_t* sz = write ? &datasz : &totsz;
+        size_t* align = write ? &dataalign : &totalign;
+        *sz = ALIGN_UP(*sz, elf_shnt->sh_addralign);
+        elf_shnt->sh_addr = *sz; // keep offset into allocation
+        *sz += elf_shnt->sh_size;
+        if (*align < elf_shnt->sh_addralign)
+            *align = elf_shnt->sh_addralign;
     }
 
     char* base = mem_alloc_code(totsz, totalign);
     if (BAD_ADDR(base))
         return (int) (uintptr_t) base;
+    char* data_base = NULL;
+    if (datasz) {
+        data_base = mem_alloc_data(datasz, dataalign);
+        if (BAD_ADDR(data_base))
+            return (int) (uintptr_t) data_base;
+    }
 
-    for (i = 0, elf_shnt = re.re_shdr; i < re.re_ehdr->e_shnum; i++, elf_shnt++)
-        if (elf_shnt->sh_flags & SHF_ALLOC)
+    for (i = 0, elf_shnt = re.re_shdr; i < re.re_ehdr->e_shnum; i++, elf_shnt++) {
+        if ((elf_shnt->sh_flags & SHF_WRITE) && !data_in_code)
+            elf_shnt->sh_addr += (uintptr_t) data_base;
+        else if (elf_shnt->sh_flags & SHF_ALLOC)
             elf_shnt->sh_addr += (uintptr_t) base;
+    }
 
     // Second pass to resolve relocations, now that all sections are allocated.
     for (i = 0, elf_shnt = re.re_shdr; i < re.re_ehdr->e_shnum; i++, elf_shnt++) {
@@ -690,11 +1043,15 @@ int rtld_add_object(Rtld* r, void* obj_base, size_t obj_size, uint64_t skew) {
 
     // Third pass to actually copy code into target allocation
     for (i = 0, elf_shnt = re.re_shdr; i < re.re_ehdr->e_shnum; i++, elf_shnt++) {
+        if (elf_shnt->sh_type == SHT_NOBITS && (elf_shnt->sh_flags & SHF_WRITE))
+            memset((void*) elf_shnt->sh_addr, 0, elf_shnt->sh_size);
         if (elf_shnt->sh_type != SHT_PROGBITS)
             continue;
         uint8_t* src = re.base + elf_shnt->sh_offset;
         void* dst = (void*) elf_shnt->sh_addr;
-        if ((retval = mem_write_code(dst, src, elf_shnt->sh_size)) < 0)
+        if (elf_shnt->sh_flags & SHF_WRITE)
+            memcpy(dst, src, elf_shnt->sh_size);
+        else if ((retval = mem_write_code(dst, src, elf_shnt->sh_size)) < 0)
             goto out;
     }
 
@@ -734,7 +1091,7 @@ int rtld_add_object(Rtld* r, void* obj_base, size_t obj_size, uint64_t skew) {
                 dprintf(2, "invalid function name %s\n", name);
                 goto out;
             }
-            retval = rtld_set(r, addr, (void*) entry, obj_base, obj_size);
+            retval = rtld_set(r, addr, (void*) entry, replace);
             if (retval < 0)
                 goto out;
 
@@ -749,19 +1106,46 @@ out:
     return retval;
 }
 
-int
-rtld_init(Rtld* r, const struct DispatcherInfo* disp_info) {
-    size_t table_size = sizeof(RtldObject) * (1 << RTLD_HASH_BITS);
-    RtldObject* objects = mem_alloc_data(table_size, getpagesize());
-    if (BAD_ADDR(objects))
-        return (int) (uintptr_t) objects;
+int rtld_add_object(Rtld* r, void* obj_base, size_t obj_size, uint64_t skew) {
+    return rtld_add_object_common(r, obj_base, obj_size, skew, false);
+}
+
+int rtld_replace_object(Rtld* r, void* obj_base, size_t obj_size, uint64_t skew) {
+    return rtld_add_object_common(r, obj_base, obj_size, skew, true);
+}
 
-    r->objects = objects;
+int
+rtld_init(Rtld* r, const struct DispatcherInfo* disp_info, unsigned table_bits,
+          bool profile) {
+    if (!table_bits)
+        table_bits = RTLD_TABLE_BITS;
+    else if (table_bits > RTLD_TABLE_MAX_BITS)
+        table_bits = RTLD_TABLE_MAX_BITS;
+    int retval = rtld_table_alloc(&r->table, table_bits);
+    if (retval < 0)
+        return retval;
+    r->old_table.keys = NULL;
+    r->rehash_idx = 0;
+    r->profile = profile;
+    r->lookups = 0;
+    r->lookup_probes = 0;
+    r->max_probes = 0;
+    retval = rtld_table_alloc(&r->pending, RTLD_PENDING_BITS);
+    if (retval < 0)
+        return retval;
+    r->patch_pending = true;
+    r->track_refs = false;
+    r->pending_patched = 0;
+    r->link_code = NULL;
+    r->link_code_size = 0;
+    r->link_data = NULL;
+    r->link_data_size = 0;
     r->perfmap_fd = -1;
     r->perfdump_fd = -1;
     r->disp_info = disp_info;
+    r->snapshot_dir = -1;
 
-    int retval = plt_create(disp_info, &r->plt);
+    retval = plt_create(disp_info, &r->plt);
     if (retval < 0)
         return retval;
 
@@ -772,30 +1156,292 @@ int
 rtld_resolve(Rtld* r, uintptr_t addr, void** out_entry) {
     if (!addr) // 0 is reserved for "empty"
         return -ENOENT;
-    size_t hash = RTLD_HASH(addr);
-    for (size_t i = 0; i <= RTLD_HASH_MASK; i++) {
-        RtldObject* obj = &r->objects[(hash + i) & RTLD_HASH_MASK];
-        uintptr_t obj_addr = atomic_load_explicit(&obj->addr, memory_order_acquire);
-        if (!obj_addr)
-            break;
-        if (obj_addr == addr) {
-            *out_entry = obj->entry;
-            return 0;
-        }
+    size_t probes = 0;
+    size_t* out_probes = UNLIKELY(r->profile) ? &probes : NULL;
+    size_t idx = rtld_table_find(&r->table, addr, out_probes);
+    const struct RtldTable* t = &r->table;
+    if (!t->keys[idx] && r->old_table.keys) {
+        size_t old_probes = 0;
+        t = &r->old_table;
+        idx = rtld_table_find(t, addr, out_probes ? &old_probes : NULL);
+        probes += old_probes;
     }
-
-    return -ENOENT;
+    if (UNLIKELY(r->profile)) {
+        r->lookups++;
+        r->lookup_probes += probes;
+        if (r->max_probes < probes)
+            r->max_probes = probes;
+    }
+    if (!t->keys[idx])
+        return -ENOENT;
+    *out_entry = t->entries[idx];
+    return 0;
 }
 
 void
-rtld_patch(struct RtldPatchData* patch_data, void* sym) {
+rtld_patch(struct RtldPatchData* patch_data, uintptr_t addr, void* sym) {
     // Ignore relocations failures and cases where nothing is to patch.
     char reloc_buf[8];
     if (!patch_data)
         return;
+    if (!patch_data->sym_addr) {
+        // Only the first miss fills the slot, the entry before the address.
+        struct RtldInlineCache* ic = (struct RtldInlineCache*)
+                (patch_data->patch_addr - offsetof(struct RtldInlineCache, miss));
+        ic->entry = sym;
+        atomic_store_explicit(&ic->addr, addr, memory_order_release);
+        ic->miss = ic->dispatch;
+        return;
+    }
     if (patch_data->rel_size > sizeof reloc_buf)
         return;
     memcpy(reloc_buf, (void*) patch_data->patch_addr, patch_data->rel_size);
     (void) rtld_reloc_at(patch_data, reloc_buf, sym);
     mem_write_code((void*) patch_data->patch_addr, reloc_buf, patch_data->rel_size);
 }
+
+// Snapshots hold the code arena, mapped back to the same address, the entries
+// of the table and the pending lists, whose patch data is in the code arena.
+// Code of this process outside the arena is referenced only through the PLT,
+// which is rewritten after restoring.
+struct RtldSnapshotHdr {
+    uint64_t magic;
+    uint64_t layout; // see rtld_snapshot_layout
+    uint8_t key[RTLD_SNAPSHOT_KEY_SIZE];
+    uint64_t code_addr;
+    uint64_t code_offset; // page-aligned file offset of the code
+    uint64_t code_size; // page-aligned
+    uint64_t code_used;
+    uint64_t entry_count; // entries follow the header
+    uint64_t pending_count; // heads of pending lists follow the entries
+};
+
+struct RtldSnapshotEntry {
+    uint64_t addr;
+    uint64_t entry; // or the first patch data of a pending list
+};
+
+#define RTLD_SNAPSHOT_MAGIC 0x0250414e53574900ull // "\0IWSNAP\2"
+
+// Snapshots of a different client build can't be used.
+static uint64_t
+rtld_snapshot_layout(void) {
+    uint64_t vals[] = {
+        EM_CURRENT, PLT_FUNC_SIZE, PLT_SIZE, sizeof(struct RtldPatchData),
+        sizeof(struct RtldSnapshotHdr),
+    };
+    uint64_t h = instrew_hash(0, vals, sizeof vals);
+    for (size_t i = 0; plt_entries[i].name; i++)
+        h = instrew_hash(h, plt_entries[i].name,
+                               strlen(plt_entries[i].name) + 1);
+    return h;
+}
+
+// Snapshots are named by the key in hex. Temporary files have the pid
+// appended, they are renamed when complete.
+static void
+rtld_snapshot_name(char* buf, size_t buf_size, const uint8_t* key, int pid) {
+    static const char hex[] = "0123456789abcdef";
+    char key_hex[2 * RTLD_SNAPSHOT_KEY_SIZE + 1];
+    for (size_t i = 0; i < RTLD_SNAPSHOT_KEY_SIZE; i++) {
+        key_hex[2 * i] = hex[key[i] >> 4];
+        key_hex[2 * i + 1] = hex[key[i] & 0xf];
+    }
+    key_hex[2 * RTLD_SNAPSHOT_KEY_SIZE] = '\0';
+    if (pid)
+        snprintf(buf, buf_size, "%s.%u.tmp", key_hex, pid);
+    else
+        snprintf(buf, buf_size, "%s", key_hex);
+}
+
+int
+rtld_snapshot_load(Rtld* r, int dir_fd, const uint8_t* key,
+                   uintptr_t guest_start, uintptr_t guest_end) {
+    r->snapshot_dir = dir_fd;
+    r->snapshot_pid = getpid();
+    memcpy(r->snapshot_key, key, RTLD_SNAPSHOT_KEY_SIZE);
+    r->snapshot_guest_start = guest_start;
+    r->snapshot_guest_end = guest_end;
+    char* code = mem_code_used(&r->snapshot_code_used);
+
+    char name[96];
+    rtld_snapshot_name(name, sizeof name, key, 0);
+    int fd = openat(dir_fd, name, O_RDONLY|O_CLOEXEC, 0);
+    if (fd < 0)
+        return 0;
+
+    // Invalid or outdated snapshots are ignored, they are replaced at exit.
+    int retval = 0;
+    struct RtldSnapshotHdr hdr;
+    size_t pagesize = getpagesize();
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    if (file_size < (off_t) sizeof(hdr) || lseek(fd, 0, SEEK_SET) != 0)
+        goto out;
+    if (read_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        goto out;
+    if (hdr.magic != RTLD_SNAPSHOT_MAGIC || hdr.layout != rtld_snapshot_layout() ||
+        memcmp(hdr.key, key, RTLD_SNAPSHOT_KEY_SIZE) ||
+        hdr.code_addr != (uintptr_t) code)
+        goto out;
+    if (hdr.code_offset & (pagesize - 1) || hdr.code_size & (pagesize - 1) ||
+        hdr.code_used > hdr.code_size || hdr.code_size > (uint64_t) file_size ||
+        hdr.code_offset > (uint64_t) file_size - hdr.code_size)
+        goto out;
+    if (hdr.entry_count > (uint64_t) file_size ||
+        hdr.pending_count > (uint64_t) file_size ||
+        sizeof(hdr) + (hdr.entry_count + hdr.pending_count) *
+                      sizeof(struct RtldSnapshotEntry) > hdr.code_offset)
+        goto out;
+
+    void* meta = mmap(NULL, hdr.code_offset, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (BAD_ADDR(meta))
+        goto out;
+    const struct RtldSnapshotEntry* entries =
+            (const void*) ((char*) meta + sizeof(hdr));
+    const struct RtldSnapshotEntry* pending = entries + hdr.entry_count;
+    for (size_t i = 0; i < hdr.entry_count; i++) {
+        if (entries[i].addr < guest_start || entries[i].addr >= guest_end)
+            goto out_unmap;
+        if (entries[i].entry - hdr.code_addr >= hdr.code_used)
+            goto out_unmap;
+    }
+    for (size_t i = 0; i < hdr.pending_count; i++) {
+        uint64_t offset = pending[i].entry - hdr.code_addr;
+        if (!pending[i].addr || offset >= hdr.code_used ||
+            hdr.code_used - offset < sizeof(struct RtldPatchData) ||
+            offset % _Alignof(struct RtldPatchData))
+            goto out_unmap;
+    }
+
+    // From here on, the code arena is replaced, so errors are fatal.
+    retval = mem_map_code(fd, hdr.code_offset, hdr.code_size, hdr.code_used);
+    if (retval < 0)
+        goto out_unmap;
+    if ((retval = plt_write(r->disp_info, r->plt)) < 0)
+        goto out_unmap;
+    for (size_t i = 0; i < hdr.entry_count; i++) {
+        retval = rtld_set(r, entries[i].addr, (void*) entries[i].entry, false);
+        if (retval < 0)
+            goto out_unmap;
+    }
+    // The lists are linked in the restored code arena, only the heads are
+    // needed. Without patching, the lists are never used.
+    for (size_t i = 0; i < hdr.pending_count && r->patch_pending; i++) {
+        if ((retval = rtld_pending_reserve(&r->pending)) < 0)
+            goto out_unmap;
+        size_t idx = rtld_table_find(&r->pending, pending[i].addr, NULL);
+        if (!r->pending.keys[idx])
+            rtld_table_insert(&r->pending, idx, pending[i].addr,
+                              (void*) pending[i].entry);
+    }
+    r->snapshot_code_used = hdr.code_used;
+    retval = 1;
+
+out_unmap:
+    munmap(meta, hdr.code_offset);
+out:
+    close(fd);
+    return retval;
+}
+
+// Write the addresses and entries of all used slots of t.
+static ssize_t
+rtld_snapshot_write_table(int fd, const struct RtldTable* t) {
+    struct RtldSnapshotEntry buf[64];
+    size_t buf_count = 0;
+    ssize_t retval;
+    for (size_t i = 0; i <= t->mask; i++) {
+        uintptr_t addr = atomic_load_explicit(&t->keys[i], memory_order_relaxed);
+        if (!addr || !t->entries[i])
+            continue;
+        buf[buf_count++] = (struct RtldSnapshotEntry) {addr, (uintptr_t) t->entries[i]};
+        if (buf_count == sizeof(buf) / sizeof(buf[0])) {
+            size_t size = buf_count * sizeof(buf[0]);
+            if ((retval = write_full(fd, buf, size)) != (ssize_t) size)
+                return retval < 0 ? retval : -EIO;
+            buf_count = 0;
+        }
+    }
+    if (buf_count) {
+        size_t size = buf_count * sizeof(buf[0]);
+        if ((retval = write_full(fd, buf, size)) != (ssize_t) size)
+            return retval < 0 ? retval : -EIO;
+    }
+    return 0;
+}
+
+int
+rtld_snapshot_save(Rtld* r) {
+    if (r->snapshot_dir < 0 || r->snapshot_pid != getpid())
+        return 0;
+    size_t code_used;
+    char* code = mem_code_used(&code_used);
+    if (code_used == r->snapshot_code_used)
+        return 0; // nothing new
+
+    // All entries are in the current table afterwards.
+    rtld_rehash(r, SIZE_MAX);
+    size_t entry_count = 0;
+    for (size_t i = 0; i <= r->table.mask; i++) {
+        uintptr_t addr = atomic_load_explicit(&r->table.keys[i],
+                                              memory_order_relaxed);
+        if (!addr)
+            continue;
+        // The key doesn't identify the guest code at other addresses.
+        if (addr < r->snapshot_guest_start || addr >= r->snapshot_guest_end)
+            return 0;
+        entry_count++;
+    }
+    size_t pending_count = 0;
+    for (size_t i = 0; i <= r->pending.mask; i++)
+        if (r->pending.keys[i] && r->pending.entries[i])
+            pending_count++;
+
+    size_t pagesize = getpagesize();
+    size_t entries_size = (entry_count + pending_count) * sizeof(struct RtldSnapshotEntry);
+    struct RtldSnapshotHdr hdr = {
+        .magic = RTLD_SNAPSHOT_MAGIC,
+        .layout = rtld_snapshot_layout(),
+        .code_addr = (uintptr_t) code,
+        .code_offset = ALIGN_UP(sizeof(hdr) + entries_size, pagesize),
+        .code_size = ALIGN_UP(code_used, pagesize),
+        .code_used = code_used,
+        .entry_count = entry_count,
+        .pending_count = pending_count,
+    };
+    memcpy(hdr.key, r->snapshot_key, RTLD_SNAPSHOT_KEY_SIZE);
+
+    // Write a new file and rename it, the old one may still be mapped.
+    char tmp_name[96];
+    rtld_snapshot_name(tmp_name, sizeof tmp_name, r->snapshot_key, getpid());
+    int fd = openat(r->snapshot_dir, tmp_name,
+                    O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (fd < 0)
+        return fd;
+
+    ssize_t retval;
+    if ((retval = write_full(fd, &hdr, sizeof(hdr))) != sizeof(hdr))
+        goto err;
+    if ((retval = rtld_snapshot_write_table(fd, &r->table)) < 0)
+        goto err;
+    if ((retval = rtld_snapshot_write_table(fd, &r->pending)) < 0)
+        goto err;
+    if ((retval = lseek(fd, hdr.code_offset, SEEK_SET)) < 0)
+        goto err;
+    if ((retval = write_full(fd, code, hdr.code_size)) != (ssize_t) hdr.code_size)
+        goto err;
+    close(fd);
+
+    char name[96];
+    rtld_snapshot_name(name, sizeof name, r->snapshot_key, 0);
+    retval = syscall(__NR_renameat2, r->snapshot_dir, (uintptr_t) tmp_name,
+                     r->snapshot_dir, (uintptr_t) name, 0, 0);
+    if (retval < 0)
+        syscall(__NR_unlinkat, r->snapshot_dir, (uintptr_t) tmp_name, 0, 0, 0, 0);
+    return retval;
+
+err:
+    close(fd);
+    syscall(__NR_unlinkat, r->snapshot_dir, (uintptr_t) tmp_name, 0, 0, 0, 0);
+    return retval < 0 ? retval : -EIO;
+}
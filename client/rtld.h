@@ -5,37 +5,122 @@
 #include <common.h>
 #include <dispatcher-info.h>
 
-typedef struct RtldObject RtldObject;
+// Open-addressing table of entries by guest address. Keys are separate from
+// entries, so that probing only touches keys; a key of 0 marks a free slot.
+struct RtldTable {
+    _Atomic uintptr_t* keys;
+    void** entries;
+    size_t mask;
+    unsigned shift; // 64 - log2(size), for the multiplicative hash
+    size_t count;
+};
+
+// Size of snapshot keys, see rtld_snapshot_load.
+#define RTLD_SNAPSHOT_KEY_SIZE 32
+
 struct Rtld {
     int perfmap_fd;
     int perfdump_fd;
     const struct DispatcherInfo* disp_info;
 
-    RtldObject* objects;
-    size_t objects_idx;
-    size_t objects_cap;
+    // When table is full, it is replaced by a larger one and the entries of
+    // old_table are moved over a few at a time while adding entries; lookups
+    // fall back to old_table meanwhile.
+    struct RtldTable table;
+    struct RtldTable old_table; // keys is NULL if not used
+    size_t rehash_idx;
+    // Lookup statistics, only collected when profiling.
+    bool profile;
+    uint64_t lookups;
+    uint64_t lookup_probes;
+    uint64_t max_probes;
+
+    // Patch stubs by guest address, as linked list of their patch data, so
+    // that all references are patched when the address is added. Entries of
+    // added addresses are cleared, but their keys remain until growing. With
+    // track_refs, lists are kept and also get references that were resolved
+    // directly, so that all of them are patched again when the entry is
+    // replaced.
+    struct RtldTable pending;
+    bool patch_pending; // cleared for complete traces
+    bool track_refs;
+    uint64_t pending_patched;
 
     void* plt;
 
+    // Memory for objects linked by the server, see rtld_link_info.
+    void* link_code;
+    size_t link_code_size;
+    void* link_data;
+    size_t link_data_size;
+
     void* server_funcs[16];
+
+    // Snapshot of the code, see rtld_snapshot_load; snapshot_dir is -1 if
+    // snapshots are disabled.
+    int snapshot_dir;
+    int snapshot_pid;
+    uint8_t snapshot_key[RTLD_SNAPSHOT_KEY_SIZE];
+    uintptr_t snapshot_guest_start;
+    uintptr_t snapshot_guest_end;
+    size_t snapshot_code_used;
 };
 typedef struct Rtld Rtld;
 
 struct RtldPatchData {
-    uint64_t sym_addr;
+    uint64_t sym_addr; // zero for the miss pointer of an inline cache
     unsigned rel_type;
     unsigned rel_size;
     int64_t addend;
     uintptr_t patch_addr;
+    // Next stub for the same sym_addr that is still to be patched.
+    struct RtldPatchData* next_pending;
+};
+
+// Slot of an indirect jump or call in translated code with -inline-caches.
+// The code jumps to entry if the target matches addr, otherwise to miss. miss
+// initially is a patch stub, which fills the slot and replaces miss with the
+// dispatcher, so that further misses don't go through a full resolve.
+struct RtldInlineCache {
+    _Atomic uintptr_t addr;
+    void* entry;
+    void* miss;
+    void* dispatch;
 };
 
-int rtld_init(Rtld* r, const struct DispatcherInfo* disp_info);
+int rtld_init(Rtld* r, const struct DispatcherInfo* disp_info, unsigned table_bits,
+              bool profile);
 /// Init perf support, modes: 0=none, 1=map, 2=map+jitdump
 int rtld_perf_init(Rtld* r, int mode);
 int rtld_resolve(Rtld* r, uintptr_t addr, void** out_entry);
 
+/// Reserve memory for objects linked by the server and describe it together
+/// with the PLT in buf (see InstrewLinkInfo). Returns the size used in buf.
+int rtld_link_info(Rtld* r, void* buf, size_t buf_size);
+
+/// Add an ELF object or an object linked by the server.
 int rtld_add_object(Rtld* r, void* obj_base, size_t obj_size, uint64_t skew);
+/// Whether the object was linked by the server. The server links later objects
+/// against its code, so it must be added even if its entries are known.
+bool rtld_object_linked(const void* obj_base, size_t obj_size);
+/// Like rtld_add_object, but functions replace existing entries. References
+/// are patched to the new code with track_refs; old entries are redirected to
+/// it for all others, e.g. inline caches and code still running.
+int rtld_replace_object(Rtld* r, void* obj_base, size_t obj_size, uint64_t skew);
+
+/// Patch the reference which led to resolving addr to sym, if any.
+void rtld_patch(struct RtldPatchData* patch_data, uintptr_t addr, void* sym);
 
-void rtld_patch(struct RtldPatchData* patch_data, void* sym);
+/// Restore code, entries and pending references from the snapshot named by
+/// key in dir_fd, if any, and save the snapshot there with rtld_snapshot_save.
+/// The key must identify the guest code in [guest_start, guest_end); entries
+/// outside of this range prevent saving. Must be called before any object is
+/// added. Returns 1 if a snapshot was restored, 0 if not; invalid snapshots
+/// are ignored.
+int rtld_snapshot_load(Rtld* r, int dir_fd, const uint8_t* key,
+                       uintptr_t guest_start, uintptr_t guest_end);
+/// Save the code and entries for the next run, if anything was added since
+/// rtld_snapshot_load and only in the process that called it.
+int rtld_snapshot_save(Rtld* r);
 
 #endif
@@ -6,6 +6,8 @@
 #include <rtld.h>
 #include <translator.h>
 
+#include "instrew-shadow-stack.h"
+
 #include <asm/siginfo.h>
 #include <asm/signal.h>
 
@@ -22,31 +24,58 @@ struct State {
     struct TranslatorConfig tc;
 };
 
-#define QUICK_TLB_BITS 10
+// The quick TLB caches recent dispatch targets. It has a power of two number
+// of sets, selected at startup up to the maximum, of QUICK_TLB_WAYS pairs of
+// guest address and entry each. It is at the end of the CpuState, which is
+// allocated with CPU_STATE_SIZE for the selected number of sets. Sets are
+// indexed by the address bits from QUICK_TLB_BITOFF on; the set mask is kept
+// in the CpuState for the dispatchers.
+// Unlike the number of sets, QUICK_TLB_BITOFF is fixed at build time: the
+// dispatchers fold the shift into the index scale of their memory operands,
+// which is an immediate, and a variable shift would cost an instruction on
+// every indirect jump.
+#define QUICK_TLB_MAX_BITS 12
+#define QUICK_TLB_DEFAULT_BITS 9
+#define QUICK_TLB_WAYS 2
+#define QUICK_TLB_BITOFF 4 // must be either 2, 3, or 4
 
 struct CpuState {
     struct CpuState* self;
     struct State* state;
-    uintptr_t _unused[6];
+    uintptr_t quick_tlb_mask; // (sets - 1) << QUICK_TLB_BITOFF
+    uintptr_t _unused[5];
 
     _Alignas(64) uint8_t regdata[0x400];
 
-    _Alignas(64) uint64_t quick_tlb[1 << QUICK_TLB_BITS][2];
+    // Accessed by translated code, see instrew-shadow-stack.h.
+    _Alignas(64) struct InstrewShadowStack shadow_stack;
 
     _Atomic volatile int sigpending;
     sigset_t sigmask;
     stack_t sigaltstack;
     struct siginfo siginfo;
+
+    _Alignas(64) uint64_t quick_tlb[][2 * QUICK_TLB_WAYS];
 };
 
+#define CPU_STATE_SIZE(quick_tlb_bits) (sizeof(struct CpuState) + \
+        ((size_t) 1 << (quick_tlb_bits)) * 16 * QUICK_TLB_WAYS)
+
+#define CPU_STATE_QTLB_MASK_OFFSET 0x10
+_Static_assert(offsetof(struct CpuState, quick_tlb_mask) == CPU_STATE_QTLB_MASK_OFFSET,
+               "CPU_STATE_QTLB_MASK_OFFSET mismatch");
+
 #define CPU_STATE_REGDATA_OFFSET 0x40
 _Static_assert(offsetof(struct CpuState, regdata) == CPU_STATE_REGDATA_OFFSET,
                "CPU_STATE_REGDATA_OFFSET mismatch");
 
-#define CPU_STATE_QTLB_OFFSET 0x440
+#define CPU_STATE_QTLB_OFFSET 0x940
 _Static_assert(offsetof(struct CpuState, quick_tlb) == CPU_STATE_QTLB_OFFSET,
                "CPU_STATE_QTLB_OFFSET mismatch");
 
+_Static_assert(offsetof(struct CpuState, shadow_stack) - CPU_STATE_REGDATA_OFFSET ==
+               INSTREW_SHADOW_STACK_OFFSET, "INSTREW_SHADOW_STACK_OFFSET mismatch");
+
 #define CPU_STATE_FROM_REGS(regdata) ((struct CpuState*) \
                                    ((char*) regdata - CPU_STATE_REGDATA_OFFSET))
 
@@ -2,13 +2,17 @@
 #include <common.h>
 #include <asm/signal.h>
 #include <linux/fcntl.h>
+#include <linux/fs.h>
 #include <linux/mman.h>
+#include <linux/prctl.h>
 #include <linux/sched.h>
 
 #include <translator.h>
 
 #include <memory.h>
 
+#include "instrew-index.h"
+
 
 enum MsgId {
 #define INSTREW_MESSAGE_ID(id, name) MSGID_ ## name = id,
@@ -39,25 +43,120 @@ static int32_t translator_hdr_recv(Translator* t, uint32_t id) {
     return sz;
 }
 
+static int translator_recv_fd(Translator* t) {
+    int32_t sz = translator_hdr_recv(t, MSGID_S_FD);
+    if (sz != 4)
+        return sz < 0 ? sz : -EPROTO;
+
+    int ret;
+    int error;
+    struct iovec iov = {&error, sizeof(error)};
+    struct fd_cmsg {
+        size_t cmsg_len;
+        int cmsg_level;
+        int cmsg_type;
+        int fd;
+    } cmsg;
+    size_t cmsg_len = offsetof(struct fd_cmsg, fd) + sizeof(int);
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = &cmsg,
+        .msg_controllen = cmsg_len,
+    };
+    if ((ret = recvmsg(t->socket, &msg, MSG_CMSG_CLOEXEC)) != sizeof(error))
+        return ret < 0 ? ret : -EPROTO;
+    if (error != 0)
+        return error;
+    if (cmsg.cmsg_type != SCM_RIGHTS || cmsg.cmsg_len != cmsg_len)
+        return -EPROTO;
+
+    return cmsg.fd;
+}
+
+// Map the shared memory for objects sent by the server. If the server
+// declined, objects are sent over the socket.
+static int translator_recv_shm(Translator* t) {
+    int fd = translator_recv_fd(t);
+    if (fd < 0) {
+        t->shm_base = NULL;
+        t->shm_size = 0;
+        return fd == -EOPNOTSUPP ? 0 : fd;
+    }
+
+    int ret;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < 0) {
+        ret = size;
+        goto out;
+    }
+    void* mem;
+    if (t->shm_base) // after fork, replace the mapping shared with the parent
+        mem = mmap(t->shm_base, size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_FIXED, fd, 0);
+    else
+        mem = mem_map_shared(fd, size);
+    if (BAD_ADDR(mem)) {
+        ret = (int) (uintptr_t) mem;
+        goto out;
+    }
+    t->shm_base = mem;
+    t->shm_size = size;
+    ret = 0;
+out:
+    close(fd);
+    return ret;
+}
+
+// Allow the server (and its forks) to read our memory directly, instead of
+// sending memory requests. Without Yama, this is permitted anyway.
+static int translator_enable_direct_mem(Translator* t) {
+    if (t->server_pid)
+        syscall(__NR_prctl, PR_SET_PTRACER, t->server_pid, 0, 0, 0, 0);
+
+    int ret;
+    int32_t pid = getpid();
+    if ((ret = translator_hdr_send(t, MSGID_C_MEMPID, sizeof(pid))) != 0)
+        return ret;
+    if ((ret = write_full(t->socket, &pid, sizeof(pid))) != sizeof(pid))
+        return ret;
+    return 0;
+}
+
 int translator_init(Translator* t, const char* server_config,
                     const struct TranslatorServerConfig* tsc) {
+    // Format: <socket>[:<server pid>]
     int socket = 0;
-    for (size_t i = 0; server_config[i]; i++)
+    size_t i;
+    for (i = 0; server_config[i] && server_config[i] != ':'; i++)
         socket = socket * 10 + server_config[i] - '0';
     t->socket = socket;
+    t->server_pid = 0;
+    if (server_config[i] == ':')
+        for (i++; server_config[i]; i++)
+            t->server_pid = t->server_pid * 10 + server_config[i] - '0';
 
     t->written_bytes = 0;
     t->last_hdr = (TranslatorMsgHdr) {MSGID_UNKNOWN, 0};
     t->recvbuf = NULL;
     t->recvbuf_sz = 0;
+    t->shm_base = NULL;
+    t->shm_size = 0;
+    t->spec_handler = NULL;
+    t->spec_handler_arg = NULL;
+    t->index_base = NULL;
+    t->index_size = 0;
 
     int ret;
     if ((ret = translator_hdr_send(t, MSGID_C_INIT, sizeof *tsc)))
         return ret;
     if ((ret = write_full(t->socket, tsc, sizeof *tsc)) != sizeof *tsc)
         return ret;
+    if (tsc->tsc_server_mode & TRANSLATOR_SERVER_MODE_SHM)
+        if ((ret = translator_recv_shm(t)) < 0)
+            return ret;
 
-    return 0;
+    return translator_enable_direct_mem(t);
 }
 
 int translator_fini(Translator* t) {
@@ -77,11 +176,13 @@ int translator_config_fetch(Translator* t, struct TranslatorConfig* cfg) {
     return 0;
 }
 
-int translator_get_object(Translator* t, void** out_obj, size_t* out_obj_size) {
-    int32_t sz = translator_hdr_recv(t, MSGID_S_OBJECT);
-    if (sz < 0)
-        return sz;
+void translator_set_spec_handler(Translator* t, TranslatorSpecHandler handler,
+                                 void* arg) {
+    t->spec_handler = handler;
+    t->spec_handler_arg = arg;
+}
 
+static int translator_recv_buf(Translator* t, int32_t sz) {
     if ((uint32_t) sz >= t->recvbuf_sz) {
         // TODO: free old buffer
         // int ret = mem_free(t->recvbuf);
@@ -95,6 +196,50 @@ int translator_get_object(Translator* t, void** out_obj, size_t* out_obj_size) {
     }
     int ret = read_full(t->socket, t->recvbuf, sz);
     if (ret != (ssize_t) sz)
+        return ret < 0 ? ret : -EPROTO;
+    return 0;
+}
+
+// Objects in shared memory are used in place; they remain valid until the
+// next message is sent to the server.
+static int translator_get_shm(Translator* t, size_t num, uint64_t* out_vals,
+                              void** out_obj) {
+    size_t msgsz = num * sizeof(uint64_t);
+    int ret = read_full(t->socket, out_vals, msgsz);
+    if (ret != (ssize_t) msgsz)
+        return ret < 0 ? ret : -EPROTO;
+    uint64_t offset = out_vals[num - 2];
+    uint64_t size = out_vals[num - 1];
+    if (offset > t->shm_size || size > t->shm_size - offset)
+        return -EPROTO;
+    *out_obj = (char*) t->shm_base + offset;
+    return 0;
+}
+
+static int translator_get_shmobj(Translator* t, void** out_obj,
+                                 size_t* out_obj_size) {
+    uint64_t vals[2]; // offset, size
+    int32_t sz = translator_hdr_recv(t, MSGID_S_SHMOBJ);
+    if (sz < 0)
+        return sz;
+    if (sz != sizeof(vals))
+        return -EPROTO;
+    int ret = translator_get_shm(t, 2, vals, out_obj);
+    if (ret < 0)
+        return ret;
+    *out_obj_size = vals[1];
+    return 0;
+}
+
+int translator_get_object(Translator* t, void** out_obj, size_t* out_obj_size) {
+    int32_t sz = translator_hdr_recv(t, MSGID_S_OBJECT);
+    if (sz == -EPROTO && t->last_hdr.id == MSGID_S_SHMOBJ)
+        return translator_get_shmobj(t, out_obj, out_obj_size);
+    if (sz < 0)
+        return sz;
+
+    int ret = translator_recv_buf(t, sz);
+    if (ret < 0)
         return ret;
 
     *out_obj = t->recvbuf;
@@ -103,18 +248,68 @@ int translator_get_object(Translator* t, void** out_obj, size_t* out_obj_size) {
     return 0;
 }
 
-int translator_get(Translator* t, uintptr_t addr, void** out_obj,
-                   size_t* out_obj_size) {
-    int ret;
-    if ((ret = translator_hdr_send(t, MSGID_C_TRANSLATE, 8)) != 0)
+// Speculative objects are optional: if one can't be added, the client
+// requests the code again when it is needed, so only warn.
+static void translator_spec_object(Translator* t, uintptr_t addr, void* obj,
+                                   size_t obj_size) {
+    if (!t->spec_handler)
+        return;
+    int ret = t->spec_handler(t->spec_handler_arg, addr, obj, obj_size);
+    if (ret < 0)
+        dprintf(2, "warning: dropping speculative object for %lx: %u\n", addr, -ret);
+}
+
+static int translator_get_specobj(Translator* t) {
+    int32_t sz = translator_hdr_recv(t, MSGID_S_SPECOBJ);
+    if (sz < 0)
+        return sz;
+
+    uint64_t addr;
+    if (sz < (int32_t) sizeof(addr))
+        return -EPROTO;
+    int ret = read_full(t->socket, &addr, sizeof(addr));
+    if (ret != sizeof(addr))
+        return ret < 0 ? ret : -EPROTO;
+    sz -= sizeof(addr);
+    if ((ret = translator_recv_buf(t, sz)) < 0)
         return ret;
-    if ((ret = write_full(t->socket, &addr, sizeof(addr))) != sizeof(addr))
+
+    translator_spec_object(t, addr, t->recvbuf, sz);
+    return 0;
+}
+
+static int translator_get_shmspecobj(Translator* t) {
+    uint64_t vals[3]; // address, offset, size
+    int32_t sz = translator_hdr_recv(t, MSGID_S_SHMSPECOBJ);
+    if (sz < 0)
+        return sz;
+    if (sz != sizeof(vals))
+        return -EPROTO;
+    void* obj;
+    int ret = translator_get_shm(t, 3, vals, &obj);
+    if (ret < 0)
         return ret;
 
+    translator_spec_object(t, vals[0], obj, vals[2]);
+    return 0;
+}
+
+// Serve memory requests and take speculative objects until the response to
+// the last request arrives, which is left for translator_hdr_recv.
+static int translator_serve(Translator* t) {
+    int ret;
     while (true) {
         int32_t sz = translator_hdr_recv(t, MSGID_S_MEMREQ);
-        if (sz == -EPROTO) {
-            return translator_get_object(t, out_obj, out_obj_size);
+        if (sz == -EPROTO && t->last_hdr.id == MSGID_S_SPECOBJ) {
+            if ((ret = translator_get_specobj(t)) < 0)
+                return ret;
+            continue;
+        } else if (sz == -EPROTO && t->last_hdr.id == MSGID_S_SHMSPECOBJ) {
+            if ((ret = translator_get_shmspecobj(t)) < 0)
+                return ret;
+            continue;
+        } else if (sz == -EPROTO) {
+            return 0;
         } else if (sz < 0) {
             return sz;
         }
@@ -153,44 +348,206 @@ int translator_get(Translator* t, uintptr_t addr, void** out_obj,
     }
 }
 
-int
-translator_fork_prepare(Translator* t) {
+static int translator_request(Translator* t, uint32_t msgid, uintptr_t addr,
+                              void** out_obj, size_t* out_obj_size) {
     int ret;
-    if ((ret = translator_hdr_send(t, MSGID_C_FORK, 0)))
+    if ((ret = translator_hdr_send(t, msgid, 8)) != 0)
+        return ret;
+    if ((ret = write_full(t->socket, &addr, sizeof(addr))) != sizeof(addr))
+        return ret;
+    if ((ret = translator_serve(t)) < 0)
         return ret;
+    return translator_get_object(t, out_obj, out_obj_size);
+}
 
-    int32_t sz = translator_hdr_recv(t, MSGID_S_FD);
-    if (sz != 4)
-        return sz < 0 ? sz : -EPROTO;
+int translator_load_index(Translator* t) {
+    int fd = translator_recv_fd(t);
+    if (fd < 0) // no index for this binary yet
+        return fd == -ENOENT || fd == -EOPNOTSUPP ? 0 : fd;
 
-    int error;
-    struct iovec iov = {&error, sizeof(error)};
-    struct fd_cmsg {
-        size_t cmsg_len;
-        int cmsg_level;
-        int cmsg_type;
-        int fd;
-    } cmsg;
-    size_t cmsg_len = offsetof(struct fd_cmsg, fd) + sizeof(int);
-    struct msghdr msg = {
-        .msg_iov = &iov,
-        .msg_iovlen = 1,
-        .msg_control = &cmsg,
-        .msg_controllen = cmsg_len,
-    };
-    if ((ret = recvmsg(t->socket, &msg, MSG_CMSG_CLOEXEC)) != sizeof(error))
-        return ret < 0 ? ret : -EPROTO;
-    if (error != 0)
-        return error;
-    if (cmsg.cmsg_type != SCM_RIGHTS || cmsg.cmsg_len != cmsg_len)
+    int ret;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t) sizeof(struct InstrewIndexHdr)) {
+        ret = size < 0 ? size : 0;
+        goto out;
+    }
+    // Private and writable, the runtime linker modifies objects in place.
+    void* mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (BAD_ADDR(mem)) {
+        ret = (int) (uintptr_t) mem;
+        goto out;
+    }
+
+    const struct InstrewIndexHdr* hdr = mem;
+    size_t tables_size = sizeof(*hdr) +
+                         (size_t) hdr->entry_count * sizeof(struct InstrewIndexEntry);
+    if (hdr->magic != INSTREW_INDEX_MAGIC || hdr->file_size != (uint64_t) size ||
+        hdr->range_count > (uint64_t) size ||
+        tables_size + hdr->range_count * sizeof(struct InstrewIndexRange) > (uint64_t) size) {
+        munmap(mem, size);
+        ret = 0;
+        goto out;
+    }
+    t->index_base = mem;
+    t->index_size = size;
+    ret = 0;
+out:
+    close(fd);
+    return ret;
+}
+
+// Compare the code in [start, end) with code. The code of an entry may belong
+// to a different mapping than the one at its address now, which may be
+// unreadable, so it is read with process_vm_readv, which fails instead of
+// faulting. Returns false if the range isn't readable or differs.
+static bool translator_index_compare(uintptr_t start, uintptr_t end,
+                                     const uint8_t* code) {
+    uint8_t buf[1024];
+    int pid = getpid();
+    while (start < end) {
+        size_t size = end - start < sizeof(buf) ? end - start : sizeof(buf);
+        struct iovec local = {buf, size};
+        struct iovec remote = {(void*) start, size};
+        long ret = syscall(__NR_process_vm_readv, pid, (uintptr_t) &local, 1,
+                           (uintptr_t) &remote, 1, 0);
+        if (ret != (long) size || memcmp(buf, code, size))
+            return false;
+        start += size;
+        code += size;
+    }
+    return true;
+}
+
+// Find an object for addr in the index, if the code it was translated from is
+// unchanged. Each object is used only once, as linking modifies it.
+static bool translator_index_get(Translator* t, uintptr_t addr, void** out_obj,
+                                 size_t* out_obj_size) {
+    const struct InstrewIndexHdr* hdr = t->index_base;
+    struct InstrewIndexEntry* entries = (struct InstrewIndexEntry*) (hdr + 1);
+    const struct InstrewIndexRange* ranges =
+            (const struct InstrewIndexRange*) (entries + hdr->entry_count);
+
+    size_t lo = 0, hi = hdr->entry_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].addr < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == hdr->entry_count || entries[lo].addr != addr)
+        return false;
+
+    struct InstrewIndexEntry* entry = &entries[lo];
+    if (!entry->obj_size || entry->range_idx > hdr->range_count ||
+        entry->range_count > hdr->range_count - entry->range_idx ||
+        entry->code_offset > t->index_size ||
+        entry->obj_offset > t->index_size ||
+        entry->obj_size > t->index_size - entry->obj_offset)
+        return false;
+
+    const uint8_t* code = (const uint8_t*) t->index_base + entry->code_offset;
+    size_t code_left = t->index_size - entry->code_offset;
+    for (size_t i = 0; i < entry->range_count; i++) {
+        const struct InstrewIndexRange* range = &ranges[entry->range_idx + i];
+        if (range->end < range->start || range->end - range->start > code_left)
+            return false;
+        if (!translator_index_compare(range->start, range->end, code))
+            return false;
+        code += range->end - range->start;
+        code_left -= range->end - range->start;
+    }
+
+    *out_obj = (char*) t->index_base + entry->obj_offset;
+    *out_obj_size = entry->obj_size;
+    entry->obj_size = 0;
+    return true;
+}
+
+int translator_get(Translator* t, uintptr_t addr, void** out_obj,
+                   size_t* out_obj_size) {
+    if (t->index_base && translator_index_get(t, addr, out_obj, out_obj_size))
+        return 0;
+    return translator_request(t, MSGID_C_TRANSLATE, addr, out_obj, out_obj_size);
+}
+
+int translator_tier_up(Translator* t, uintptr_t addr, void** out_obj,
+                       size_t* out_obj_size) {
+    return translator_request(t, MSGID_C_TIERUP, addr, out_obj, out_obj_size);
+}
+
+int translator_send_profile(Translator* t, uintptr_t addr,
+                            const uint64_t* counts, size_t count) {
+    int ret;
+    size_t size = count * sizeof(*counts);
+    if (size > INT32_MAX - sizeof(addr))
+        return -EINVAL;
+    if ((ret = translator_hdr_send(t, MSGID_C_PROFILE, sizeof(addr) + size)) != 0)
+        return ret;
+    if ((ret = write_full(t->socket, &addr, sizeof(addr))) != sizeof(addr))
+        return ret;
+    if ((ret = write_full(t->socket, counts, size)) != (ssize_t) size)
+        return ret;
+    return 0;
+}
+
+int translator_send_link_info(Translator* t, const void* info, size_t size) {
+    int ret;
+    if (size > INT32_MAX)
+        return -EINVAL;
+    if ((ret = translator_hdr_send(t, MSGID_C_LINKINFO, size)) != 0)
+        return ret;
+    if ((ret = write_full(t->socket, info, size)) != (ssize_t) size)
+        return ret;
+    return 0;
+}
+
+int translator_get_snapshot_dir(Translator* t) {
+    return translator_recv_fd(t);
+}
+
+int translator_snapshot_key(Translator* t, const uint64_t* ranges,
+                            size_t range_count, uint8_t* key, size_t key_size) {
+    int ret;
+    size_t size = range_count * 2 * sizeof(*ranges);
+    if (size > INT32_MAX)
+        return -EINVAL;
+    if ((ret = translator_hdr_send(t, MSGID_C_SNAPSHOT, size)) != 0)
+        return ret;
+    if ((ret = write_full(t->socket, ranges, size)) != (ssize_t) size)
+        return ret;
+    if ((ret = translator_serve(t)) < 0)
+        return ret;
+
+    int32_t sz = translator_hdr_recv(t, MSGID_S_SNAPSHOT);
+    if (sz <= 0) // empty if the server couldn't read the code
+        return sz;
+    if ((size_t) sz != key_size)
         return -EPROTO;
+    if ((ret = read_full(t->socket, key, key_size)) != (ssize_t) key_size)
+        return ret < 0 ? ret : -EPROTO;
+    return 1;
+}
 
-    return cmsg.fd;
+int
+translator_fork_prepare(Translator* t) {
+    int ret;
+    if ((ret = translator_hdr_send(t, MSGID_C_FORK, 0)))
+        return ret;
+    return translator_recv_fd(t);
 }
 
 int
 translator_fork_finalize(Translator* t, int fork_fd) {
     close(t->socket); // Forked process should not use parent translator.
     t->socket = fork_fd;
-    return 0;
+    // The forked server sends new shared memory, the old one is still used by
+    // our parent.
+    if (t->shm_base) {
+        int ret = translator_recv_shm(t);
+        if (ret < 0)
+            return ret;
+    }
+    // Ptracer permissions are not inherited, and the server doesn't know us.
+    return translator_enable_direct_mem(t);
 }
@@ -14,20 +14,40 @@ struct TranslatorServerConfig {
 #undef INSTREW_SERVER_CONF_INT32
 };
 
+// Request shared memory for objects, see instrew-protocol.inc.
+#define TRANSLATOR_SERVER_MODE_SHM 2
+
 typedef struct TranslatorMsgHdr TranslatorMsgHdr;
 struct TranslatorMsgHdr {
     uint32_t id;
     int32_t sz;
 };
 
+// Handler for objects the server translated ahead of demand.
+typedef int (* TranslatorSpecHandler)(void* arg, uintptr_t addr, void* obj,
+                                      size_t obj_size);
+
 struct Translator {
     int socket;
+    int server_pid;
 
     size_t written_bytes;
     TranslatorMsgHdr last_hdr;
 
     void* recvbuf;
     size_t recvbuf_sz;
+
+    // Objects are placed here by the server, if negotiated at init.
+    void* shm_base;
+    size_t shm_size;
+
+    TranslatorSpecHandler spec_handler;
+    void* spec_handler_arg;
+
+    // Objects of earlier runs, used without asking the server; see
+    // instrew-index.h.
+    void* index_base;
+    size_t index_size;
 };
 
 typedef struct Translator Translator;
@@ -38,6 +58,29 @@ int translator_fini(Translator* t);
 int translator_get_object(Translator* t, void** out_obj, size_t* out_obj_size);
 int translator_get(Translator* t, uintptr_t addr, void** out_obj,
                    size_t* out_obj_size);
+// Request recompilation of hot code at the highest tier.
+int translator_tier_up(Translator* t, uintptr_t addr, void** out_obj,
+                       size_t* out_obj_size);
+// Send execution counters of tier-0 code at addr, used by the next tier-up.
+int translator_send_profile(Translator* t, uintptr_t addr,
+                            const uint64_t* counts, size_t count);
+// Announce memory and PLT for objects linked by the server, see instrew-link.h.
+int translator_send_link_info(Translator* t, const void* info, size_t size);
+// Receive the directory for code snapshots, sent after the initial object if
+// tc_snapshot is set.
+int translator_get_snapshot_dir(Translator* t);
+// Ask the server for the key of a snapshot of the guest code in ranges (start
+// and end of each), which covers the code and the configuration. Returns 1 if
+// key was filled, 0 if the server couldn't read the code. The server sends no
+// objects in between, so earlier ones stay valid.
+int translator_snapshot_key(Translator* t, const uint64_t* ranges,
+                            size_t range_count, uint8_t* key, size_t key_size);
+// Receive and map the index of objects for the binary, sent after the snapshot
+// directory if tc_client_index is set. translator_get uses it from now on.
+int translator_load_index(Translator* t);
+// Speculative objects can arrive while waiting for any other object.
+void translator_set_spec_handler(Translator* t, TranslatorSpecHandler handler,
+                                 void* arg);
 
 struct TranslatorConfig {
 #define INSTREW_CLIENT_CONF
@@ -0,0 +1,510 @@
+
+#include "cache.h"
+#include "config.h"
+#include "connection.h"
+#include "version.h"
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <elf.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+
+// Ahead-of-time translation: translate the functions of a guest binary with
+// the same rewriting code as the server and store the objects in the cache,
+// under the keys the server computes for them at run time.
+
+namespace {
+
+llvm::cl::OptionCategory AotCategory("Instrew AOT Options");
+
+llvm::cl::opt<std::string> guestBinary(llvm::cl::Positional, llvm::cl::Required,
+        llvm::cl::desc("<guest binary>"), llvm::cl::cat(AotCategory));
+llvm::cl::opt<unsigned> numJobs("jobs", llvm::cl::desc("Number of translation threads (default: number of CPUs)"),
+        llvm::cl::init(0), llvm::cl::cat(AotCategory));
+llvm::cl::opt<bool> aotVerbose("aot-verbose", llvm::cl::desc("Print each translated function"),
+        llvm::cl::cat(AotCategory));
+
+/// The loadable segments of the guest binary, as the client maps them.
+class GuestImage {
+public:
+    bool Load(const std::string& path);
+
+    size_t Read(uint64_t start, uint64_t end, uint8_t* buf) const;
+    bool IsCode(uint64_t addr) const;
+
+    uint16_t Machine() const { return machine; }
+    uint16_t Type() const { return type; }
+    const std::vector<uint8_t>& BuildId() const { return build_id; }
+    /// File offset of addr, which the server uses for relocatable images.
+    bool FileOffset(uint64_t addr, uint64_t& offset) const;
+    const std::vector<uint64_t>& Entries() const { return entries; }
+
+private:
+    struct Segment {
+        uint64_t vaddr;
+        uint64_t offset;
+        std::vector<uint8_t> data; // p_memsz bytes
+        bool exec;
+    };
+
+    const Segment* FindSegment(uint64_t addr) const;
+    void AddEntry(uint64_t addr);
+    void ReadBuildId(const Elf64_Phdr& note);
+    void CollectSymbols(const Elf64_Shdr& symtab);
+    void CollectEhFrame(const Elf64_Shdr& eh_frame);
+    bool DecodePointer(uint8_t enc, const uint8_t*& ptr, const uint8_t* end,
+                       uint64_t pc, uint64_t& val) const;
+
+    std::vector<char> file;
+    uint16_t machine = 0;
+    uint16_t type = 0;
+    std::vector<Segment> segments;
+    std::vector<uint64_t> entries;
+    std::vector<uint8_t> build_id;
+};
+
+bool GuestImage::Load(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+    file.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+    if (file.size() < sizeof(Elf64_Ehdr))
+        return false;
+    Elf64_Ehdr ehdr;
+    std::memcpy(&ehdr, file.data(), sizeof(ehdr));
+    if (std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG) || ehdr.e_ident[EI_CLASS] != ELFCLASS64)
+        return false;
+    if (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN)
+        return false;
+    machine = ehdr.e_machine;
+    type = ehdr.e_type;
+
+    if (ehdr.e_phoff + uint64_t{ehdr.e_phnum} * sizeof(Elf64_Phdr) > file.size())
+        return false;
+    for (unsigned i = 0; i < ehdr.e_phnum; i++) {
+        Elf64_Phdr phdr;
+        std::memcpy(&phdr, file.data() + ehdr.e_phoff + i * sizeof(phdr), sizeof(phdr));
+        if (phdr.p_type == PT_NOTE)
+            ReadBuildId(phdr);
+        if (phdr.p_type != PT_LOAD)
+            continue;
+        if (phdr.p_filesz > phdr.p_memsz || phdr.p_offset + phdr.p_filesz > file.size())
+            return false;
+        Segment seg{phdr.p_vaddr, phdr.p_offset, std::vector<uint8_t>(phdr.p_memsz),
+                    (phdr.p_flags & PF_X) != 0};
+        std::memcpy(seg.data.data(), file.data() + phdr.p_offset, phdr.p_filesz);
+        segments.push_back(std::move(seg));
+    }
+
+    AddEntry(ehdr.e_entry);
+
+    if (ehdr.e_shoff + uint64_t{ehdr.e_shnum} * sizeof(Elf64_Shdr) > file.size())
+        return true; // no section headers, only the entry point is known
+    std::vector<Elf64_Shdr> shdrs(ehdr.e_shnum);
+    std::memcpy(shdrs.data(), file.data() + ehdr.e_shoff, shdrs.size() * sizeof(Elf64_Shdr));
+    const char* shstrtab = nullptr;
+    if (ehdr.e_shstrndx < shdrs.size() &&
+        shdrs[ehdr.e_shstrndx].sh_offset + shdrs[ehdr.e_shstrndx].sh_size <= file.size())
+        shstrtab = file.data() + shdrs[ehdr.e_shstrndx].sh_offset;
+    for (const Elf64_Shdr& shdr : shdrs) {
+        if (shdr.sh_type == SHT_NOBITS || shdr.sh_offset + shdr.sh_size > file.size())
+            continue;
+        if (shdr.sh_type == SHT_SYMTAB || shdr.sh_type == SHT_DYNSYM)
+            CollectSymbols(shdr);
+        else if (shstrtab && shdr.sh_name < shdrs[ehdr.e_shstrndx].sh_size &&
+                 !std::strcmp(shstrtab + shdr.sh_name, ".eh_frame"))
+            CollectEhFrame(shdr);
+    }
+
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+    return true;
+}
+
+const GuestImage::Segment* GuestImage::FindSegment(uint64_t addr) const {
+    for (const Segment& seg : segments)
+        if (addr >= seg.vaddr && addr - seg.vaddr < seg.data.size())
+            return &seg;
+    return nullptr;
+}
+
+size_t GuestImage::Read(uint64_t start, uint64_t end, uint8_t* buf) const {
+    size_t bytes_read = 0;
+    while (start < end) {
+        const Segment* seg = FindSegment(start);
+        if (!seg)
+            break;
+        uint64_t off = start - seg->vaddr;
+        size_t len = std::min<uint64_t>(end - start, seg->data.size() - off);
+        std::memcpy(buf + bytes_read, seg->data.data() + off, len);
+        bytes_read += len;
+        start += len;
+    }
+    return bytes_read;
+}
+
+bool GuestImage::IsCode(uint64_t addr) const {
+    const Segment* seg = FindSegment(addr);
+    return seg && seg->exec;
+}
+
+bool GuestImage::FileOffset(uint64_t addr, uint64_t& offset) const {
+    const Segment* seg = FindSegment(addr);
+    if (!seg)
+        return false;
+    offset = addr - seg->vaddr + seg->offset;
+    return true;
+}
+
+void GuestImage::ReadBuildId(const Elf64_Phdr& note) {
+    if (note.p_offset + note.p_filesz > file.size())
+        return;
+    const char* notes = file.data() + note.p_offset;
+    size_t off = 0;
+    while (off + sizeof(Elf64_Nhdr) <= note.p_filesz) {
+        Elf64_Nhdr nhdr;
+        std::memcpy(&nhdr, notes + off, sizeof(nhdr));
+        size_t name_off = off + sizeof(nhdr);
+        size_t desc_off = name_off + ((nhdr.n_namesz + 3) & ~3u);
+        off = desc_off + ((nhdr.n_descsz + 3) & ~3u);
+        if (off > note.p_filesz)
+            break;
+        if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 &&
+            !std::memcmp(notes + name_off, "GNU", 4))
+            build_id.assign(notes + desc_off, notes + desc_off + nhdr.n_descsz);
+    }
+}
+
+void GuestImage::AddEntry(uint64_t addr) {
+    if (IsCode(addr))
+        entries.push_back(addr);
+}
+
+void GuestImage::CollectSymbols(const Elf64_Shdr& symtab) {
+    if (symtab.sh_entsize != sizeof(Elf64_Sym))
+        return;
+    size_t count = symtab.sh_size / sizeof(Elf64_Sym);
+    for (size_t i = 0; i < count; i++) {
+        Elf64_Sym sym;
+        std::memcpy(&sym, file.data() + symtab.sh_offset + i * sizeof(sym), sizeof(sym));
+        if (ELF64_ST_TYPE(sym.st_info) == STT_FUNC && sym.st_shndx != SHN_UNDEF)
+            AddEntry(sym.st_value);
+    }
+}
+
+bool GuestImage::DecodePointer(uint8_t enc, const uint8_t*& ptr, const uint8_t* end,
+                               uint64_t pc, uint64_t& val) const {
+    auto read = [&](auto tmp) {
+        if (end - ptr < static_cast<ptrdiff_t>(sizeof(tmp)))
+            return false;
+        std::memcpy(&tmp, ptr, sizeof(tmp));
+        ptr += sizeof(tmp);
+        val = static_cast<uint64_t>(static_cast<int64_t>(tmp));
+        return true;
+    };
+    bool ok;
+    switch (enc & 0x0f) {
+    case 0x00: ok = read(uint64_t{}); break; // DW_EH_PE_absptr
+    case 0x03: ok = read(uint32_t{}); break; // DW_EH_PE_udata4
+    case 0x0b: ok = read(int32_t{}); break; // DW_EH_PE_sdata4
+    case 0x04: ok = read(uint64_t{}); break; // DW_EH_PE_udata8
+    case 0x0c: ok = read(int64_t{}); break; // DW_EH_PE_sdata8
+    default: return false;
+    }
+    if ((enc & 0x0f) == 0x03)
+        val &= 0xffffffff;
+    switch (enc & 0x70) {
+    case 0x00: break; // DW_EH_PE_absptr
+    case 0x10: val += pc; break; // DW_EH_PE_pcrel
+    default: return false;
+    }
+    return ok;
+}
+
+/// Add the initial locations of all FDEs. Only the pointer encodings that
+/// compilers use for .eh_frame are supported.
+void GuestImage::CollectEhFrame(const Elf64_Shdr& eh_frame) {
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(file.data() + eh_frame.sh_offset);
+    const uint8_t* end = base + eh_frame.sh_size;
+    auto read_uleb = [&](const uint8_t*& ptr) {
+        uint64_t val = 0;
+        for (unsigned shift = 0; ptr < end && shift < 64; shift += 7) {
+            uint8_t byte = *ptr++;
+            val |= uint64_t{byte & 0x7fu} << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return val;
+    };
+
+    std::unordered_map<uint64_t, uint8_t> cie_enc;
+    const uint8_t* cur = base;
+    while (end - cur >= 8) {
+        uint32_t len;
+        std::memcpy(&len, cur, sizeof(len));
+        if (len == 0 || len == 0xffffffff || len > static_cast<uint64_t>(end - cur - 4))
+            break; // terminator or 64-bit DWARF, which isn't used for .eh_frame
+        const uint8_t* rec = cur + 4;
+        const uint8_t* rec_end = rec + len;
+        uint32_t cie_ptr;
+        std::memcpy(&cie_ptr, rec, sizeof(cie_ptr));
+
+        if (cie_ptr == 0) { // CIE
+            const uint8_t* ptr = rec + 5; // skip id and version
+            const char* aug = reinterpret_cast<const char*>(ptr);
+            size_t aug_len = strnlen(aug, rec_end - ptr);
+            ptr += aug_len + 1;
+            read_uleb(ptr); // code alignment
+            read_uleb(ptr); // data alignment, signed, but only skipped
+            if (rec[4] == 1)
+                ptr++; // return address register
+            else
+                read_uleb(ptr);
+            uint8_t enc = 0; // DW_EH_PE_absptr
+            if (aug_len && aug[0] == 'z') {
+                read_uleb(ptr); // augmentation data length
+                for (size_t i = 1; i < aug_len && ptr < rec_end; i++) {
+                    if (aug[i] == 'R') {
+                        enc = *ptr++;
+                    } else if (aug[i] == 'P') {
+                        uint8_t penc = *ptr++;
+                        uint64_t personality;
+                        uint64_t pc = eh_frame.sh_addr + (ptr - base);
+                        if (!DecodePointer(penc, ptr, rec_end, pc, personality))
+                            break;
+                    } else if (aug[i] == 'L') {
+                        ptr++;
+                    } else if (aug[i] == 'S') {
+                        // signal frame, no data
+                    } else {
+                        break; // unknown augmentation
+                    }
+                }
+            }
+            cie_enc[cur - base] = enc;
+        } else { // FDE
+            uint64_t cie_off = (rec - base) - cie_ptr;
+            auto enc_it = cie_enc.find(cie_off);
+            const uint8_t* ptr = rec + 4;
+            uint64_t pc_begin;
+            if (enc_it != cie_enc.end() &&
+                DecodePointer(enc_it->second, ptr, rec_end,
+                              eh_frame.sh_addr + (ptr - base), pc_begin))
+                AddEntry(pc_begin);
+        }
+        cur = rec_end;
+    }
+}
+
+} // end anonymous namespace
+
+struct IWConnection {
+    IWServerConfig iwsc;
+    IWClientConfig iwcc;
+    GuestImage image;
+    instrew::Cache cache;
+
+    // Protects queue, known and running.
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<uint64_t> queue;
+    std::unordered_set<uint64_t> known;
+    size_t running = 0;
+
+    std::atomic<size_t> translated{0};
+    std::atomic<size_t> failed{0};
+
+    // Whether the server identifies the binary by build-id with -pic-images.
+    bool image_keys = false;
+
+    IWConnection(const std::filesystem::path& cache_dir)
+            : cache(cache_dir, true, true) {}
+
+    void Enqueue(uint64_t addr) {
+        if (!image.IsCode(addr))
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!known.insert(addr).second)
+            return;
+        queue.push_back(addr);
+        cv.notify_one();
+    }
+
+    void WorkerMain(IWState* state) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this] { return !queue.empty() || !running; });
+            if (queue.empty())
+                return; // all done
+            uint64_t addr = queue.front();
+            queue.pop_front();
+            running++;
+            lock.unlock();
+
+            if (aotVerbose)
+                llvm::errs() << "translating 0x" << llvm::Twine::utohexstr(addr) << "\n";
+            // Direct targets are added to the queue with iw_speculate.
+            iw_rewrite_functions.translate(state, addr, 0);
+
+            lock.lock();
+            running--;
+            if (!running && queue.empty())
+                cv.notify_all();
+        }
+    }
+};
+
+const struct IWServerConfig* iw_get_sc(IWConnection* iwc) {
+    return &iwc->iwsc;
+}
+struct IWClientConfig* iw_get_cc(IWConnection* iwc) {
+    return &iwc->iwcc;
+}
+size_t iw_readmem(IWConnection* iwc, uintptr_t addr, uintptr_t end, uint8_t* buf) {
+    return iwc->image.Read(addr, end, buf);
+}
+bool iw_cache_enabled(IWConnection* iwc) {
+    (void) iwc;
+    return true;
+}
+bool iw_cache_probe(IWConnection* iwc, uintptr_t addr, const uint8_t* hash) {
+    (void) iwc; (void) addr; (void) hash;
+    // Cached functions are translated again to find their direct targets.
+    return false;
+}
+bool iw_cache_get(IWConnection* iwc, const uint8_t* hash, std::vector<char>& data) {
+    return iwc->cache.Get(hash, data);
+}
+void iw_cache_put(IWConnection* iwc, const uint8_t* hash, const void* data, size_t size) {
+    iwc->cache.Put(hash, size, static_cast<const char*>(data));
+}
+bool iw_find_image(IWConnection* iwc, uintptr_t addr, std::vector<uint8_t>& id,
+                   uint64_t& offset) {
+    if (!iwc->image_keys || !iwc->image.FileOffset(addr, offset))
+        return false;
+    id = iwc->image.BuildId();
+    return true;
+}
+void iw_object_cache_stats(IWConnection* iwc, uint64_t& hits, uint64_t& misses) {
+    (void) iwc;
+    hits = misses = 0;
+}
+void iw_sendobj(IWConnection* iwc, uintptr_t addr, const void* data,
+                size_t size, const uint8_t* hash) {
+    if (!size) {
+        iwc->failed++;
+        return;
+    }
+    // The initial object is cached, too, so that runs start without LLVM.
+    iwc->cache.Put(hash, size, static_cast<const char*>(data));
+    if (addr)
+        iwc->translated++;
+}
+void iw_set_code_config(IWConnection* iwc, const void* config, size_t size) {
+    (void) iwc; (void) config; (void) size;
+}
+bool iw_push_cached(IWConnection* iwc, uintptr_t addr, const uint8_t* hash) {
+    (void) iwc; (void) addr; (void) hash;
+    return false;
+}
+void iw_record_code(IWConnection* iwc, uintptr_t addr, const uint8_t* hash,
+                    const std::vector<uint8_t>& code,
+                    const std::vector<std::pair<uint64_t, uint64_t>>& ranges) {
+    (void) iwc; (void) addr; (void) hash; (void) code; (void) ranges;
+}
+void iw_speculate(IWConnection* iwc, uintptr_t addr) {
+    iwc->Enqueue(addr);
+}
+bool iw_follow_targets(IWConnection* iwc) {
+    (void) iwc;
+    // Translate everything reachable from the entries.
+    return true;
+}
+bool iw_take_profile(IWConnection* iwc, uintptr_t addr, std::vector<uint64_t>& counts) {
+    (void) iwc; (void) addr; (void) counts;
+    return false;
+}
+
+int main(int argc, char** argv) {
+    llvm::cl::HideUnrelatedOptions({&InstrewCategory, &CodeGenCategory, &AotCategory});
+    auto& optionMap = llvm::cl::getRegisteredOptions();
+    optionMap["time-passes"]->setHiddenFlag(llvm::cl::Hidden);
+    llvm::cl::SetVersionPrinter([](llvm::raw_ostream& os) {
+        os << "Instrew " << instrew::instrewVersion << "\n";
+    });
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Instrew ahead-of-time translation into the cache\n");
+
+    IWConnection iwc(instrew::Cache::DefaultDir());
+    if (!iwc.cache.Enabled()) {
+        std::cerr << "error: unable to open cache" << std::endl;
+        return 1;
+    }
+    if (!iwc.image.Load(guestBinary)) {
+        std::cerr << "error: unable to load " << guestBinary << std::endl;
+        return 1;
+    }
+    // Without -pic, keys contain absolute addresses, which are only known in
+    // advance for non-relocatable binaries. With -pic-images, the server keys
+    // relocatable binaries with a build-id by their build-id and offset.
+    bool pic = *static_cast<llvm::cl::opt<bool>*>(optionMap["pic"]);
+    bool pic_images = *static_cast<llvm::cl::opt<bool>*>(optionMap["pic-images"]);
+    if (iwc.image.Type() == ET_DYN && !pic) {
+        iwc.image_keys = pic_images && !iwc.image.BuildId().empty();
+        if (!iwc.image_keys) {
+            std::cerr << "error: position-independent binaries need -pic or -pic-images and a build-id" << std::endl;
+            return 1;
+        }
+    }
+
+    // Same server configuration as the client sends.
+    iwc.iwsc = IWServerConfig{};
+    iwc.iwsc.tsc_guest_arch = iwc.image.Machine();
+#ifdef __x86_64__
+    iwc.iwsc.tsc_host_arch = EM_X86_64;
+    iwc.iwsc.tsc_stack_alignment = 8;
+#elif defined(__aarch64__)
+    iwc.iwsc.tsc_host_arch = EM_AARCH64;
+#else
+#error "Unsupported architecture!"
+#endif
+
+    unsigned jobs = numJobs ? numJobs : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<IWState*> states;
+    for (unsigned i = 0; i < jobs; i++)
+        states.push_back(iw_rewrite_functions.init(&iwc, i == 0));
+
+    for (uint64_t addr : iwc.image.Entries())
+        iwc.Enqueue(addr);
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < jobs; i++)
+        workers.emplace_back(&IWConnection::WorkerMain, &iwc, states[i]);
+    for (auto& worker : workers)
+        worker.join();
+
+    // Finalize the primary state last, it reports the profile.
+    for (auto it = states.rbegin(); it != states.rend(); ++it)
+        iw_rewrite_functions.finalize(*it);
+
+    std::cout << iwc.translated << " functions translated, " << iwc.failed
+              << " failed" << std::endl;
+    return 0;
+}
@@ -4,12 +4,23 @@
 #include "config.h"
 
 #include <llvm/Support/CommandLine.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <elf.h>
 #include <fcntl.h>
+#include <functional>
 #include <filesystem>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <pwd.h>
 #include <sstream>
 #include <system_error>
+#include <thread>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -17,8 +28,15 @@
 
 namespace instrew {
 
-// Cache implementation heavily inspired by MESA:
-// https://github.com/mesa3d/mesa/blob/main/src/util/disk_cache_os.c
+// All objects are stored in a single pack file, which is mapped into memory:
+// a header page, the index (open addressing with linear probing), a filter for
+// negative lookups (Bloom filter with two bits per entry) and the objects,
+// appended at the end. Entries are published by storing their offset last, so
+// readers need no lock; writers hold an fcntl lock on the file.
+//
+// Entries are never removed in place. Instead, the pack is rewritten with the
+// remaining entries and replaces the old file, which is marked as replaced so
+// that other processes switch to the new file.
 
 namespace {
 
@@ -35,6 +53,11 @@ llvm::cl::opt<CacheMode> cacheMode("cachemode", llvm::cl::desc("Allowed cache ac
             clEnumValN(CacheMode::WriteOnly, "writeonly", "Write-only (rarely useful)")
             ), llvm::cl::cat(InstrewCategory));
 llvm::cl::opt<std::string> cacheDir("cachedir", llvm::cl::desc("Cache directory"), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<uint64_t> cacheMaxSize("cache-max-size", llvm::cl::desc("Evict least recently used cache entries above this size in MiB, 0 for no limit (default: 1024)"), llvm::cl::init(1024), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<size_t> cacheQueueSize("cache-queue", llvm::cl::desc("Write at most this many objects to the cache in the background, 0 for synchronous writes (default: 256)"), llvm::cl::init(256), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<size_t> cacheMemory("cache-memory", llvm::cl::desc("Keep recently used objects up to this size in MiB in memory, 0 to disable (default: 64)"), llvm::cl::init(64), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<std::string> cacheImport("cache-import", llvm::cl::desc("Add the entries of a pack file to the cache"), llvm::cl::value_desc("pack"), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<std::string> cacheExport("cache-export", llvm::cl::desc("Write all cache entries to a new pack file"), llvm::cl::value_desc("pack"), llvm::cl::cat(InstrewCategory));
 llvm::cl::opt<bool> cacheVerbose("cacheverbose", llvm::cl::desc("Print cache operations"), llvm::cl::Hidden, llvm::cl::cat(InstrewCategory));
 
 struct HexBuffer {
@@ -48,117 +71,700 @@ struct HexBuffer {
     }
 };
 
-static ssize_t write_full(int fd, const char* buf, size_t nbytes) {
+constexpr char PACK_MAGIC[8] = {'I', 'W', 'P', 'A', 'C', 'K', 0, 0};
+constexpr uint32_t PACK_VERSION = 2;
+constexpr uint32_t PACK_INDEX_BITS = 20;
+constexpr uint64_t PACK_FILTER_BITS_PER_SLOT = 8;
+constexpr uint64_t PACK_HEADER_SIZE = 0x1000;
+constexpr uint64_t PACK_ALIGN = 16;
+// Address space reserved for the mapping, which covers appended objects.
+constexpr uint64_t PACK_MAP_SIZE = uint64_t{1} << 36;
+// Access times are updated at most this often (seconds), to avoid dirtying
+// index pages on every hit.
+constexpr uint32_t PACK_ATIME_GRANULARITY = 60;
+
+struct PackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t index_bits;
+    uint64_t index_offset;
+    uint64_t filter_offset;
+    uint64_t filter_bits; // power of two
+    uint64_t data_offset;
+    std::atomic<uint64_t> entries;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint32_t> replaced;
+};
+
+struct PackSlot {
+    uint8_t hash[Cache::HASH_SIZE];
+    uint32_t size;
+    std::atomic<uint64_t> offset; // zero for empty slots
+    std::atomic<uint32_t> atime; // seconds since the epoch
+    uint32_t reserved;
+};
+static_assert(sizeof(PackSlot) == 40, "unexpected pack slot size");
+
+uint64_t AlignUp(uint64_t val, uint64_t align) {
+    return (val + align - 1) & ~(align - 1);
+}
+
+uint64_t HashWord(const uint8_t* hash, size_t offset) {
+    uint64_t word;
+    std::memcpy(&word, hash + offset, sizeof(word));
+    return word;
+}
+
+uint32_t Now() {
+    return static_cast<uint32_t>(std::time(nullptr));
+}
+
+bool PWriteFull(int fd, const char* buf, size_t nbytes, off_t offset) {
     size_t total_written = 0;
-    const char* buf_cp = buf;
     while (total_written < nbytes) {
-        ssize_t bytes_written = write(fd, buf_cp + total_written, nbytes - total_written);
-        if (bytes_written < 0)
-            return bytes_written;
-        if (bytes_written == 0)
-            return -EIO;
+        ssize_t bytes_written = pwrite(fd, buf + total_written,
+                                       nbytes - total_written,
+                                       offset + total_written);
+        if (bytes_written <= 0)
+            return false;
         total_written += bytes_written;
     }
-    return total_written;
+    return true;
 }
 
 } // end namespace
 
+class Pack {
+public:
+    enum class InsertResult {
+        Inserted, Exists, Full, Replaced, Failed,
+    };
+
+    /// Open a valid pack file.
+    static std::unique_ptr<Pack> Open(const std::filesystem::path& path,
+                                      bool writable) {
+        int fd = open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (fd < 0)
+            return nullptr;
+
+        PackHeader hdr;
+        struct stat sb;
+        if (fstat(fd, &sb) == 0 &&
+            static_cast<uint64_t>(sb.st_size) >= PACK_HEADER_SIZE &&
+            pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+            Valid(hdr, sb.st_size)) {
+            int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+            void* map = mmap(nullptr, PACK_MAP_SIZE, prot,
+                             MAP_SHARED | MAP_NORESERVE, fd, 0);
+            if (map != MAP_FAILED)
+                return std::unique_ptr<Pack>(new Pack(fd, static_cast<char*>(map), writable));
+        }
+        close(fd);
+        return nullptr;
+    }
+
+    /// Create a pack file, filled by fill if set, and replace any existing
+    /// file. Processes using the old file keep their mapping.
+    static bool Create(const std::filesystem::path& path,
+                       const std::function<bool(Pack&)>& fill = nullptr) {
+        std::filesystem::path tmp = path;
+        tmp += ".tmp" + std::to_string(getpid());
+        int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+
+        PackHeader hdr{};
+        std::memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+        hdr.version = PACK_VERSION;
+        hdr.index_bits = PACK_INDEX_BITS;
+        hdr.index_offset = PACK_HEADER_SIZE;
+        hdr.filter_offset = hdr.index_offset + (sizeof(PackSlot) << PACK_INDEX_BITS);
+        hdr.filter_bits = PACK_FILTER_BITS_PER_SLOT << PACK_INDEX_BITS;
+        hdr.data_offset = AlignUp(hdr.filter_offset + hdr.filter_bits / 8, 0x1000);
+        bool ok = ftruncate(fd, hdr.data_offset) == 0 &&
+                  PWriteFull(fd, reinterpret_cast<const char*>(&hdr), sizeof(hdr), 0);
+        close(fd);
+        if (ok && fill) {
+            std::unique_ptr<Pack> pack = Open(tmp, true);
+            ok = pack && fill(*pack);
+        }
+        if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    ~Pack() {
+        munmap(map, PACK_MAP_SIZE);
+        close(fd);
+    }
+
+    const PackSlot* Find(const uint8_t* hash) const {
+        if (!FilterTest(hash))
+            return nullptr;
+        size_t pos = HashWord(hash, 12);
+        for (size_t i = 0; i <= slot_mask; i++, pos++) {
+            const PackSlot& slot = slots[pos & slot_mask];
+            if (!slot.offset.load(std::memory_order_acquire))
+                break;
+            if (!std::memcmp(slot.hash, hash, Cache::HASH_SIZE))
+                return &slot;
+        }
+        return nullptr;
+    }
+
+    /// Find an entry and count the access.
+    std::pair<const char*, size_t> Get(const uint8_t* hash) {
+        const PackSlot* slot = Find(hash);
+        if (writable) {
+            (slot ? hdr->hits : hdr->misses).fetch_add(1, std::memory_order_relaxed);
+            uint32_t now = Now();
+            if (slot && now - slot->atime.load(std::memory_order_relaxed) >= PACK_ATIME_GRANULARITY)
+                const_cast<PackSlot*>(slot)->atime.store(now, std::memory_order_relaxed);
+        }
+        if (!slot || !InFile(*slot))
+            return std::make_pair(nullptr, 0);
+        return std::make_pair(Data(*slot), slot->size);
+    }
+
+    /// Append an object. Fails with Full if the index is too full and with
+    /// Replaced if another process replaced the pack file.
+    InsertResult Insert(const uint8_t* hash, size_t size, const char* buf,
+                        uint32_t atime) {
+        if (!Lock())
+            return InsertResult::Failed;
+        InsertResult res = InsertLocked(hash, size, buf, atime);
+        Unlock();
+        return res;
+    }
+
+    /// Same as Insert, but the caller holds the lock, e.g. to write a batch.
+    InsertResult InsertLocked(const uint8_t* hash, size_t size, const char* buf,
+                              uint32_t atime) {
+        if (hdr->replaced.load())
+            return InsertResult::Replaced;
+        if (Find(hash)) // someone else got it already, so nothing to do.
+            return InsertResult::Exists;
+        if (hdr->entries.load() >= (slot_mask + 1) / 4 * 3)
+            return InsertResult::Full;
+        // Objects are appended, so the file size is the end of the data.
+        if (!data_end) {
+            struct stat sb;
+            if (fstat(fd, &sb) < 0)
+                return InsertResult::Failed;
+            data_end = sb.st_size;
+        }
+        uint64_t end = std::max(AlignUp(data_end, PACK_ALIGN), hdr->data_offset);
+        if (size > UINT32_MAX || end + size > PACK_MAP_SIZE ||
+            !PWriteFull(fd, buf, size, end))
+            return InsertResult::Failed;
+        data_end = end + size;
+
+        size_t pos = HashWord(hash, 12);
+        while (slots[pos & slot_mask].offset.load(std::memory_order_relaxed))
+            pos++;
+        PackSlot& slot = slots[pos & slot_mask];
+        std::memcpy(slot.hash, hash, Cache::HASH_SIZE);
+        slot.size = size;
+        slot.atime.store(atime, std::memory_order_relaxed);
+        slot.offset.store(end, std::memory_order_release);
+        FilterSet(hash);
+        hdr->entries.fetch_add(1, std::memory_order_relaxed);
+        hdr->bytes.fetch_add(size, std::memory_order_relaxed);
+        return InsertResult::Inserted;
+    }
+
+    /// Exclusive access for writing among all threads and processes.
+    bool Lock() {
+        // fcntl locks don't exclude threads of the same process.
+        mutex.lock();
+        struct flock lock{};
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        if (fcntl(fd, F_SETLKW, &lock) < 0) {
+            mutex.unlock();
+            return false;
+        }
+        data_end = 0; // other processes may have appended
+        return true;
+    }
+    void Unlock() {
+        struct flock lock{};
+        lock.l_type = F_UNLCK;
+        lock.l_whence = SEEK_SET;
+        fcntl(fd, F_SETLK, &lock);
+        mutex.unlock();
+    }
+
+    /// Call f for all entries whose object is in the file.
+    template<typename F>
+    void ForEach(F f) const {
+        ForEachSlot([&](const PackSlot& slot) {
+            if (InFile(slot))
+                f(slot);
+        });
+    }
+    /// Call f for all used slots, including invalid ones.
+    template<typename F>
+    void ForEachSlot(F f) const {
+        for (size_t i = 0; i <= slot_mask; i++)
+            if (slots[i].offset.load(std::memory_order_acquire))
+                f(slots[i]);
+    }
+
+    /// Whether the object of a slot is in the data area and within the file.
+    /// Reading beyond the end of the file through the mapping raises SIGBUS,
+    /// e.g. for a truncated file.
+    bool InFile(const PackSlot& slot) const {
+        uint64_t offset = slot.offset.load(std::memory_order_relaxed);
+        if (offset < hdr->data_offset || offset % PACK_ALIGN ||
+            offset + slot.size > PACK_MAP_SIZE)
+            return false;
+        uint64_t end = offset + slot.size;
+        // Other processes append objects, so the file only grows.
+        if (end <= file_size.load(std::memory_order_relaxed))
+            return true;
+        uint64_t cur_size = FileSize();
+        file_size.store(cur_size, std::memory_order_relaxed);
+        return end <= cur_size;
+    }
+
+    const char* Data(const PackSlot& slot) const {
+        return map + slot.offset.load(std::memory_order_relaxed);
+    }
+    const PackHeader& Header() const {
+        return *hdr;
+    }
+    uint64_t FileSize() const {
+        struct stat sb;
+        return fstat(fd, &sb) == 0 ? sb.st_size : 0;
+    }
+    bool FilterTest(const uint8_t* hash) const {
+        uint64_t bit1 = HashWord(hash, 0) & filter_mask;
+        uint64_t bit2 = HashWord(hash, 4) >> 7 & filter_mask;
+        return (filter[bit1 / 64].load(std::memory_order_relaxed) >> (bit1 % 64) & 1) &&
+               (filter[bit2 / 64].load(std::memory_order_relaxed) >> (bit2 % 64) & 1);
+    }
+
+    bool Replaced() const {
+        return hdr->replaced.load(std::memory_order_relaxed);
+    }
+    void MarkReplaced() {
+        hdr->replaced.store(1);
+    }
+    void AddCounts(uint64_t hits, uint64_t misses) {
+        hdr->hits.fetch_add(hits, std::memory_order_relaxed);
+        hdr->misses.fetch_add(misses, std::memory_order_relaxed);
+    }
+
+private:
+    Pack(int fd, char* map, bool writable) : fd(fd), map(map), writable(writable) {
+        hdr = reinterpret_cast<PackHeader*>(map);
+        slots = reinterpret_cast<PackSlot*>(map + hdr->index_offset);
+        slot_mask = (size_t{1} << hdr->index_bits) - 1;
+        filter = reinterpret_cast<std::atomic<uint64_t>*>(map + hdr->filter_offset);
+        filter_mask = hdr->filter_bits - 1;
+    }
+
+    static bool Valid(const PackHeader& hdr, uint64_t file_size) {
+        if (std::memcmp(hdr.magic, PACK_MAGIC, sizeof(hdr.magic)) || hdr.version != PACK_VERSION)
+            return false;
+        if (hdr.index_bits == 0 || hdr.index_bits > 32)
+            return false;
+        if (hdr.filter_bits < 64 || (hdr.filter_bits & (hdr.filter_bits - 1)))
+            return false;
+        return hdr.index_offset >= sizeof(PackHeader) &&
+               hdr.filter_offset >= hdr.index_offset + (sizeof(PackSlot) << hdr.index_bits) &&
+               hdr.data_offset >= hdr.filter_offset + hdr.filter_bits / 8 &&
+               hdr.data_offset <= file_size;
+    }
+
+    void FilterSet(const uint8_t* hash) {
+        uint64_t bit1 = HashWord(hash, 0) & filter_mask;
+        uint64_t bit2 = HashWord(hash, 4) >> 7 & filter_mask;
+        filter[bit1 / 64].fetch_or(uint64_t{1} << (bit1 % 64), std::memory_order_relaxed);
+        filter[bit2 / 64].fetch_or(uint64_t{1} << (bit2 % 64), std::memory_order_relaxed);
+    }
+
+    int fd;
+    char* map;
+    bool writable;
+    PackHeader* hdr;
+    PackSlot* slots;
+    size_t slot_mask;
+    std::atomic<uint64_t>* filter;
+    uint64_t filter_mask;
+    std::mutex mutex;
+    // End of the object data while locked, zero if unknown.
+    uint64_t data_end = 0;
+    // File size seen last, to avoid fstat for each access.
+    mutable std::atomic<uint64_t> file_size{0};
+};
+
 Cache::Cache() {
-    allow_read = false;
-    allow_write = false; // default to no cache -- it's not critical.
     if (!cacheEnabled)
         return;
     if (geteuid() != getuid())
         return;
-    if (!cacheDir.empty()) {
-        path = static_cast<std::string>(cacheDir);
-    } else {
-        passwd* pw = getpwuid(getuid());
-        path = pw->pw_dir;
-        path /= ".cache";
-        path /= "instrew";
-    }
+    allow_read = cacheMode != CacheMode::WriteOnly;
+    allow_write = cacheMode != CacheMode::ReadOnly;
+    max_bytes = cacheMaxSize << 20;
+    Open(DefaultDir());
+
+    if (!cacheImport.empty() && !Import(static_cast<std::string>(cacheImport)))
+        std::cerr << "unable to import cache from " << cacheImport << std::endl;
+    if (!cacheExport.empty() && !Export(static_cast<std::string>(cacheExport)))
+        std::cerr << "unable to export cache to " << cacheExport << std::endl;
+
+    StartWriter();
+}
+
+Cache::Cache(const std::filesystem::path& dir, bool allow_read, bool allow_write)
+        : allow_read(allow_read), allow_write(allow_write) {
+    Open(dir);
+}
+
+Cache::~Cache() {
+    StopWriter();
+}
+
+std::filesystem::path Cache::DefaultDir() {
+    if (!cacheDir.empty())
+        return static_cast<std::string>(cacheDir);
+    passwd* pw = getpwuid(getuid());
+    std::filesystem::path dir = pw->pw_dir;
+    return dir / ".cache" / "instrew";
+}
+
+void Cache::Open(const std::filesystem::path& dir) {
     std::error_code ec;
     // F*ck C++ creates this with 0777, but 0755 would be better.
     // TODO: fix cache dir permissions
-    std::filesystem::create_directories(path, ec);
+    std::filesystem::create_directories(dir, ec);
     if (ec) {
         std::cerr << "unable to create cache directory, disabling cache" << std::endl;
+        allow_read = allow_write = false;
         return;
     }
-    allow_read = cacheMode != CacheMode::WriteOnly;
-    allow_write = cacheMode != CacheMode::ReadOnly;
+    path = dir / "objects.pack";
+    if (!ReopenLocked(nullptr)) {
+        std::cerr << "unable to open cache pack file, disabling cache" << std::endl;
+        allow_read = allow_write = false;
+    }
 }
 
-Cache::~Cache() {
+std::shared_ptr<Pack> Cache::Current() const {
+    return std::atomic_load(&pack);
+}
+
+std::shared_ptr<Pack> Cache::Reopen(const Pack* stale) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return ReopenLocked(stale);
 }
 
-std::filesystem::path Cache::FileName(const uint8_t* hash, std::string suffix) {
-    std::stringstream fn;
-    fn << HexBuffer{hash, HASH_SIZE} << suffix;
-    return path / fn.str();
+std::shared_ptr<Pack> Cache::ReopenLocked(const Pack* stale) {
+    std::shared_ptr<Pack> cur = Current();
+    if (cur.get() != stale)
+        return cur; // another thread was faster
+    std::shared_ptr<Pack> new_pack = Pack::Open(path, allow_write);
+    // A missing or incompatible pack is replaced with an empty pack.
+    if (!new_pack && allow_write && Pack::Create(path))
+        new_pack = Pack::Open(path, allow_write);
+    if (!new_pack)
+        return cur;
+    std::atomic_store(&pack, new_pack);
+    return new_pack;
 }
 
-std::pair<int,size_t> Cache::Get(const uint8_t* hash) {
+bool Cache::Get(const uint8_t* hash, std::vector<char>& obj) {
     if (!allow_read)
-        return std::make_pair(-1, 0);
-
-    std::filesystem::path cachefile = FileName(hash);
-    int fd = open(cachefile.c_str(), O_RDONLY | O_CLOEXEC);
-    if (fd == -1)
-        return std::make_pair(-1, 0);
-    struct stat sb;
-    if (fstat(fd, &sb) == -1) {
-        close(fd);
-        return std::make_pair(-1, 0);
+        return false;
+
+    // The reference keeps the mapping while copying.
+    std::shared_ptr<Pack> cur = Current();
+    auto res = cur->Get(hash);
+    if (!res.first && cur->Replaced()) {
+        cur = Reopen(cur.get());
+        res = cur->Get(hash);
     }
+    if (!res.first)
+        return false;
     if (cacheVerbose)
-        std::cerr << "hitting " << cachefile << "\n";
-    return std::make_pair(fd, sb.st_size);
+        std::cerr << "hitting " << HexBuffer{hash, HASH_SIZE} << "\n";
+    obj.assign(res.first, res.first + res.second);
+    return true;
 }
 
 void Cache::Put(const uint8_t* hash, size_t bufsz, const char* buf) {
     if (!allow_write)
         return;
+    if (max_bytes && bufsz > max_bytes)
+        return;
 
-    std::filesystem::path cachefile = FileName(hash, ".tmp");
-    std::string cachefile_tmp = cachefile; // copy
-    cachefile.replace_extension("");
+    QueuedEntry entry;
+    std::memcpy(entry.hash, hash, HASH_SIZE);
+    entry.data.assign(buf, buf + bufsz);
+    if (!writer.joinable()) {
+        Write(&entry, 1);
+        return;
+    }
 
-    struct flock lock{};
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    // Never block the translation on the file system; the object will be
+    // cached on another run.
+    if (queue.size() >= cacheQueueSize) {
+        if (cacheVerbose)
+            std::cerr << "skipping " << HexBuffer{hash, HASH_SIZE} << "\n";
+        return;
+    }
+    queue.push_back(std::move(entry));
+    queue_cv.notify_one();
+}
 
-    int fd_real = -1;
-    int fd = open(cachefile_tmp.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT, 0644);
-    if (fd == -1)
-        goto close_fds;
+void Cache::StartWriter() {
+    if (!allow_write || !cacheQueueSize || writer.joinable())
+        return;
+    stop_writer = false;
+    writer = std::thread(&Cache::WriterMain, this);
+}
 
-    lock.l_type = F_WRLCK;
-    lock.l_whence = SEEK_SET;
-    if (fcntl(fd, F_SETLK, &lock) < 0)
-        goto close_fds;
+void Cache::StopWriter() {
+    if (!writer.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stop_writer = true;
+        queue_cv.notify_one();
+    }
+    writer.join();
+}
 
-    fd_real = open(cachefile.c_str(), O_RDONLY, O_CLOEXEC);
-    if (fd_real >= 0) { // someone else got it already, so nothing to do.
-        unlink(cachefile_tmp.c_str());
-        goto close_fds;
+void Cache::WriterMain() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (true) {
+        queue_cv.wait(lock, [this] { return stop_writer || !queue.empty(); });
+        if (queue.empty())
+            return; // stopped and all entries written
+        // Write everything queued so far under a single file lock.
+        std::vector<QueuedEntry> batch;
+        batch.swap(queue);
+        lock.unlock();
+        Write(batch.data(), batch.size());
+        lock.lock();
     }
-    if (write_full(fd, buf, bufsz) < 0) {
-        unlink(cachefile_tmp.c_str());
-        goto close_fds;
+}
+
+void Cache::Write(const QueuedEntry* entries, size_t count) {
+    uint64_t batch_bytes = 0;
+    for (size_t i = 0; i < count; i++)
+        batch_bytes += entries[i].data.size();
+
+    // Evict down to 3/4 of the limit, so that this doesn't happen often.
+    std::shared_ptr<Pack> cur = Current();
+    if (max_bytes && cur->Header().bytes.load() + batch_bytes > max_bytes)
+        Prune(max_bytes / 4 * 3, 0);
+
+    size_t done = 0;
+    for (unsigned attempt = 0; attempt < 2 && done < count; attempt++) {
+        cur = Current();
+        if (!cur->Lock())
+            return;
+        auto res = Pack::InsertResult::Inserted;
+        uint32_t now = Now();
+        for (; done < count; done++) {
+            const QueuedEntry& entry = entries[done];
+            res = cur->InsertLocked(entry.hash, entry.data.size(),
+                                    entry.data.data(), now);
+            if (res == Pack::InsertResult::Inserted && cacheVerbose)
+                std::cerr << "writing " << HexBuffer{entry.hash, HASH_SIZE} << "\n";
+            else if (res != Pack::InsertResult::Inserted &&
+                     res != Pack::InsertResult::Exists)
+                break;
+        }
+        cur->Unlock();
+
+        if (res == Pack::InsertResult::Replaced)
+            Reopen(cur.get());
+        else if (res == Pack::InsertResult::Full) // too many entries
+            Prune(cur->Header().bytes.load() / 4 * 3, 0);
+        else if (res == Pack::InsertResult::Failed)
+            return;
     }
-    if (cacheVerbose)
-        std::cerr << "writing to " << cachefile << "\n";
-    if (rename(cachefile_tmp.c_str(), cachefile.c_str()) < 0) {
-        unlink(cachefile_tmp.c_str());
-        goto close_fds;
+}
+
+bool Cache::Export(const std::filesystem::path& dest) {
+    std::shared_ptr<Pack> cur = Current();
+    if (!cur)
+        return false;
+    return Pack::Create(dest, [cur](Pack& dest_pack) {
+        bool ok = true;
+        cur->ForEach([&](const PackSlot& slot) {
+            auto res = dest_pack.Insert(slot.hash, slot.size, cur->Data(slot), slot.atime);
+            ok &= res == Pack::InsertResult::Inserted;
+        });
+        return ok;
+    });
+}
+
+bool Cache::Import(const std::filesystem::path& src) {
+    if (!allow_write)
+        return false;
+    std::unique_ptr<Pack> src_pack = Pack::Open(src, false);
+    if (!src_pack)
+        return false;
+    bool ok = true;
+    src_pack->ForEach([&](const PackSlot& slot) {
+        std::shared_ptr<Pack> cur = Current();
+        auto res = cur->Insert(slot.hash, slot.size, src_pack->Data(slot), Now());
+        ok &= res == Pack::InsertResult::Inserted || res == Pack::InsertResult::Exists;
+    });
+    return ok;
+}
+
+bool Cache::GetStats(Stats& stats) {
+    std::shared_ptr<Pack> cur = Current();
+    if (!cur)
+        return false;
+    const PackHeader& hdr = cur->Header();
+    stats.entries = hdr.entries.load();
+    stats.bytes = hdr.bytes.load();
+    stats.file_size = cur->FileSize();
+    stats.hits = hdr.hits.load();
+    stats.misses = hdr.misses.load();
+    return true;
+}
+
+bool Cache::Prune(uint64_t max_bytes, uint64_t max_age) {
+    if (!allow_write)
+        return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<Pack> old = Current();
+    if (!old->Lock())
+        return false;
+    if (old->Replaced()) { // somebody else pruned already
+        old->Unlock();
+        ReopenLocked(old.get());
+        return true;
     }
 
-close_fds:
-    if (fd_real != -1)
-        close(fd_real);
-    if (fd != -1)
-        close(fd);
+    std::vector<const PackSlot*> entries;
+    old->ForEach([&](const PackSlot& slot) { entries.push_back(&slot); });
+    std::sort(entries.begin(), entries.end(), [](const PackSlot* a, const PackSlot* b) {
+        return a->atime.load(std::memory_order_relaxed) > b->atime.load(std::memory_order_relaxed);
+    });
+    uint32_t now = Now();
+    uint64_t kept_bytes = 0;
+    std::vector<const PackSlot*> keep;
+    for (const PackSlot* slot : entries) {
+        uint32_t atime = slot->atime.load(std::memory_order_relaxed);
+        if (max_age && now - atime > max_age)
+            break; // all following entries are older
+        if (max_bytes && kept_bytes + slot->size > max_bytes)
+            break;
+        kept_bytes += slot->size;
+        keep.push_back(slot);
+    }
+
+    bool ok = Pack::Create(path, [&](Pack& new_pack) {
+        for (const PackSlot* slot : keep) {
+            auto res = new_pack.Insert(slot->hash, slot->size, old->Data(*slot),
+                                       slot->atime.load(std::memory_order_relaxed));
+            if (res != Pack::InsertResult::Inserted)
+                return false;
+        }
+        new_pack.AddCounts(old->Header().hits.load(), old->Header().misses.load());
+        return true;
+    });
+    if (ok)
+        old->MarkReplaced();
+    old->Unlock();
+    if (ok) {
+        if (cacheVerbose)
+            std::cerr << "evicted " << entries.size() - keep.size() << " entries\n";
+        ReopenLocked(old.get());
+    }
+    return ok;
+}
+
+size_t Cache::Verify(std::ostream& os) {
+    std::shared_ptr<Pack> cur = Current();
+    if (!cur)
+        return 0;
+    const PackHeader& hdr = cur->Header();
+    uint64_t file_size = cur->FileSize();
+    size_t invalid = 0;
+    uint64_t entries = 0, bytes = 0;
+    cur->ForEachSlot([&](const PackSlot& slot) {
+        entries++;
+        bytes += slot.size;
+        uint64_t offset = slot.offset.load(std::memory_order_relaxed);
+        const char* error = nullptr;
+        if (offset < hdr.data_offset || offset % PACK_ALIGN)
+            error = "bad offset";
+        else if (offset + slot.size > file_size)
+            error = "truncated object";
+        else if (cur->Find(slot.hash) != &slot)
+            error = "unreachable or duplicate";
+        else if (!cur->FilterTest(slot.hash))
+            error = "missing in filter";
+        else if (slot.size < sizeof(Elf64_Ehdr) ||
+                 std::memcmp(cur->Data(slot), ELFMAG, SELFMAG) ||
+                 reinterpret_cast<const Elf64_Ehdr*>(cur->Data(slot))->e_type != ET_REL)
+            error = "not an object file";
+        if (error) {
+            os << HexBuffer{slot.hash, HASH_SIZE} << ": " << error << "\n";
+            invalid++;
+        }
+    });
+    if (entries != hdr.entries.load() || bytes != hdr.bytes.load())
+        os << "header counts " << hdr.entries.load() << " entries, "
+           << hdr.bytes.load() << " bytes; found " << entries << " entries, "
+           << bytes << " bytes\n";
+    return invalid;
+}
+
+size_t ObjectCache::KeyHash::operator()(const Key& key) const {
+    return HashWord(key.data(), 0);
+}
+
+ObjectCache::ObjectCache() : max_bytes(cacheMemory << 20) {}
+
+ObjectCache::Object ObjectCache::Get(const uint8_t* hash) {
+    if (!max_bytes)
+        return nullptr;
+    Key key;
+    std::memcpy(key.data(), hash, key.size());
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    hits.fetch_add(1, std::memory_order_relaxed);
+    lru.splice(lru.begin(), lru, it->second.lru_it);
+    return it->second.obj;
+}
+
+void ObjectCache::Put(const uint8_t* hash, Object obj) {
+    if (!max_bytes || obj->size() > max_bytes)
+        return;
+    Key key;
+    std::memcpy(key.data(), hash, key.size());
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.count(key))
+        return;
+    bytes += obj->size();
+    lru.push_front(key);
+    entries.emplace(key, Entry{std::move(obj), lru.begin()});
+    while (bytes > max_bytes) {
+        auto victim = entries.find(lru.back());
+        bytes -= victim->second.obj->size();
+        entries.erase(victim);
+        lru.pop_back();
+    }
 }
 
 } // namespace instrew
@@ -1,29 +1,132 @@
-
 #ifndef _INSTREW_SERVER_CACHE_H
 #define _INSTREW_SERVER_CACHE_H
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <filesystem>
+#include <iosfwd>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 namespace instrew {
 
+class Pack;
+
 class Cache {
 public:
     static constexpr size_t HASH_SIZE = 20;
 
-    Cache();
+    struct Stats {
+        uint64_t entries;
+        uint64_t bytes; // object data
+        uint64_t file_size;
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    Cache(); // configured with command line options
+    Cache(const std::filesystem::path& dir, bool allow_read, bool allow_write);
     ~Cache();
 
-    std::pair<int,size_t> Get(const uint8_t* hash); // returns fd (or -1) + size
+    bool Enabled() const { return allow_read || allow_write; }
+
+    /// Directory of -cachedir or the default in the home directory.
+    static std::filesystem::path DefaultDir();
+
+    /// Copy the object to obj; returns false if there is none.
+    bool Get(const uint8_t* hash, std::vector<char>& obj);
     void Put(const uint8_t* hash, size_t bufsz, const char* buf);
 
+    /// Write all entries to a new pack file or add all entries of a pack file.
+    bool Export(const std::filesystem::path& dest);
+    bool Import(const std::filesystem::path& src);
+
+    /// Write objects from Put in a background thread, unless disabled with
+    /// -cache-queue=0. The thread doesn't survive fork, so stop it before.
+    void StartWriter();
+    /// Stop the background thread after writing all queued objects.
+    void StopWriter();
+
+    bool GetStats(Stats& stats);
+    /// Keep the most recently used entries up to max_bytes, and drop entries
+    /// not used for max_age seconds; zero means no limit.
+    bool Prune(uint64_t max_bytes, uint64_t max_age);
+    /// Check all entries, report problems to os; returns the number of
+    /// invalid entries.
+    size_t Verify(std::ostream& os);
+
 private:
-    std::filesystem::path FileName(const uint8_t* hash, std::string suffix = "");
+    struct QueuedEntry {
+        uint8_t hash[HASH_SIZE];
+        std::vector<char> data;
+    };
 
-    bool allow_read;
-    bool allow_write;
+    void Open(const std::filesystem::path& dir);
+    std::shared_ptr<Pack> Current() const;
+    std::shared_ptr<Pack> Reopen(const Pack* stale);
+    std::shared_ptr<Pack> ReopenLocked(const Pack* stale);
+    void WriterMain();
+    void Write(const QueuedEntry* entries, size_t count);
+
+    bool allow_read = false;
+    bool allow_write = false;
+    uint64_t max_bytes = 0;
     std::filesystem::path path;
+
+    // Serializes replacing the pack file.
+    std::mutex mutex;
+    // Accessed with std::atomic_load/store. Users of a replaced pack keep a
+    // reference, so that it is unmapped and closed after the last use.
+    std::shared_ptr<Pack> pack;
+
+    std::thread writer;
+    // Protects queue and stop_writer.
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::vector<QueuedEntry> queue;
+    bool stop_writer = false;
+};
+
+/// In-memory objects by hash, in front of Cache, so that repeated requests in
+/// a server process (e.g., after fork) don't need the file system. The least
+/// recently used objects are dropped above -cache-memory.
+class ObjectCache {
+public:
+    using Object = std::shared_ptr<const std::vector<char>>;
+
+    ObjectCache(); // configured with command line options
+
+    Object Get(const uint8_t* hash);
+    void Put(const uint8_t* hash, Object obj);
+
+    bool Enabled() const { return max_bytes != 0; }
+    uint64_t Hits() const { return hits.load(std::memory_order_relaxed); }
+    uint64_t Misses() const { return misses.load(std::memory_order_relaxed); }
+
+private:
+    using Key = std::array<uint8_t, Cache::HASH_SIZE>;
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+    struct Entry {
+        Object obj;
+        std::list<Key>::iterator lru_it;
+    };
+
+    size_t max_bytes;
+    size_t bytes = 0;
+    std::mutex mutex;
+    std::unordered_map<Key, Entry, KeyHash> entries;
+    // Most recently used first.
+    std::list<Key> lru;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
 };
 
 } // namespace instrew
@@ -2,6 +2,7 @@
 #include "callconv.h"
 
 #include "config.h"
+#include "instrew-shadow-stack.h"
 
 #include <llvm/Analysis/ValueTracking.h>
 #include <llvm/IR/Instructions.h>
@@ -12,7 +13,9 @@
 #include <llvm/Transforms/Utils/Cloning.h>
 #include <chrono>
 #include <unistd.h>
+#include <algorithm>
 #include <bitset>
+#include <cstddef>
 #include <elf.h>
 #include <iostream>
 #include <optional>
@@ -58,6 +61,22 @@ int GetCallConvClientNumber(CallConv cc) {
     }
 }
 
+int GetCallConvPCArg(CallConv cc) {
+    switch (cc) {
+#if LL_LLVM_MAJOR < 17
+    case CallConv::HHVM: return 0;
+    case CallConv::RV64_X86_HHVM: return 0;
+    case CallConv::AARCH64_X86_HHVM: return 0;
+#endif
+    case CallConv::X86_X86_REGCALL: return 1;
+    case CallConv::RV64_X86_REGCALL: return 1;
+    case CallConv::AARCH64_X86_REGCALL: return 1;
+    case CallConv::X86_AARCH64_X: return 0;
+    case CallConv::AARCH64_AARCH64_X: return 0;
+    default: return -1;
+    }
+}
+
 static uint64_t pointerOffset(llvm::Value* base, llvm::Value* ptr,
                              const llvm::DataLayout& DL) {
     ptr = ptr->stripPointerCasts();
@@ -175,6 +194,9 @@ struct CCState {
     int sptr_ret_idx;
     llvm::Function* call_fn;
     llvm::Function* tail_fn;
+    bool shadow_stack;
+    uint64_t addr;
+    llvm::ArrayRef<uint64_t> call_ends;
 
     SptrFieldMap::value_type GetFieldIdx(size_t idx) {
         return idx < fieldmap.size() ? fieldmap[idx] : 0;
@@ -294,6 +316,174 @@ struct CCState {
         return vals;
     }
 
+    llvm::Value* ShadowStackPtr(llvm::IRBuilder<>& irb, llvm::Value* offset) {
+        unsigned sptr_as = sptr->getType()->getPointerAddressSpace();
+        llvm::Value* gep = irb.CreateGEP(irb.getInt8Ty(), sptr, offset);
+        return irb.CreatePointerCast(gep, irb.getInt64Ty()->getPointerTo(sptr_as));
+    }
+
+    // Base value and constant offset of an address, looking through casts,
+    // constant offsets and byte offsets from null.
+    std::pair<llvm::Value*, int64_t> SplitAddress(llvm::Value* val) {
+        int64_t offset = 0;
+        while (auto* op = llvm::dyn_cast<llvm::Operator>(val)) {
+            unsigned opc = op->getOpcode();
+            if (opc == llvm::Instruction::IntToPtr ||
+                opc == llvm::Instruction::PtrToInt ||
+                opc == llvm::Instruction::BitCast) {
+                val = op->getOperand(0);
+            } else if (auto* gep = llvm::dyn_cast<llvm::GEPOperator>(op)) {
+                llvm::APInt gep_off(DL.getIndexTypeSizeInBits(gep->getType()), 0);
+                if (gep->accumulateConstantOffset(DL, gep_off)) {
+                    offset += gep_off.getSExtValue();
+                    val = gep->getPointerOperand();
+                } else if (gep->getNumIndices() == 1 &&
+                           gep->getSourceElementType()->isIntegerTy(8) &&
+                           llvm::isa<llvm::ConstantPointerNull>(gep->getPointerOperand())) {
+                    val = gep->getOperand(1);
+                } else {
+                    break;
+                }
+            } else if (opc == llvm::Instruction::Add || opc == llvm::Instruction::Sub) {
+                auto* cnst = llvm::dyn_cast<llvm::ConstantInt>(op->getOperand(1));
+                if (!cnst)
+                    break;
+                offset += opc == llvm::Instruction::Add ? cnst->getSExtValue()
+                                                        : -cnst->getSExtValue();
+                val = op->getOperand(0);
+            } else {
+                break;
+            }
+        }
+        return {val, offset};
+    }
+
+    // Return address of a call: the last store to guest memory before the
+    // function returns must write the address following a call, i.e. the end
+    // of a decoded code range, to the outgoing stack pointer. nullptr if the
+    // function doesn't end with a call, e.g. for push+jmp sequences.
+    llvm::Value* PushedReturnAddress(llvm::Instruction* ret, FoldedStores& vals) {
+        int spFieldIdx = GetFieldIdx(SptrFields::x86_64::RSP.offset);
+        if (spFieldIdx <= 0 || call_ends.empty())
+            return nullptr;
+        llvm::Value* sp = vals[spFieldIdx - 1];
+        unsigned sptr_as = sptr->getType()->getPointerAddressSpace();
+
+        llvm::StoreInst* store = nullptr;
+        auto end = ret->getParent()->rend();
+        for (auto it = ++ret->getReverseIterator(); it != end; ++it) {
+            if (llvm::isa<llvm::CallInst>(&*it))
+                return nullptr;
+            store = llvm::dyn_cast<llvm::StoreInst>(&*it);
+            if (store && store->getPointerAddressSpace() != sptr_as)
+                break;
+            store = nullptr;
+        }
+        if (!store || SplitAddress(store->getPointerOperand()) != SplitAddress(sp))
+            return nullptr;
+
+        // Position-independent addresses are relative to the function.
+        llvm::Value* val = store->getValueOperand();
+        uint64_t ret_addr;
+        if (!FuncConstName(val))
+            return nullptr;
+        if (auto* cnst = llvm::dyn_cast<llvm::ConstantInt>(val)) {
+            ret_addr = cnst->getZExtValue();
+        } else {
+            auto* expr = llvm::cast<llvm::ConstantExpr>(val);
+            ret_addr = addr + llvm::cast<llvm::ConstantInt>(expr->getOperand(1))->getZExtValue();
+        }
+        if (std::find(call_ends.begin(), call_ends.end(), ret_addr) == call_ends.end())
+            return nullptr;
+        return val;
+    }
+
+    // Without call-ret lifting, guest calls and returns leave the function.
+    // Calls, which store a constant return address to guest memory last, push
+    // it with a reference to its code. Returns, whose target is loaded from
+    // guest memory, pop the top and continue there if it matches the target.
+    void UpdateShadowStack(llvm::Instruction* ret, FoldedStores& vals) {
+        int pcFieldIdx = GetFieldIdx(0);
+        if (pcFieldIdx <= 0)
+            return;
+        llvm::Value* pc = vals[pcFieldIdx - 1];
+        unsigned sptr_as = sptr->getType()->getPointerAddressSpace();
+
+        llvm::Value* ret_addr = PushedReturnAddress(ret, vals);
+
+        auto* load = llvm::dyn_cast<llvm::LoadInst>(pc);
+        bool is_ret = load && load->getPointerAddressSpace() != sptr_as;
+        if (!ret_addr && !is_ret)
+            return;
+
+        using SS = InstrewShadowStack;
+        constexpr uint64_t mask = INSTREW_SHADOW_STACK_ENTRIES - 1;
+        constexpr uint64_t entry_size = sizeof(SS::entries[0]);
+        constexpr uint64_t top_off = INSTREW_SHADOW_STACK_OFFSET + offsetof(SS, top);
+        constexpr uint64_t entries_off = INSTREW_SHADOW_STACK_OFFSET + offsetof(SS, entries);
+
+        llvm::LLVMContext& ctx = nfn->getContext();
+        llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+        llvm::FunctionType* fn_ty = nfn->getFunctionType();
+        llvm::IRBuilder<> irb(ret);
+        llvm::Value* top_ptr = ShadowStackPtr(irb, irb.getInt64(top_off));
+        llvm::Value* top = irb.CreateLoad(i64, top_ptr);
+        if (ret_addr) {
+            auto fnc = nfn->getParent()->getOrInsertFunction(*FuncConstName(ret_addr), fn_ty);
+            auto* cont = llvm::cast<llvm::Function>(fnc.getCallee());
+            cont->copyAttributesFrom(nfn);
+            cont->setDSOLocal(true);
+
+            llvm::Value* idx = irb.CreateAnd(top, mask);
+            llvm::Value* off = irb.CreateAdd(irb.CreateMul(idx, irb.getInt64(entry_size)),
+                                             irb.getInt64(entries_off));
+            irb.CreateStore(ret_addr, ShadowStackPtr(irb, off));
+            off = irb.CreateAdd(off, irb.getInt64(8));
+            irb.CreateStore(irb.CreatePtrToInt(cont, i64), ShadowStackPtr(irb, off));
+            irb.CreateStore(irb.CreateAdd(top, irb.getInt64(1)), top_ptr);
+            return;
+        }
+
+        llvm::Value* new_top = irb.CreateSub(top, irb.getInt64(1));
+        llvm::Value* idx = irb.CreateAnd(new_top, mask);
+        llvm::Value* off = irb.CreateAdd(irb.CreateMul(idx, irb.getInt64(entry_size)),
+                                         irb.getInt64(entries_off));
+        llvm::Value* expected = irb.CreateLoad(i64, ShadowStackPtr(irb, off));
+
+        // bb: compare with the top; hit_bb: pop and tail call of the entry;
+        // ret_bb: return to the dispatcher.
+        llvm::BasicBlock* bb = ret->getParent();
+        llvm::BasicBlock* ret_bb = bb->splitBasicBlock(ret);
+        auto* hit_bb = llvm::BasicBlock::Create(ctx, "", nfn, ret_bb);
+        bb->getTerminator()->eraseFromParent();
+        irb.SetInsertPoint(bb);
+        irb.CreateCondBr(irb.CreateICmpEQ(expected, pc), hit_bb, ret_bb);
+
+        irb.SetInsertPoint(hit_bb);
+        irb.CreateStore(new_top, top_ptr);
+        off = irb.CreateAdd(off, irb.getInt64(8));
+        llvm::Value* entry = irb.CreateLoad(i64, ShadowStackPtr(irb, off));
+        entry = irb.CreateIntToPtr(entry, fn_ty->getPointerTo());
+
+        llvm::SmallVector<llvm::Value*, SPTR_MAX_CNT+1> params;
+        params.resize(fn_ty->getNumParams());
+        for (unsigned i = 0; i < params.size(); i++)
+            params[i] = llvm::UndefValue::get(fn_ty->getParamType(i));
+        params[sptr->getArgNo()] = sptr;
+        for (unsigned i = 0; i < fields.size(); i++) {
+            llvm::Value* val = vals[i];
+            llvm::Type* param_ty = fn_ty->getParamType(fields[i].argidx);
+            if (val->getType() != param_ty)
+                val = irb.CreateBitCast(val, param_ty);
+            params[fields[i].argidx] = val;
+        }
+        auto* call = irb.CreateCall(fn_ty, entry, params);
+        call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+        call->setCallingConv(nfn->getCallingConv());
+        call->setAttributes(nfn->getAttributes());
+        irb.CreateRet(call);
+    }
+
     void UpdateCallRet(llvm::Instruction* callret, FoldedStores& vals) {
         llvm::IRBuilder<> irb(callret);
         auto ret_ty = llvm::cast<llvm::StructType>(nfn->getReturnType());
@@ -341,6 +531,10 @@ struct CCState {
             newcall->setAttributes(tgt->getAttributes());
             call->replaceAllUsesWith(newcall);
         } else {
+            if (shadow_stack) {
+                UpdateShadowStack(callret, vals);
+                irb.SetInsertPoint(callret);
+            }
             llvm::Value* ret_val = llvm::UndefValue::get(ret_ty);
             if (sptr_ret_idx >= 0) {
                 unsigned idx_u = static_cast<unsigned>(sptr_ret_idx);
@@ -394,7 +588,9 @@ struct CCState {
     }
 };
 
-llvm::Function* ChangeCallConv(llvm::Function* fn, CallConv cc) {
+llvm::Function* ChangeCallConv(llvm::Function* fn, CallConv cc,
+                               bool shadow_stack, uint64_t addr,
+                               llvm::ArrayRef<uint64_t> call_ends) {
     if (cc == CallConv::CDECL)
         return fn;
 
@@ -652,7 +848,8 @@ llvm::Function* ChangeCallConv(llvm::Function* fn, CallConv cc) {
         assert(false && "unsupported Instrew calling convention!");
     }
 
-    CCState ccs{DL, nfn, sptr, *fieldmap, fields, sptr_ret_idx, call_fn, tail_fn};
+    CCState ccs{DL, nfn, sptr, *fieldmap, fields, sptr_ret_idx, call_fn, tail_fn,
+                shadow_stack && !call_fn_cdecl, addr, call_ends};
 
     // Move basic blocks from one function to another. Because all code is
     // unoptimized at this point, copying (either by CloneFunctionInto or
@@ -874,3 +1071,96 @@ end_escape:
 
     return nfn;
 }
+
+bool IsDispatchCall(llvm::CallInst* call, int pc_arg) {
+    llvm::Function* callee = call->getCalledFunction();
+    if (pc_arg < 0 || !callee || !callee->isDeclaration())
+        return false;
+    llvm::StringRef name = callee->getName();
+    if (name != "instrew_quick_dispatch" && name != "instrew_tail_hhvm" &&
+        name != "instrew_call_hhvm")
+        return false;
+    return !llvm::isa<llvm::Constant>(call->getArgOperand(pc_arg));
+}
+
+void InsertInlineCaches(llvm::Function* fn, CallConv cc) {
+    int pc_arg = GetCallConvPCArg(cc);
+    llvm::SmallVector<llvm::CallInst*, 8> sites;
+    for (llvm::BasicBlock& bb : *fn)
+        for (llvm::Instruction& inst : bb)
+            if (auto* call = llvm::dyn_cast<llvm::CallInst>(&inst))
+                if (IsDispatchCall(call, pc_arg))
+                    sites.push_back(call);
+
+    llvm::Module* mod = fn->getParent();
+    llvm::LLVMContext& ctx = fn->getContext();
+    llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+    for (llvm::CallInst* call : sites) {
+        llvm::FunctionType* fn_ty = call->getFunctionType();
+        llvm::Type* fn_ptr_ty = fn_ty->getPointerTo();
+        auto* miss_fn = llvm::cast<llvm::Function>(mod->getOrInsertFunction("instrew_ic_miss", fn_ty).getCallee());
+        miss_fn->setDSOLocal(true);
+
+        // Layout of RtldInlineCache in the client: target, entry, miss and
+        // dispatcher. The client resolves instrew_ic_miss to a patch stub,
+        // which fills the slot and replaces miss with the dispatcher.
+        auto* slot_ty = llvm::StructType::get(i64, fn_ptr_ty, fn_ptr_ty, fn_ptr_ty);
+        llvm::Constant* init = llvm::ConstantStruct::get(slot_ty, {
+            llvm::ConstantInt::get(i64, 0),
+            llvm::Constant::getNullValue(fn_ptr_ty),
+            miss_fn,
+            call->getCalledFunction(),
+        });
+        // The slot ends up in a writable data section of the object.
+        auto* slot = new llvm::GlobalVariable(*mod, slot_ty, false,
+                                              llvm::GlobalValue::InternalLinkage,
+                                              init, "instrew_ic");
+
+        // bb: compare with the cached target; hit_bb: call of the cached
+        // entry; miss_bb: original call through the miss pointer. Calls which
+        // return to this function continue in cont_bb.
+        llvm::BasicBlock* bb = call->getParent();
+        llvm::BasicBlock* miss_bb = bb->splitBasicBlock(call);
+        llvm::BasicBlock* cont_bb = nullptr;
+        if (!call->isMustTailCall())
+            cont_bb = miss_bb->splitBasicBlock(call->getNextNode());
+        auto* hit_bb = llvm::BasicBlock::Create(ctx, "", fn, miss_bb);
+
+        // The slot is written by the client, so all loads are volatile. The
+        // entry is written before the target.
+        bb->getTerminator()->eraseFromParent();
+        llvm::IRBuilder<> irb(bb);
+        llvm::LoadInst* tag = irb.CreateLoad(i64, irb.CreateConstGEP2_32(slot_ty, slot, 0, 0));
+        tag->setVolatile(true);
+        tag->setAtomic(llvm::AtomicOrdering::Acquire);
+        irb.CreateCondBr(irb.CreateICmpEQ(tag, call->getArgOperand(pc_arg)),
+                         hit_bb, miss_bb);
+
+        irb.SetInsertPoint(hit_bb);
+        llvm::LoadInst* entry = irb.CreateLoad(fn_ptr_ty, irb.CreateConstGEP2_32(slot_ty, slot, 0, 1));
+        entry->setVolatile(true);
+        auto* hit_call = llvm::cast<llvm::CallInst>(call->clone());
+        hit_call->setCalledOperand(entry);
+        irb.Insert(hit_call);
+        if (!cont_bb) {
+            if (hit_call->getType()->isVoidTy())
+                irb.CreateRetVoid();
+            else
+                irb.CreateRet(hit_call);
+        } else {
+            irb.CreateBr(cont_bb);
+            if (!call->getType()->isVoidTy()) {
+                irb.SetInsertPoint(&cont_bb->front());
+                llvm::PHINode* phi = irb.CreatePHI(call->getType(), 2);
+                call->replaceAllUsesWith(phi);
+                phi->addIncoming(call, miss_bb);
+                phi->addIncoming(hit_call, hit_bb);
+            }
+        }
+
+        irb.SetInsertPoint(call);
+        llvm::LoadInst* miss = irb.CreateLoad(fn_ptr_ty, irb.CreateConstGEP2_32(slot_ty, slot, 0, 2));
+        miss->setVolatile(true);
+        call->setCalledOperand(miss);
+    }
+}
@@ -2,7 +2,10 @@
 #ifndef _INSTREW_SERVER_CALLCONV_H
 #define _INSTREW_SERVER_CALLCONV_H
 
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <cstdint>
 
 
 enum class CallConv {
@@ -22,6 +25,22 @@ enum class CallConv {
 
 CallConv GetFastCC(int host_arch, int guest_arch);
 int GetCallConvClientNumber(CallConv cc);
-llvm::Function* ChangeCallConv(llvm::Function* fn, CallConv cc);
+/// Parameter index of the guest PC, or -1 for CDECL where it is in memory.
+int GetCallConvPCArg(CallConv cc);
+/// With shadow_stack, calls and returns of code lifted without call-ret use
+/// the shadow stack of the client, see instrew-shadow-stack.h. Calls are
+/// only recognized by a return address in call_ends, the ends of the code
+/// ranges decoded for fn at addr.
+llvm::Function* ChangeCallConv(llvm::Function* fn, CallConv cc,
+                               bool shadow_stack = false, uint64_t addr = 0,
+                               llvm::ArrayRef<uint64_t> call_ends = {});
+
+/// Whether call is a dispatcher call of a function after ChangeCallConv with a
+/// target only known at run time.
+bool IsDispatchCall(llvm::CallInst* call, int pc_arg);
+/// Guard all dispatcher calls of a function after ChangeCallConv with an
+/// inline cache: a slot of the last target and its entry, which the client
+/// fills on the first miss. Further misses go to the dispatcher.
+void InsertInlineCaches(llvm::Function* fn, CallConv cc);
 
 #endif
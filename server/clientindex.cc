@@ -0,0 +1,149 @@
+#include "clientindex.h"
+
+#include "instrew-index.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <unistd.h>
+
+namespace instrew {
+
+namespace {
+
+constexpr uint64_t INDEX_ALIGN = 8;
+
+uint64_t AlignUp(uint64_t val) {
+    return (val + INDEX_ALIGN - 1) & ~(INDEX_ALIGN - 1);
+}
+
+} // end anonymous namespace
+
+bool ClientIndex::Load(const std::filesystem::path& path) {
+    entries.clear();
+    std::ifstream is(path, std::ios::binary);
+    if (!is)
+        return false;
+    std::vector<char> buf((std::istreambuf_iterator<char>(is)),
+                          std::istreambuf_iterator<char>());
+
+    InstrewIndexHdr hdr;
+    if (buf.size() < sizeof(hdr))
+        return false;
+    std::memcpy(&hdr, buf.data(), sizeof(hdr));
+    uint64_t ranges_offset = sizeof(hdr) + hdr.entry_count * sizeof(InstrewIndexEntry);
+    if (hdr.magic != INSTREW_INDEX_MAGIC || hdr.file_size != buf.size() ||
+        hdr.range_count > buf.size() ||
+        ranges_offset + hdr.range_count * sizeof(InstrewIndexRange) > buf.size())
+        return false;
+
+    for (uint32_t i = 0; i < hdr.entry_count; i++) {
+        InstrewIndexEntry ie;
+        std::memcpy(&ie, &buf[sizeof(hdr) + i * sizeof(ie)], sizeof(ie));
+        if (uint64_t{ie.range_idx} + ie.range_count > hdr.range_count ||
+            ie.obj_offset > buf.size() || ie.obj_size > buf.size() - ie.obj_offset) {
+            entries.clear();
+            return false;
+        }
+        Entry entry;
+        uint64_t code_size = 0;
+        for (uint32_t j = 0; j < ie.range_count; j++) {
+            InstrewIndexRange range;
+            std::memcpy(&range, &buf[ranges_offset + (ie.range_idx + j) * sizeof(range)], sizeof(range));
+            if (range.end < range.start || range.end - range.start > buf.size()) {
+                entries.clear();
+                return false;
+            }
+            entry.ranges.emplace_back(range.start, range.end);
+            code_size += range.end - range.start;
+        }
+        if (ie.code_offset > buf.size() || code_size > buf.size() - ie.code_offset) {
+            entries.clear();
+            return false;
+        }
+        entry.code.assign(&buf[ie.code_offset], &buf[ie.code_offset] + code_size);
+        entry.obj.assign(&buf[ie.obj_offset], &buf[ie.obj_offset] + ie.obj_size);
+        entry.stamp = ie.stamp;
+        entries[ie.addr] = std::move(entry);
+    }
+    return true;
+}
+
+bool ClientIndex::Save(const std::filesystem::path& path) const {
+    InstrewIndexHdr hdr{INSTREW_INDEX_MAGIC, static_cast<uint32_t>(entries.size()), 0, 0};
+    for (const auto& [addr, entry] : entries)
+        hdr.range_count += entry.ranges.size();
+    uint64_t offset = AlignUp(sizeof(hdr) + entries.size() * sizeof(InstrewIndexEntry) +
+                              hdr.range_count * sizeof(InstrewIndexRange));
+
+    // Each entry's code is followed by its object.
+    std::vector<InstrewIndexEntry> index_entries;
+    std::vector<InstrewIndexRange> ranges;
+    for (const auto& [addr, entry] : entries) {
+        uint64_t obj_offset = AlignUp(offset + entry.code.size());
+        index_entries.push_back(InstrewIndexEntry{addr,
+                static_cast<uint32_t>(ranges.size()),
+                static_cast<uint32_t>(entry.ranges.size()),
+                offset, obj_offset, entry.obj.size(), entry.stamp});
+        for (const auto& range : entry.ranges)
+            ranges.push_back(InstrewIndexRange{range.first, range.second});
+        offset = AlignUp(obj_offset + entry.obj.size());
+    }
+    hdr.file_size = offset;
+
+    std::filesystem::path tmp = path;
+    tmp += ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+        static const char padding[INDEX_ALIGN] = {};
+        os.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        os.write(reinterpret_cast<const char*>(index_entries.data()),
+                 index_entries.size() * sizeof(InstrewIndexEntry));
+        os.write(reinterpret_cast<const char*>(ranges.data()),
+                 ranges.size() * sizeof(InstrewIndexRange));
+        uint64_t pos = sizeof(hdr) + index_entries.size() * sizeof(InstrewIndexEntry) +
+                       ranges.size() * sizeof(InstrewIndexRange);
+        for (const auto& [addr, entry] : entries) {
+            os.write(padding, AlignUp(pos) - pos);
+            os.write(reinterpret_cast<const char*>(entry.code.data()), entry.code.size());
+            pos = AlignUp(pos) + entry.code.size();
+            os.write(padding, AlignUp(pos) - pos);
+            os.write(entry.obj.data(), entry.obj.size());
+            pos = AlignUp(pos) + entry.obj.size();
+        }
+        os.write(padding, AlignUp(pos) - pos);
+        if (!os.flush()) {
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void ClientIndex::Put(uint64_t addr, Entry entry) {
+    entries[addr] = std::move(entry);
+}
+
+void ClientIndex::Prune(uint64_t max_bytes) {
+    std::vector<std::pair<uint64_t, uint64_t>> by_stamp; // stamp, addr
+    for (const auto& [addr, entry] : entries)
+        by_stamp.emplace_back(entry.stamp, addr);
+    std::sort(by_stamp.begin(), by_stamp.end(), std::greater<>());
+    uint64_t bytes = 0;
+    for (const auto& [stamp, addr] : by_stamp) {
+        auto it = entries.find(addr);
+        bytes += AlignUp(it->second.code.size()) + AlignUp(it->second.obj.size());
+        if (bytes > max_bytes)
+            entries.erase(it);
+    }
+}
+
+} // namespace instrew
@@ -0,0 +1,44 @@
+#ifndef _INSTREW_SERVER_CLIENTINDEX_H
+#define _INSTREW_SERVER_CLIENTINDEX_H
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace instrew {
+
+/// Objects of a binary with the code ranges they were translated from, which
+/// the client maps and uses without asking the server (-client-index). See
+/// instrew-index.h for the format.
+class ClientIndex {
+public:
+    struct Entry {
+        std::vector<uint8_t> code; // bytes of the code ranges, in order
+        std::vector<std::pair<uint64_t, uint64_t>> ranges; // [start, end)
+        std::vector<char> obj;
+        uint64_t stamp = 0; // seconds since the epoch when last sent
+    };
+
+    /// Read an index; a missing or malformed file gives an empty index.
+    bool Load(const std::filesystem::path& path);
+    /// Replace the file atomically, clients may map it concurrently.
+    bool Save(const std::filesystem::path& path) const;
+
+    /// Add or replace the entry for addr.
+    void Put(uint64_t addr, Entry entry);
+    /// Keep the most recently sent entries with code and objects up to
+    /// max_bytes.
+    /// Entries the client uses itself age as well, the server sends them
+    /// again after they are dropped.
+    void Prune(uint64_t max_bytes);
+    size_t Size() const { return entries.size(); }
+
+private:
+    std::map<uint64_t, Entry> entries;
+};
+
+} // namespace instrew
+
+#endif
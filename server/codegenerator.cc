@@ -21,6 +21,8 @@
 #include <cstdlib>
 #include <elf.h>
 #include <iostream>
+#include <mutex>
+#include <vector>
 
 
 namespace {
@@ -34,22 +36,32 @@ llvm::cl::opt<unsigned> targetopt("targetopt", llvm::cl::init(2),
 
 class CodeGenerator::impl {
 private:
-    llvm::SmallVectorImpl<char>& obj_buffer;
+    int32_t host_arch;
+    int32_t stack_alignment;
+    bool pic;
+    bool fast;
+    // The target writes here, the object is swapped into the caller's buffer,
+    // so that the target doesn't depend on its user, see Prepare.
+    llvm::SmallVector<char, 0> obj_buffer;
     llvm::raw_svector_ostream obj_stream;
     llvm::MCContext* mc_ctx;
     std::unique_ptr<llvm::TargetMachine> target;
     llvm::legacy::PassManager mc_pass_manager;
 
 public:
-    impl(const IWServerConfig& server_config, bool pic,
-         llvm::SmallVectorImpl<char> &o)
-            : obj_buffer(o), obj_stream(o), mc_ctx(nullptr), mc_pass_manager() {
+    impl(const IWServerConfig& server_config, bool pic, bool fast)
+            : host_arch(server_config.tsc_host_arch),
+              stack_alignment(server_config.tsc_stack_alignment),
+              pic(pic), fast(fast), obj_stream(obj_buffer), mc_ctx(nullptr),
+              mc_pass_manager() {
         llvm::InitializeNativeTarget();
         llvm::InitializeNativeTargetAsmPrinter();
         llvm::InitializeNativeTargetAsmParser();
 
+        unsigned optlevel = fast ? 0 : unsigned(targetopt);
+
         llvm::TargetOptions target_options;
-        target_options.EnableFastISel = targetopt == 0; // Use FastISel for CodeGenOpt::None
+        target_options.EnableFastISel = optlevel == 0; // Use FastISel for CodeGenOpt::None
 #if LL_LLVM_MAJOR < 13
         // In LLVM13+, Module::setOverrideStackAlignment is used instead.
         if (server_config.tsc_stack_alignment != 0)
@@ -92,9 +104,9 @@ public:
             /*RelocModel=*/rm,
             /*CodeModel=*/cm,
 #if LL_LLVM_MAJOR < 18
-            /*OptLevel=*/static_cast<llvm::CodeGenOpt::Level>(unsigned(targetopt)),
+            /*OptLevel=*/static_cast<llvm::CodeGenOpt::Level>(optlevel),
 #else
-            /*OptLevel=*/llvm::CodeGenOpt::getLevel(targetopt).value_or(llvm::CodeGenOptLevel::Default),
+            /*OptLevel=*/llvm::CodeGenOpt::getLevel(optlevel).value_or(llvm::CodeGenOptLevel::Default),
 #endif
             /*JIT=*/true
         ));
@@ -110,18 +122,71 @@ public:
         }
     }
 
-    void GenerateCode(llvm::Module* mod) {
+    bool Matches(const IWServerConfig& server_config, bool pic, bool fast) const {
+        return host_arch == server_config.tsc_host_arch &&
+               stack_alignment == server_config.tsc_stack_alignment &&
+               this->pic == pic && this->fast == fast;
+    }
+
+    llvm::DataLayout GetDataLayout() const {
+        return target->createDataLayout();
+    }
+
+    void GenerateCode(llvm::Module* mod, llvm::SmallVectorImpl<char>& out) {
         mod->setDataLayout(target->createDataLayout());
         obj_buffer.clear();
         mc_pass_manager.run(*mod);
+        out.swap(obj_buffer);
     }
 };
 
 CodeGenerator::CodeGenerator(const IWServerConfig& sc, bool pic,
-                             llvm::SmallVectorImpl<char>& o)
-        : pimpl{std::make_unique<impl>(sc, pic, o)} {}
+                             llvm::SmallVectorImpl<char>& o, bool fast)
+        : server_config(sc), pic(pic), fast(fast), obj_buffer(o) {}
 CodeGenerator::~CodeGenerator() {}
-void CodeGenerator::GenerateCode(llvm::Module* m) { pimpl->GenerateCode(m); }
+void CodeGenerator::GenerateCode(llvm::Module* m) {
+    // Runs with all objects from the cache never need the target.
+    if (!pimpl)
+        pimpl = TakePrepared(server_config, pic, fast);
+    pimpl->GenerateCode(m, obj_buffer);
+}
+llvm::DataLayout CodeGenerator::GetDataLayout() {
+    if (!pimpl)
+        pimpl = TakePrepared(server_config, pic, fast);
+    return pimpl->GetDataLayout();
+}
+
+namespace {
+
+// Protects the prepared targets, which worker threads take concurrently.
+std::mutex prepared_mutex;
+
+} // end anonymous namespace
+
+std::vector<std::unique_ptr<CodeGenerator::impl>> CodeGenerator::prepared;
+
+void CodeGenerator::Prepare(const IWServerConfig& server_config, bool pic,
+                            bool fast) {
+    auto target = std::make_unique<impl>(server_config, pic, fast);
+    std::lock_guard<std::mutex> lock(prepared_mutex);
+    prepared.push_back(std::move(target));
+}
+
+std::unique_ptr<CodeGenerator::impl>
+CodeGenerator::TakePrepared(const IWServerConfig& server_config, bool pic,
+                            bool fast) {
+    {
+        std::lock_guard<std::mutex> lock(prepared_mutex);
+        for (auto it = prepared.begin(); it != prepared.end(); ++it) {
+            if ((*it)->Matches(server_config, pic, fast)) {
+                std::unique_ptr<impl> res = std::move(*it);
+                prepared.erase(it);
+                return res;
+            }
+        }
+    }
+    return std::make_unique<impl>(server_config, pic, fast);
+}
 
 void CodeGenerator::appendConfig(llvm::SmallVectorImpl<uint8_t>& buffer) const {
     struct {
@@ -3,24 +3,48 @@
 #define _INSTREW_SERVER_CODE_GENERATOR_H
 
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Module.h>
 
+#include <memory>
+#include <vector>
+
 
 struct IWServerConfig;
 
 class CodeGenerator {
 public:
+    /// With fast set, always use the lowest optimization level and FastISel,
+    /// independent of -targetopt. The target is only set up at the first
+    /// GenerateCode, so server_config must remain valid until then.
     CodeGenerator(const IWServerConfig& server_config, bool pic,
-                  llvm::SmallVectorImpl<char> &o);
+                  llvm::SmallVectorImpl<char> &o, bool fast = false);
     ~CodeGenerator();
     void GenerateCode(llvm::Module* mod);
+    /// Data layout of the target, which lifting and optimization need as
+    /// well; sets up the target.
+    llvm::DataLayout GetDataLayout();
+
+    /// Set up a target ahead of time, e.g. in the daemon before it forks
+    /// servers. The first code generator with the same configuration takes it
+    /// over instead of setting up its own.
+    static void Prepare(const IWServerConfig& server_config, bool pic,
+                        bool fast = false);
 
     /// Dump code generator configuration into the buffer.
     void appendConfig(llvm::SmallVectorImpl<uint8_t>& buffer) const;
 
 private:
     class impl;
+    static std::unique_ptr<impl> TakePrepared(const IWServerConfig& server_config,
+                                              bool pic, bool fast);
+    // Targets from Prepare that no code generator took yet.
+    static std::vector<std::unique_ptr<impl>> prepared;
     std::unique_ptr<impl> pimpl;
+    const IWServerConfig& server_config;
+    bool pic;
+    bool fast;
+    llvm::SmallVectorImpl<char>& obj_buffer;
 };
 
 #endif
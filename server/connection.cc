@@ -2,32 +2,64 @@
 #include "connection.h"
 
 #include "cache.h"
+#include "clientindex.h"
 #include "config.h"
+#include "imagemap.h"
+#include "instrew-link.h"
+#include "linker.h"
 
+#include <llvm/Support/BLAKE3.h>
 #include <llvm/Support/CommandLine.h>
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <condition_variable>
 #include <cstddef>
+#include <csignal>
 #include <cstdio>
 #include <cstdint>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <sys/mman.h>
-#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 
 namespace {
 
 llvm::cl::opt<bool> dumpObjects("dumpobj", llvm::cl::desc("Dump compiled object files"), llvm::cl::Hidden, llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<bool> directMemory("direct-memory", llvm::cl::desc("Read guest memory with process_vm_readv if possible (default: true)"), llvm::cl::init(true), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<bool> shmObjects("shm-objects", llvm::cl::desc("Place objects in memory shared with the client (default: true)"), llvm::cl::init(true), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<bool> serverLink("server-link", llvm::cl::desc("Link objects for their final location in the client"), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<bool> clientIndex("client-index", llvm::cl::desc("Let clients load objects of earlier runs of a binary from an index file without asking the server"), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<uint64_t> clientIndexMaxSize("client-index-max-size", llvm::cl::desc("Keep the most recently sent objects up to this size in MiB in a client index (default: 64)"), llvm::cl::init(64), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<bool> snapshotCode("snapshot", llvm::cl::desc("Let clients of static binaries save their translated code at exit and restore it at the next start"), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<bool> prewarm("prewarm", llvm::cl::desc("Record the functions a binary executes and send their cached objects at once in the next run (needs -cache)"), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<unsigned> numThreads("threads", llvm::cl::desc("Number of translation worker threads (default: 1)"), llvm::cl::init(1), llvm::cl::cat(InstrewCategory));
 llvm::cl::opt<std::string> Stub("stub", llvm::cl::desc("Path for instrew client stub (default: built-in stub). Only useful for debugging."), llvm::cl::value_desc("instrew-client"), llvm::cl::Hidden, llvm::cl::cat(InstrewCategory));
-llvm::cl::opt<std::string> Program(llvm::cl::Positional, llvm::cl::desc("<program>"), llvm::cl::Required);
+llvm::cl::opt<std::string> daemonSocket("daemon", llvm::cl::desc("Serve clients connecting to this UNIX socket with warmed-up servers instead of running a program"), llvm::cl::value_desc("socket"), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<std::string> connectSocket("connect", llvm::cl::desc("Run the program with a server of the daemon listening on this UNIX socket"), llvm::cl::value_desc("socket"), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<std::string> Program(llvm::cl::Positional, llvm::cl::desc("<program>"));
 llvm::cl::list<std::string> ProgramArgs(llvm::cl::ConsumeAfter, llvm::cl::desc("<arguments>..."));
 
 struct HexBuffer {
@@ -81,6 +113,9 @@ public:
         return static_cast<Msg::Id>(recv_hdr.id);
     }
 
+    size_t RemainingSize() const {
+        return recv_hdr.sz;
+    }
     void Read(void* buf, size_t size) {
         if (static_cast<size_t>(recv_hdr.sz) < size)
             assert(false && "message too small");
@@ -108,16 +143,6 @@ public:
         if (wr_hdr.sz == 0)
             std::fflush(file);
     }
-    void Sendfile(int fd, size_t size) {
-        std::fflush(file);
-        while (size) {
-            ssize_t cnt = sendfile(fileno(file), fd, nullptr, size);
-            if (cnt < 0)
-                assert(false && "unable to write msg content (sendfile)");
-            size -= cnt;
-        }
-        wr_hdr.sz -= size;
-    }
     template<typename T>
     void SendMsg(Msg::Id id, const T& val) {
         SendMsgHdr(id, sizeof(T));
@@ -152,15 +177,10 @@ public:
     }
 };
 
-int CreateChild(char* argv0) {
-    int fds[2];
-    int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[0]);
-    if (ret < 0) {
-        perror("socketpair");
-        std::exit(1);
-    }
-
-    std::string client_config = std::to_string(fds[1]);
+/// Replace this process with the client, connected to the server on fd.
+[[noreturn]] void ExecClient(const char* argv0, int fd, pid_t server_pid) {
+    // Tell the client our pid, so that it can allow us to read its memory.
+    std::string client_config = std::to_string(fd) + ":" + std::to_string(server_pid);
 
     std::vector<const char*> exec_args;
     exec_args.reserve(ProgramArgs.size() + 4);
@@ -171,13 +191,12 @@ int CreateChild(char* argv0) {
         exec_args.push_back(uarg.c_str());
     exec_args.push_back(nullptr);
 
-    int memfd = -1;
     if (Stub.empty()) {
         static const unsigned char instrew_stub[] = {
     #include "client.inc"
         };
 
-        memfd = memfd_create("instrew_stub", MFD_CLOEXEC);
+        int memfd = memfd_create("instrew_stub", MFD_CLOEXEC);
         if (memfd < 0) {
             perror("memfd_create");
             std::exit(1);
@@ -192,6 +211,20 @@ int CreateChild(char* argv0) {
             }
             written += wres;
         }
+        fexecve(memfd, const_cast<char* const*>(&exec_args[0]), environ);
+    } else {
+        execve(Stub.c_str(), const_cast<char* const*>(&exec_args[0]), environ);
+    }
+    perror("fexecve");
+    std::exit(1);
+}
+
+int CreateChild(char* argv0) {
+    int fds[2];
+    int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[0]);
+    if (ret < 0) {
+        perror("socketpair");
+        std::exit(1);
     }
 
     pid_t forkres = fork();
@@ -200,19 +233,88 @@ int CreateChild(char* argv0) {
         std::exit(1);
     } else if (forkres > 0) {
         close(fds[0]);
-        if (memfd >= 0)
-            fexecve(memfd, const_cast<char* const*>(&exec_args[0]), environ);
-        else
-            execve(Stub.c_str(), const_cast<char* const*>(&exec_args[0]), environ);
-        perror("fexecve");
-        std::exit(1);
+        ExecClient(argv0, fds[1], forkres);
     }
-    if (memfd >= 0)
-        close(memfd);
     close(fds[1]);
     return fds[0];
 }
 
+bool SocketAddress(const std::string& path, struct sockaddr_un& addr) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "error: socket path too long: " << path << std::endl;
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+/// Run the client with a server of the daemon at -connect. The daemon forks
+/// the server, so the permission to read our memory extends to it.
+[[noreturn]] void ConnectDaemon(char* argv0) {
+    struct sockaddr_un addr;
+    if (!SocketAddress(connectSocket, addr))
+        std::exit(1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        perror("connect");
+        std::exit(1);
+    }
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+        perror("getsockopt");
+        std::exit(1);
+    }
+
+    // The server needs the program for per-binary state, e.g. -prewarm. It
+    // runs in the daemon's working directory, so resolve the path here.
+    std::error_code ec;
+    std::string program = std::filesystem::canonical(static_cast<std::string>(Program), ec);
+    if (ec)
+        program = Program;
+    std::vector<char> msg(sizeof(Msg::Hdr) + program.size());
+    Msg::Hdr hdr{Msg::C_PROGRAM, static_cast<int32_t>(program.size())};
+    std::memcpy(msg.data(), &hdr, sizeof(hdr));
+    std::memcpy(msg.data() + sizeof(hdr), program.data(), program.size());
+    if (write(fd, msg.data(), msg.size()) != static_cast<ssize_t>(msg.size())) {
+        perror("write");
+        std::exit(1);
+    }
+    ExecClient(argv0, fd, cred.pid);
+}
+
+// Set on translation worker threads, which must not use the connection.
+thread_local bool isWorkerThread = false;
+// Job of the current worker thread, see JobKey.
+thread_local uint64_t workerJobKey = 0;
+// Set when a worker's memory request was abandoned because the workers are
+// being stopped; the result of that translation must be discarded.
+thread_local bool workerReadAborted = false;
+
+// Guest memory last read directly by this thread. Reads are mostly sequential,
+// so a window ahead of the requested address is read in a single operation.
+// The window is only valid for one translation.
+struct DirectWindow {
+    uint64_t start = 0;
+    size_t size = 0;
+    std::array<uint8_t, 0x4000> data;
+};
+thread_local DirectWindow directWindow;
+
+// Jobs, results and speculation are keyed by address and tier. Guest
+// user-space addresses never have the top bit set, so it encodes tier 1.
+uint64_t JobKey(uint64_t addr, unsigned tier) {
+    return tier ? addr | (uint64_t{1} << 63) : addr;
+}
+uint64_t JobAddr(uint64_t key) {
+    return key & ~(uint64_t{1} << 63);
+}
+unsigned JobTier(uint64_t key) {
+    return key >> 63;
+}
+
 class RemoteMemory {
 private:
     const static size_t PG_SIZE = 0x1000;
@@ -220,15 +322,26 @@ private:
     std::unordered_map<uint64_t, std::unique_ptr<Page>> page_cache;
     Conn& conn;
 
+    // Workers forward page misses to the connection thread, which serves
+    // them while waiting for a translation result.
+    std::mutex& mutex;
+    std::condition_variable& request_cv;
+    std::condition_variable page_cv;
+    std::deque<uint64_t> page_requests;
+    std::unordered_set<uint64_t> page_failed;
+    bool abort_requests = false;
+
+    // Client process to read from with process_vm_readv, or 0. Reset when
+    // reading fails for other reasons than unmapped memory, e.g. missing
+    // permissions, in which case the client serves memory requests instead.
+    std::atomic<pid_t> direct_pid{0};
+
 public:
-    RemoteMemory(Conn& c) : conn(c) {}
+    RemoteMemory(Conn& c, std::mutex& mutex, std::condition_variable& cv)
+            : conn(c), mutex(mutex), request_cv(cv) {}
 
 private:
-    Page* GetPage(size_t page_addr) {
-        const auto& page_it = page_cache.find(page_addr);
-        if (page_it != page_cache.end())
-            return page_it->second.get();
-
+    Page* FetchPage(size_t page_addr) {
         struct { uint64_t addr; size_t buf_sz; } send_buf{page_addr, PG_SIZE};
         conn.SendMsg(Msg::S_MEMREQ, send_buf);
 
@@ -239,16 +352,111 @@ private:
         auto page = std::make_unique<Page>();
         conn.Read(page->data(), page->size());
         uint8_t failed = conn.Read<uint8_t>();
-        if (failed)
+
+        std::lock_guard<std::mutex> lock(mutex);
+        page_cv.notify_all();
+        if (failed) {
+            page_failed.insert(page_addr);
             return nullptr;
+        }
 
-        page_cache[page_addr] = std::move(page);
+        auto& slot = page_cache[page_addr];
+        slot = std::move(page);
+        return slot.get();
+    }
 
-        return page_cache[page_addr].get();
+    Page* GetPage(size_t page_addr) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            const auto& page_it = page_cache.find(page_addr);
+            if (page_it != page_cache.end())
+                return page_it->second.get();
+            if (!isWorkerThread) {
+                lock.unlock();
+                return FetchPage(page_addr);
+            }
+
+            if (page_failed.count(page_addr))
+                return nullptr;
+            if (abort_requests) {
+                workerReadAborted = true;
+                return nullptr;
+            }
+            if (std::find(page_requests.begin(), page_requests.end(),
+                          page_addr) == page_requests.end()) {
+                page_requests.push_back(page_addr);
+                request_cv.notify_all();
+            }
+            page_cv.wait(lock);
+        }
     };
 
+    /// Read memory directly from the client; returns false if unavailable.
+    bool GetDirect(size_t start, size_t end, uint8_t* buf, size_t& out_size) {
+        pid_t pid = direct_pid.load(std::memory_order_relaxed);
+        if (!pid)
+            return false;
+
+        DirectWindow& win = directWindow;
+        bool large = end - start > win.data.size();
+        if (!large && start >= win.start && end <= win.start + win.size) {
+            std::copy(win.data.data() + (start - win.start),
+                      win.data.data() + (end - win.start), buf);
+            out_size = end - start;
+            return true;
+        }
+
+        // Partial reads stop at the first unmapped page.
+        struct iovec local{large ? buf : win.data.data(),
+                           large ? end - start : win.data.size()};
+        struct iovec remote{reinterpret_cast<void*>(start), local.iov_len};
+        ssize_t res = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+        if (res < 0 && errno != EFAULT) {
+            int err = errno;
+            pid_t expected = pid;
+            if (direct_pid.compare_exchange_strong(expected, 0))
+                std::cerr << "warning: direct memory access failed ("
+                          << std::strerror(err) << "), using memory requests"
+                          << std::endl;
+            return false;
+        }
+        size_t read_size = res < 0 ? 0 : res;
+        if (large) {
+            out_size = read_size;
+            return true;
+        }
+
+        win.start = start;
+        win.size = read_size;
+        out_size = std::min(read_size, end - start);
+        std::copy(win.data.data(), win.data.data() + out_size, buf);
+        return true;
+    }
+
 public:
+    /// Write memory of the client directly; returns false if unavailable.
+    bool PutDirect(uint64_t addr, const void* buf, size_t size) {
+        pid_t pid = direct_pid.load(std::memory_order_relaxed);
+        if (!pid)
+            return false;
+        struct iovec local{const_cast<void*>(buf), size};
+        struct iovec remote{reinterpret_cast<void*>(addr), size};
+        return process_vm_writev(pid, &local, 1, &remote, 1, 0) == ssize_t(size);
+    }
+
+    void SetDirectPid(pid_t pid) {
+        direct_pid.store(directMemory ? pid : 0, std::memory_order_relaxed);
+    }
+    /// Drop the direct window of this thread before a new translation.
+    static void ResetDirectWindow() {
+        directWindow.size = 0;
+    }
+
     size_t Get(size_t start, size_t end, uint8_t* buf) {
+        size_t direct_size;
+        if (GetDirect(start, end, buf, direct_size))
+            return direct_size;
+
         size_t start_page = start & ~(PG_SIZE - 1);
         size_t end_page = end & ~(PG_SIZE - 1);
         size_t bytes_written = 0;
@@ -263,6 +471,31 @@ public:
         }
         return bytes_written;
     }
+
+    // The following functions must be called with the mutex held.
+    bool HasRequests() const {
+        return !page_requests.empty();
+    }
+    /// Serve the oldest pending worker request; temporarily releases the lock.
+    void ServeRequest(std::unique_lock<std::mutex>& lock) {
+        uint64_t page_addr = page_requests.front();
+        page_requests.pop_front();
+        lock.unlock();
+        FetchPage(page_addr);
+        lock.lock();
+    }
+    /// Forget failed reads; the client may have mapped the page since.
+    void ResetFailed() {
+        page_failed.clear();
+    }
+    /// Let pending and future worker requests fail (or stop doing so).
+    void AbortRequests(bool abort) {
+        abort_requests = abort;
+        if (abort) {
+            page_requests.clear();
+            page_cv.notify_all();
+        }
+    }
 };
 
 } // end namespace
@@ -275,11 +508,78 @@ struct IWConnection {
     IWClientConfig iwcc;
     bool need_iwcc;
 
+    // Protects the page cache, the job queue and the results.
+    std::mutex mutex;
+    // Signalled when a result or a memory request is available.
+    std::condition_variable conn_cv;
+    // Signalled when a job is available or workers should stop.
+    std::condition_variable worker_cv;
+
     RemoteMemory remote_memory;
-    instrew::Cache cache;
+    // Owned by the process. Servers of a daemon inherit them when forked;
+    // only the cache directory is shared between them afterwards.
+    instrew::Cache& cache;
+    instrew::ObjectCache& object_cache;
+    instrew::Linker linker;
+    // Client pid from C_MEMPID, zero if unknown.
+    std::atomic<pid_t> client_pid{0};
+    instrew::ImageMap images;
+    // The guest program, from the command line or from C_PROGRAM.
+    std::string program = Program;
+    // Configuration of the generated code from iw_set_code_config.
+    std::vector<uint8_t> code_config;
+    // Whether the manifest was handled; the address demanded meanwhile is
+    // sent as regular object.
+    bool prewarmed = false;
+    uint64_t prewarm_demand = 0;
 
-    IWConnection(const struct IWFunctions* fns, Conn& conn)
-            : fns(fns), conn(conn), remote_memory(conn) {}
+    /// A tier-0 object for the client index, with the code it was made of.
+    struct IndexRecord {
+        uint64_t addr;
+        std::array<uint8_t, instrew::Cache::HASH_SIZE> hash;
+        std::vector<uint8_t> code;
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    };
+    // Objects sent in this run, added to the client index at exit.
+    std::mutex index_mutex;
+    std::vector<IndexRecord> index_records;
+
+    /// A finished translation; empty if translation failed.
+    struct Result {
+        std::vector<char> obj;
+    };
+
+    // The first state is the primary state, which is only used on the
+    // connection thread; worker i uses state i + 1.
+    std::vector<IWState*> states;
+    std::vector<std::thread> workers;
+    bool stop_workers = false;
+    std::deque<uint64_t> jobs;
+    std::unordered_set<uint64_t> jobs_running;
+    std::unordered_map<uint64_t, Result> results;
+
+    // Speculation: all addresses ever requested or queued, the speculative
+    // jobs not yet demanded or pushed to the client, and their finished subset.
+    static constexpr size_t MAX_SPECULATIVE_JOBS = 1024;
+    std::unordered_set<uint64_t> known_addrs;
+    std::unordered_set<uint64_t> spec_pending;
+    std::deque<uint64_t> spec_done;
+
+    // Execution profiles of tier-0 code, sent before tier-up requests.
+    std::unordered_map<uint64_t, std::vector<uint64_t>> profiles;
+
+    // Objects are placed in memory shared with the client, which uses them in
+    // place. The client is done with them when it sends the next message, so
+    // the space is reused from then on. Objects that don't fit go inline.
+    static constexpr size_t SHM_SIZE = 4 << 20;
+    static constexpr size_t SHM_ALIGN = 64;
+    char* shm = nullptr;
+    size_t shm_used = 0;
+
+    IWConnection(const struct IWFunctions* fns, Conn& conn, instrew::Cache& cache,
+                 instrew::ObjectCache& object_cache)
+            : fns(fns), conn(conn), remote_memory(conn, mutex, conn_cv),
+              cache(cache), object_cache(object_cache) {}
 
 private:
     FILE* OpenObjDump(uint64_t addr) {
@@ -290,56 +590,526 @@ private:
         return std::fopen(debug_out1_name.str().c_str(), "wb");
     }
 
+    void StoreResult(Result res) {
+        uint64_t key = workerJobKey;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (workerReadAborted) {
+            // Memory reads were cut short, so retry the job later.
+            jobs.push_back(key);
+            return;
+        }
+        results[key] = std::move(res);
+        if (spec_pending.count(key))
+            spec_done.push_back(key);
+        conn_cv.notify_all();
+    }
+
+    /// Send the shared memory for objects to the client, replacing the
+    /// current one; on failure objects are sent inline.
+    void SendShm() {
+        if (shm)
+            munmap(shm, SHM_SIZE);
+        shm = nullptr;
+        shm_used = 0;
+        if (!shmObjects) {
+            conn.SendMsg(Msg::S_FD, -EOPNOTSUPP);
+            return;
+        }
+
+        int fd = memfd_create("instrew-objects", MFD_CLOEXEC);
+        if (fd < 0 || ftruncate(fd, SHM_SIZE) < 0) {
+            perror("memfd_create");
+        } else {
+            void* mem = mmap(nullptr, SHM_SIZE, PROT_READ|PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+            if (mem != MAP_FAILED)
+                shm = static_cast<char*>(mem);
+            else
+                perror("mmap");
+        }
+        if (shm)
+            conn.SendMsgWithFd(Msg::S_FD, 0, fd);
+        else
+            conn.SendMsg(Msg::S_FD, -EOPNOTSUPP);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    /// Send the directory for client snapshots, one per code configuration;
+    /// the client names snapshots after the binary.
+    void SendSnapshotDir() {
+        if (code_config.empty()) {
+            conn.SendMsg(Msg::S_FD, -EOPNOTSUPP);
+            return;
+        }
+        llvm::BLAKE3 hasher;
+        hasher.update(code_config);
+        std::array<uint8_t, 16> digest;
+        hasher.final(digest);
+        std::stringstream name;
+        for (uint8_t byte : digest)
+            name << std::hex << std::setw(2) << std::setfill('0') << unsigned{byte};
+
+        std::filesystem::path dir = instrew::Cache::DefaultDir() / "snapshots" / name.str();
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        int fd = open(dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0) {
+            int err = errno;
+            std::cerr << "warning: unable to open snapshot directory " << dir << std::endl;
+            conn.SendMsg(Msg::S_FD, -err);
+            return;
+        }
+        conn.SendMsgWithFd(Msg::S_FD, 0, fd);
+        close(fd);
+    }
+
+    /// Send the key for a client snapshot of the guest code in ranges, a
+    /// BLAKE3 hash of the configuration and the code; empty if the code
+    /// can't be read.
+    void SendSnapshotKey(const std::vector<uint64_t>& ranges) {
+        llvm::BLAKE3 hasher;
+        hasher.update(code_config);
+        hasher.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(&iwsc), sizeof(iwsc)));
+        hasher.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(&iwcc), sizeof(iwcc)));
+        std::vector<uint8_t> buf(0x10000);
+        RemoteMemory::ResetDirectWindow();
+        for (size_t i = 0; i + 1 < ranges.size(); i += 2) {
+            hasher.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(&ranges[i]),
+                                                  2 * sizeof(uint64_t)));
+            for (uint64_t cur = ranges[i]; cur < ranges[i + 1]; cur += buf.size()) {
+                size_t size = std::min<uint64_t>(buf.size(), ranges[i + 1] - cur);
+                if (remote_memory.Get(cur, cur + size, buf.data()) != size) {
+                    conn.SendMsgHdr(Msg::S_SNAPSHOT, 0);
+                    conn.Write(nullptr, 0);
+                    return;
+                }
+                hasher.update(llvm::ArrayRef<uint8_t>(buf.data(), size));
+            }
+        }
+        std::array<uint8_t, 32> key;
+        hasher.final(key);
+        conn.SendMsg(Msg::S_SNAPSHOT, key);
+    }
+
+    /// File for state of this binary and configuration in a subdirectory of
+    /// the cache directory; empty if unknown.
+    std::filesystem::path ProgramFile(const char* subdir) {
+        std::error_code ec;
+        std::filesystem::path program_path = std::filesystem::canonical(program, ec);
+        if (ec || code_config.empty())
+            return {};
+        llvm::BLAKE3 hasher;
+        hasher.update(code_config);
+        hasher.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(program_path.c_str()),
+                                              program_path.native().size()));
+        std::array<uint8_t, 16> digest;
+        hasher.final(digest);
+        std::stringstream name;
+        for (uint8_t byte : digest)
+            name << std::hex << std::setw(2) << std::setfill('0') << unsigned{byte};
+
+        std::filesystem::path dir = instrew::Cache::DefaultDir() / subdir;
+        std::filesystem::create_directories(dir, ec);
+        return dir / name.str();
+    }
+
+    /// Push the cached objects of the manifest for this binary and
+    /// configuration before translating addr, the first demanded address.
+    void Prewarm(uint64_t addr) {
+        prewarmed = true;
+        if (!prewarm || !cache.Enabled() || !fns->prewarm)
+            return;
+        std::filesystem::path path = ProgramFile("manifests");
+        if (path.empty())
+            return;
+        prewarm_demand = addr;
+        fns->prewarm(states[0], path.c_str());
+    }
+
+    /// Send the client index of this binary, if there is one yet.
+    void SendClientIndex() {
+        std::filesystem::path path = ProgramFile("index");
+        int fd = path.empty() ? -1 : open(path.c_str(), O_RDONLY|O_CLOEXEC);
+        if (fd < 0) {
+            conn.SendMsg(Msg::S_FD, path.empty() ? -EOPNOTSUPP : -errno);
+            return;
+        }
+        conn.SendMsgWithFd(Msg::S_FD, 0, fd);
+        close(fd);
+    }
+
+    /// Add the objects sent in this run to the client index. Entries of
+    /// earlier runs stay, the client checks their code itself.
+    void SaveClientIndex() {
+        if (index_records.empty())
+            return;
+        std::filesystem::path path = ProgramFile("index");
+        if (path.empty())
+            return;
+        instrew::ClientIndex index;
+        index.Load(path);
+        uint64_t now = std::time(nullptr);
+        for (const IndexRecord& record : index_records) {
+            instrew::ClientIndex::Entry entry{record.code, record.ranges, {}};
+            if (instrew::ObjectCache::Object obj = object_cache.Get(record.hash.data())) {
+                entry.obj = *obj;
+            } else if (!cache.Get(record.hash.data(), entry.obj)) {
+                continue;
+            }
+            entry.stamp = now;
+            index.Put(record.addr, std::move(entry));
+        }
+        index.Prune(clientIndexMaxSize << 20);
+        if (!index.Save(path))
+            std::cerr << "warning: unable to save client index " << path << std::endl;
+    }
+
+    /// Copy an object into the shared memory.
+    bool ShmPlace(const void* data, size_t size, uint64_t& offset) {
+        if (!shm || size > SHM_SIZE - shm_used)
+            return false;
+        std::memcpy(shm + shm_used, data, size);
+        offset = shm_used;
+        shm_used = std::min(SHM_SIZE, (shm_used + size + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1));
+        return true;
+    }
+
+    /// Link an object for the client, and write code and data directly into
+    /// the client if possible, so that only entries and fixups remain.
+    bool LinkObject(uint64_t addr, const void* data, size_t size,
+                    std::vector<char>& out) {
+        if (!linker.Link(static_cast<const char*>(data), size, addr, out))
+            return false;
+
+        auto* hdr = reinterpret_cast<InstrewLinkHdr*>(out.data());
+        size_t bytes_off = out.size() - hdr->code_size - hdr->data_size;
+        if (remote_memory.PutDirect(hdr->code_addr, &out[bytes_off], hdr->code_size) &&
+            remote_memory.PutDirect(hdr->data_addr, &out[bytes_off + hdr->code_size], hdr->data_size)) {
+            hdr->flags |= INSTREW_LINK_WRITTEN;
+            out.resize(bytes_off);
+        }
+        return true;
+    }
+
+    /// Send an object. Speculative objects are prefixed with their address,
+    /// which is also the base for linking.
+    void SendObjectMsg(bool spec, uint64_t addr, const void* data, size_t size) {
+        std::vector<char> linked;
+        if (linker.Active() && size > 0 && LinkObject(addr, data, size, linked)) {
+            data = linked.data();
+            size = linked.size();
+        }
+
+        uint64_t offset;
+        if (ShmPlace(data, size, offset)) {
+            if (spec) {
+                struct { uint64_t addr, offset, size; } msg{addr, offset, size};
+                conn.SendMsg(Msg::S_SHMSPECOBJ, msg);
+            } else {
+                struct { uint64_t offset, size; } msg{offset, size};
+                conn.SendMsg(Msg::S_SHMOBJ, msg);
+            }
+        } else {
+            conn.SendMsgHdr(spec ? Msg::S_SPECOBJ : Msg::S_OBJECT,
+                            (spec ? sizeof(addr) : 0) + size);
+            if (spec)
+                conn.Write(&addr, sizeof(addr));
+            conn.Write(data, size);
+        }
+    }
+
+    void SendResult(uint64_t addr, const Result& res) {
+        SendObjectMsg(false, addr, res.obj.data(), res.obj.size());
+    }
+
+    void SendSpeculativeResult(uint64_t addr, const Result& res) {
+        if (!res.obj.empty()) // failed translations are not pushed
+            SendObjectMsg(true, addr, res.obj.data(), res.obj.size());
+    }
+
+    /// Push one finished speculative translation to the client, which must be
+    /// waiting for a translation; temporarily releases the lock.
+    void PushSpeculativeResult(std::unique_lock<std::mutex>& lock) {
+        uint64_t key = spec_done.front();
+        spec_done.pop_front();
+        auto res_it = results.find(key);
+        if (!spec_pending.erase(key) || res_it == results.end())
+            return; // demanded in the meantime
+        Result res = std::move(res_it->second);
+        results.erase(res_it);
+        lock.unlock();
+        SendSpeculativeResult(JobAddr(key), res);
+        lock.lock();
+    }
+
+    void WorkerMain(size_t idx) {
+        isWorkerThread = true;
+        if (!states[idx])
+            states[idx] = fns->init(this, false);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            worker_cv.wait(lock, [this] { return stop_workers || !jobs.empty(); });
+            if (stop_workers)
+                return;
+            uint64_t key = jobs.front();
+            jobs.pop_front();
+            jobs_running.insert(key);
+            workerJobKey = key;
+            workerReadAborted = false;
+            lock.unlock();
+
+            RemoteMemory::ResetDirectWindow();
+            fns->translate(states[idx], JobAddr(key), JobTier(key));
+
+            lock.lock();
+            jobs_running.erase(key);
+        }
+    }
+
+    void StartWorkers() {
+        if (numThreads <= 1)
+            return;
+        states.resize(numThreads + 1, nullptr);
+        stop_workers = false;
+        remote_memory.AbortRequests(false);
+        for (size_t i = 1; i <= numThreads; i++)
+            workers.emplace_back(&IWConnection::WorkerMain, this, i);
+    }
+
+    void StopWorkers() {
+        if (workers.empty())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop_workers = true;
+            // Nobody serves memory requests while the client is not waiting
+            // for a translation, so let in-flight jobs fail and retry later.
+            remote_memory.AbortRequests(true);
+            worker_cv.notify_all();
+        }
+        for (auto& worker : workers)
+            worker.join();
+        workers.clear();
+    }
+
+    void Translate(uint64_t addr, unsigned tier) {
+        if (workers.empty()) {
+            RemoteMemory::ResetDirectWindow();
+            fns->translate(states[0], addr, tier);
+            return;
+        }
+
+        uint64_t key = JobKey(addr, tier);
+        std::unique_lock<std::mutex> lock(mutex);
+        remote_memory.ResetFailed();
+        known_addrs.insert(key);
+        spec_pending.erase(key);
+        if (!results.count(key) && !jobs_running.count(key)) {
+            // Demanded translations take precedence over queued jobs.
+            auto job_it = std::find(jobs.begin(), jobs.end(), key);
+            if (job_it != jobs.end())
+                jobs.erase(job_it);
+            jobs.push_front(key);
+            worker_cv.notify_one();
+        }
+
+        auto res_it = results.end();
+        while ((res_it = results.find(key)) == results.end()) {
+            if (remote_memory.HasRequests())
+                remote_memory.ServeRequest(lock);
+            else if (!spec_done.empty())
+                PushSpeculativeResult(lock);
+            else
+                conn_cv.wait(lock);
+        }
+        Result res = std::move(res_it->second);
+        results.erase(res_it);
+        while (!spec_done.empty())
+            PushSpeculativeResult(lock);
+        lock.unlock();
+
+        SendResult(addr, res);
+    }
+
 public:
-    bool CacheProbe(uint64_t addr, const uint8_t* hash) {
-        (void) addr;
-        auto res = cache.Get(hash);
-        if (res.first < 0)
+    void Speculate(uint64_t addr) {
+        if (numThreads <= 1)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (spec_pending.size() >= MAX_SPECULATIVE_JOBS)
+            return;
+        if (!known_addrs.insert(addr).second)
+            return;
+        spec_pending.insert(addr);
+        jobs.push_back(addr);
+        worker_cv.notify_one();
+    }
+
+    bool TakeProfile(uint64_t addr, std::vector<uint64_t>& counts) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = profiles.find(addr);
+        if (it == profiles.end())
             return false;
-        conn.SendMsgHdr(Msg::S_OBJECT, res.second);
-        conn.Sendfile(res.first, res.second);
-        close(res.first);
+        counts = std::move(it->second);
+        profiles.erase(it);
         return true;
     }
 
-    void SendObject(uint64_t addr, const void* data, size_t size,
-                    const uint8_t* hash) {
+    void RecordCode(uint64_t addr, const uint8_t* hash, const std::vector<uint8_t>& code,
+                    const std::vector<std::pair<uint64_t, uint64_t>>& ranges) {
+        if (!iwcc.tc_client_index)
+            return;
+        IndexRecord record{addr, {}, code, ranges};
+        std::memcpy(record.hash.data(), hash, record.hash.size());
+        std::lock_guard<std::mutex> lock(index_mutex);
+        index_records.push_back(std::move(record));
+    }
+
+    bool PushCached(uint64_t addr, const uint8_t* hash) {
+        if (addr == prewarm_demand)
+            return true; // sent as response to the pending request
+        instrew::ObjectCache::Object obj = object_cache.Get(hash);
+        if (!obj) {
+            std::vector<char> buf;
+            if (!cache.Get(hash, buf))
+                return false;
+            obj = std::make_shared<const std::vector<char>>(std::move(buf));
+            object_cache.Put(hash, obj);
+        }
+        if (!workers.empty()) {
+            // Don't translate it speculatively.
+            std::lock_guard<std::mutex> lock(mutex);
+            known_addrs.insert(addr);
+        }
+        SendObjectMsg(true, addr, obj->data(), obj->size());
+        return true;
+    }
+
+    bool CacheProbe(uint64_t addr, const uint8_t* hash) {
+        instrew::ObjectCache::Object obj = object_cache.Get(hash);
+        if (!obj) {
+            std::vector<char> buf;
+            if (!cache.Get(hash, buf))
+                return false;
+            obj = std::make_shared<const std::vector<char>>(std::move(buf));
+            object_cache.Put(hash, obj);
+        }
+        if (isWorkerThread) {
+            StoreResult(Result{*obj});
+            return true;
+        }
+        SendClientConfig();
+        SendObjectMsg(false, addr, obj->data(), obj->size());
+        return true;
+    }
+
+    /// The client config precedes the initial object, if requested.
+    void SendClientConfig() {
         if (need_iwcc) {
             conn.SendMsg(Msg::S_INIT, iwcc);
             need_iwcc = false;
         }
-        conn.SendMsgHdr(Msg::S_OBJECT, size);
-        conn.Write(data, size);
+    }
+
+    void SendObject(uint64_t addr, const void* data, size_t size,
+                    const uint8_t* hash) {
+        if (isWorkerThread) {
+            const char* obj = static_cast<const char*>(data);
+            StoreResult(Result{std::vector<char>(obj, obj + size)});
+        } else {
+            SendClientConfig();
+            SendObjectMsg(false, addr, data, size);
+        }
         if (FILE* df = OpenObjDump(addr)) {
             std::fwrite(data, size, 1, df);
             std::fclose(df);
         }
-        if (hash)
-            cache.Put(hash, size, static_cast<const char*>(data));
+        if (hash && !workerReadAborted) {
+            const char* obj = static_cast<const char*>(data);
+            object_cache.Put(hash, std::make_shared<const std::vector<char>>(obj, obj + size));
+            cache.Put(hash, size, obj);
+        }
     }
 
     int Run() {
-        if (conn.RecvMsg() != Msg::C_INIT) {
+        Msg::Id first_msgid = conn.RecvMsg();
+        if (first_msgid == Msg::C_PROGRAM) {
+            program.resize(conn.RemainingSize());
+            conn.Read(program.data(), program.size());
+            first_msgid = conn.RecvMsg();
+        }
+        if (first_msgid != Msg::C_INIT) {
             std::cerr << "error: expected C_INIT message" << std::endl;
             return 1;
         }
         iwsc = conn.Read<IWServerConfig>();
-        // In mode 0, we need to respond with a client config.
-        need_iwcc = iwsc.tsc_server_mode == 0;
+        // Without bit 0, we need to respond with a client config.
+        need_iwcc = (iwsc.tsc_server_mode & 1) == 0;
+        if (iwsc.tsc_server_mode & 2)
+            SendShm();
 
-        IWState* state = fns->init(this);
+        iwcc.tc_server_link = serverLink;
+        // Linked code depends on memory reserved at run time.
+        iwcc.tc_snapshot = snapshotCode && !serverLink;
+        iwcc.tc_client_index = clientIndex && !serverLink;
+        states.push_back(fns->init(this, true));
         if (need_iwcc)
             SendObject(0, "", 0, nullptr); // this will send the client config
+        if (iwcc.tc_snapshot)
+            SendSnapshotDir();
+        if (iwcc.tc_client_index)
+            SendClientIndex();
+
+        StartWorkers();
 
         while (true) {
             Msg::Id msgid = conn.RecvMsg();
+            shm_used = 0; // the client is done with all objects sent so far
             if (msgid == Msg::C_EXIT) {
-                fns->finalize(state);
-                state = nullptr;
+                StopWorkers();
+                // Finalize the primary state last, it reports the profile.
+                for (auto it = states.rbegin(); it != states.rend(); ++it)
+                    if (*it)
+                        fns->finalize(*it);
+                states.clear();
+                SaveClientIndex();
                 return 0;
             } else if (msgid == Msg::C_TRANSLATE) {
                 auto addr = conn.Read<uint64_t>();
-                fns->translate(state, addr);
+                if (!prewarmed)
+                    Prewarm(addr);
+                Translate(addr, 0);
+            } else if (msgid == Msg::C_TIERUP) {
+                auto addr = conn.Read<uint64_t>();
+                Translate(addr, 1);
+            } else if (msgid == Msg::C_PROFILE) {
+                auto addr = conn.Read<uint64_t>();
+                if (conn.RemainingSize() % sizeof(uint64_t)) {
+                    std::cerr << "error: malformed profile" << std::endl;
+                    return 1;
+                }
+                std::vector<uint64_t> counts(conn.RemainingSize() / sizeof(uint64_t));
+                conn.Read(counts.data(), counts.size() * sizeof(uint64_t));
+                std::lock_guard<std::mutex> lock(mutex);
+                profiles[addr] = std::move(counts);
+            } else if (msgid == Msg::C_LINKINFO) {
+                std::vector<char> info(conn.RemainingSize());
+                conn.Read(info.data(), info.size());
+                if (!linker.Configure(iwsc.tsc_host_arch, info))
+                    std::cerr << "warning: server-side linking unavailable" << std::endl;
+            } else if (msgid == Msg::C_SNAPSHOT) {
+                if (conn.RemainingSize() % (2 * sizeof(uint64_t))) {
+                    std::cerr << "error: malformed snapshot ranges" << std::endl;
+                    return 1;
+                }
+                std::vector<uint64_t> ranges(conn.RemainingSize() / sizeof(uint64_t));
+                conn.Read(ranges.data(), ranges.size() * sizeof(uint64_t));
+                SendSnapshotKey(ranges);
+            } else if (msgid == Msg::C_MEMPID) {
+                client_pid = conn.Read<int32_t>();
+                remote_memory.SetDirectPid(client_pid);
             } else if (msgid == Msg::C_FORK) {
                 int child_fds[2];
                 int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, &child_fds[0]);
@@ -350,6 +1120,11 @@ public:
                     continue;
                 }
 
+                // Only the forking thread survives in the child, so stop the
+                // workers and the cache writer and restart them in both
+                // processes afterwards.
+                StopWorkers();
+                cache.StopWriter();
                 pid_t pid = fork();
                 if (pid < 0) {
                     conn.SendMsg(Msg::S_FD, -errno);
@@ -358,11 +1133,19 @@ public:
                 } else if (pid == 0) {
                     conn = child_fds[0];
                     close(child_fds[1]);
+                    // The new client announces its pid on the new connection.
+                    remote_memory.SetDirectPid(0);
+                    client_pid = 0;
+                    // Our mapping is still shared with the parent.
+                    if (shm)
+                        SendShm();
                 } else {
                     conn.SendMsgWithFd(Msg::S_FD, 0, child_fds[1]);
                     close(child_fds[0]);
                     close(child_fds[1]);
                 }
+                cache.StartWriter();
+                StartWorkers();
             } else {
                 std::cerr << "unexpected msg " << msgid << std::endl;
                 return 1;
@@ -380,16 +1163,130 @@ struct IWClientConfig* iw_get_cc(IWConnection* iwc) {
 size_t iw_readmem(IWConnection* iwc, uintptr_t addr, uintptr_t end, uint8_t* buf) {
     return iwc->remote_memory.Get(addr, end, buf);
 }
+bool iw_cache_enabled(IWConnection* iwc) {
+    return iwc->cache.Enabled() || iwc->object_cache.Enabled();
+}
 bool iw_cache_probe(IWConnection* iwc, uintptr_t addr, const uint8_t* hash) {
     return iwc->CacheProbe(addr, hash);
 }
+bool iw_cache_get(IWConnection* iwc, const uint8_t* hash, std::vector<char>& data) {
+    return iwc->cache.Get(hash, data);
+}
+void iw_cache_put(IWConnection* iwc, const uint8_t* hash, const void* data, size_t size) {
+    iwc->cache.Put(hash, size, static_cast<const char*>(data));
+}
+bool iw_find_image(IWConnection* iwc, uintptr_t addr, std::vector<uint8_t>& id,
+                   uint64_t& offset) {
+    return iwc->images.Find(iwc->client_pid, addr, id, offset);
+}
+void iw_object_cache_stats(IWConnection* iwc, uint64_t& hits, uint64_t& misses) {
+    hits = iwc->object_cache.Hits();
+    misses = iwc->object_cache.Misses();
+}
 void iw_sendobj(IWConnection* iwc, uintptr_t addr, const void* data,
                 size_t size, const uint8_t* hash) {
     iwc->SendObject(addr, data, size, hash);
 }
+void iw_set_code_config(IWConnection* iwc, const void* config, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(config);
+    iwc->code_config.assign(bytes, bytes + size);
+}
+bool iw_push_cached(IWConnection* iwc, uintptr_t addr, const uint8_t* hash) {
+    return iwc->PushCached(addr, hash);
+}
+void iw_record_code(IWConnection* iwc, uintptr_t addr, const uint8_t* hash,
+                    const std::vector<uint8_t>& code,
+                    const std::vector<std::pair<uint64_t, uint64_t>>& ranges) {
+    iwc->RecordCode(addr, hash, code, ranges);
+}
+void iw_speculate(IWConnection* iwc, uintptr_t addr) {
+    iwc->Speculate(addr);
+}
+bool iw_follow_targets(IWConnection* iwc) {
+    (void) iwc;
+    return false;
+}
+bool iw_take_profile(IWConnection* iwc, uintptr_t addr, std::vector<uint64_t>& counts) {
+    return iwc->TakeProfile(addr, counts);
+}
+
+/// Fork a server for every client of the socket at -daemon; servers share the
+/// LLVM state initialized by warmup and the page cache of the cache files.
+int RunDaemon(const struct IWFunctions* fns) {
+    struct sockaddr_un addr;
+    if (!SocketAddress(daemonSocket, addr))
+        return 1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(addr.sun_path); // left over from an earlier daemon
+    mode_t old_umask = umask(0077); // other users may not connect
+    int ret = bind(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    umask(old_umask);
+    if (ret < 0 || listen(sock, SOMAXCONN) < 0) {
+        perror("bind");
+        return 1;
+    }
+
+    // State inherited by all servers: the opened cache, the in-memory object
+    // cache and the targets set up by warmup. Each server has its own copy
+    // after fork, so objects translated for one client reach others only
+    // through the cache directory. The cache writer thread doesn't survive
+    // fork, servers start their own.
+    instrew::Cache cache;
+    instrew::ObjectCache object_cache;
+    cache.StopWriter();
+    if (fns->warmup)
+        fns->warmup();
+    // Servers exit on their own, so don't keep zombies around.
+    signal(SIGCHLD, SIG_IGN);
+
+    while (true) {
+        int fd = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid < 0)
+            perror("fork");
+        if (pid != 0) {
+            close(fd);
+            continue;
+        }
+
+        close(sock);
+        signal(SIGCHLD, SIG_DFL);
+        cache.StartWriter();
+        int status;
+        {
+            Conn conn(fd);
+            IWConnection iwc{fns, conn, cache, object_cache};
+            status = iwc.Run();
+        }
+        // std::exit doesn't destroy the cache, so write queued objects now.
+        cache.StopWriter();
+        std::exit(status);
+    }
+}
 
 int iw_run_server(const struct IWFunctions* fns, int argc, char** argv) {
+    if (!daemonSocket.empty())
+        return RunDaemon(fns);
+    if (Program.empty()) {
+        std::cerr << "error: no program given" << std::endl;
+        return 1;
+    }
+    if (!connectSocket.empty())
+        ConnectDaemon(argv[0]);
+
     Conn conn(CreateChild(argv[0]));
-    IWConnection iwc{fns, conn};
+    instrew::Cache cache;
+    instrew::ObjectCache object_cache;
+    IWConnection iwc{fns, conn, cache, object_cache};
     return iwc.Run();
 }
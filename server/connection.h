@@ -5,6 +5,8 @@
 #include <cstddef>
 #include <cstdio>
 #include <cstdint>
+#include <utility>
+#include <vector>
 
 
 struct IWServerConfig {
@@ -30,17 +32,58 @@ typedef struct IWConnection IWConnection;
 const struct IWServerConfig* iw_get_sc(IWConnection* iwc);
 struct IWClientConfig* iw_get_cc(IWConnection* iwc);
 size_t iw_readmem(IWConnection* iwc, uintptr_t addr, size_t len, uint8_t* buf);
+// Whether translations are cached at all, otherwise they need no hash.
+bool iw_cache_enabled(IWConnection* iwc);
 bool iw_cache_probe(IWConnection* iwc, uintptr_t addr, const uint8_t* hash);
+// Other data cached like objects, e.g. values derived from the configuration.
+bool iw_cache_get(IWConnection* iwc, const uint8_t* hash, std::vector<char>& data);
+void iw_cache_put(IWConnection* iwc, const uint8_t* hash, const void* data, size_t size);
+// Hits and misses of the in-memory object cache so far.
+void iw_object_cache_stats(IWConnection* iwc, uint64_t& hits, uint64_t& misses);
 void iw_sendobj(IWConnection* iwc, uintptr_t addr, const void* data, size_t size, const uint8_t* hash);
+// Find the relocatable image (PIE or shared library) containing addr; id is
+// its build-id and offset the file offset of addr.
+bool iw_find_image(IWConnection* iwc, uintptr_t addr, std::vector<uint8_t>& id,
+                   uint64_t& offset);
+// Bytes that determine the generated code, identifying client snapshots.
+void iw_set_code_config(IWConnection* iwc, const void* config, size_t size);
+// Send the cached object for addr ahead of demand, see IWFunctions::prewarm.
+// Returns false if it is not cached.
+bool iw_push_cached(IWConnection* iwc, uintptr_t addr, const uint8_t* hash);
+// With -client-index, add the object of tier-0 code at addr to the index the
+// client reads itself; code is the bytes of the ranges, in order, which the
+// client compares with its memory.
+void iw_record_code(IWConnection* iwc, uintptr_t addr, const uint8_t* hash,
+                    const std::vector<uint8_t>& code,
+                    const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
+// Queue addr for translation ahead of demand; ignored without worker threads.
+void iw_speculate(IWConnection* iwc, uintptr_t addr);
+// Whether iw_speculate needs all direct targets, even without -speculate.
+bool iw_follow_targets(IWConnection* iwc);
+// Move the execution profile the client sent for addr into counts, if any.
+bool iw_take_profile(IWConnection* iwc, uintptr_t addr, std::vector<uint64_t>& counts);
 
 typedef struct IWState IWState;
 
 struct IWFunctions {
-    struct IWState* (* init)(IWConnection* iwc);
-    void (* translate)(IWState* state, uintptr_t addr);
+    // init is called once with primary set on the connection thread, which
+    // sends the initial object; each further worker gets its own state.
+    struct IWState* (* init)(IWConnection* iwc, bool primary);
+    // tier 0 is the first translation, tier 1 a recompilation of hot code.
+    void (* translate)(IWState* state, uintptr_t addr, unsigned tier);
+    // With -prewarm, called on the primary state before the first translation
+    // to push the cached objects listed in the manifest file; translations
+    // are recorded there at finalize.
+    void (* prewarm)(IWState* state, const char* manifest);
+    // With -daemon, called once before serving clients to initialize state
+    // that forked servers share; may be null.
+    void (* warmup)(void);
     void (* finalize)(IWState* state);
 };
 
+// The rewriting server, see rewriteserver.cc.
+extern const struct IWFunctions iw_rewrite_functions;
+
 int iw_run_server(const struct IWFunctions* fns, int argc, char** argv);
 
 #endif
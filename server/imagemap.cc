@@ -0,0 +1,141 @@
+#include "imagemap.h"
+
+#include <algorithm>
+#include <cstring>
+#include <elf.h>
+#include <fstream>
+#include <sstream>
+
+namespace instrew {
+
+namespace {
+
+bool ReadAt(std::ifstream& file, uint64_t offset, void* buf, size_t size) {
+    file.seekg(offset);
+    return static_cast<bool>(file.read(static_cast<char*>(buf), size));
+}
+
+/// Read the GNU build-id and the file ranges of executable segments of a
+/// position-independent ELF file.
+bool ReadImage(const std::string& path, std::vector<uint8_t>& id,
+               std::vector<std::pair<uint64_t, uint64_t>>& exec_ranges) {
+    std::ifstream file(path, std::ios::binary);
+    Elf64_Ehdr ehdr;
+    if (!file || !ReadAt(file, 0, &ehdr, sizeof(ehdr)))
+        return false;
+    if (std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+        ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_type != ET_DYN)
+        return false;
+
+    for (unsigned i = 0; i < ehdr.e_phnum; i++) {
+        Elf64_Phdr phdr;
+        if (!ReadAt(file, ehdr.e_phoff + i * sizeof(phdr), &phdr, sizeof(phdr)))
+            return false;
+        if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X))
+            exec_ranges.emplace_back(phdr.p_offset, phdr.p_offset + phdr.p_filesz);
+        if (phdr.p_type != PT_NOTE || phdr.p_filesz > 0x10000 || !id.empty())
+            continue;
+        std::vector<char> notes(phdr.p_filesz);
+        if (!ReadAt(file, phdr.p_offset, notes.data(), notes.size()))
+            return false;
+        size_t off = 0;
+        while (off + sizeof(Elf64_Nhdr) <= notes.size()) {
+            Elf64_Nhdr nhdr;
+            std::memcpy(&nhdr, &notes[off], sizeof(nhdr));
+            size_t name_off = off + sizeof(nhdr);
+            size_t desc_off = name_off + ((nhdr.n_namesz + 3) & ~3u);
+            off = desc_off + ((nhdr.n_descsz + 3) & ~3u);
+            if (off > notes.size())
+                break;
+            if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 &&
+                !std::memcmp(&notes[name_off], "GNU", 4)) {
+                id.assign(&notes[desc_off], &notes[desc_off] + nhdr.n_descsz);
+                break;
+            }
+        }
+    }
+    return !id.empty() && !exec_ranges.empty();
+}
+
+} // end namespace
+
+bool ImageMap::Find(pid_t pid, uint64_t addr, std::vector<uint8_t>& id,
+                    uint64_t& offset) {
+    if (!pid)
+        return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (this->pid != pid) {
+        this->pid = pid;
+        mappings.clear();
+    }
+    const Mapping* mapping = Lookup(addr);
+    // The image may have been mapped after we read the mappings.
+    if (!mapping && Update())
+        mapping = Lookup(addr);
+    if (!mapping || !mapping->image)
+        return false;
+    offset = addr - mapping->start + mapping->file_offset;
+    // Only code of executable segments, wherever it is mapped readable.
+    for (const auto& range : mapping->image->exec_ranges) {
+        if (offset >= range.first && offset < range.second) {
+            id = mapping->image->id;
+            return true;
+        }
+    }
+    return false;
+}
+
+const ImageMap::Mapping* ImageMap::Lookup(uint64_t addr) const {
+    auto it = std::upper_bound(mappings.begin(), mappings.end(), addr,
+                               [](uint64_t addr, const Mapping& mapping) {
+        return addr < mapping.start;
+    });
+    if (it == mappings.begin() || addr >= (--it)->end)
+        return nullptr;
+    return &*it;
+}
+
+bool ImageMap::Update() {
+    std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+    if (!maps)
+        return false;
+    mappings.clear();
+    std::string line;
+    while (std::getline(maps, line)) {
+        // start-end perms offset dev inode path
+        std::istringstream fields(line);
+        Mapping mapping{};
+        std::string perms, dev, path;
+        char dash;
+        uint64_t inode;
+        fields >> std::hex >> mapping.start >> dash >> mapping.end >> perms
+               >> mapping.file_offset >> dev >> std::dec >> inode;
+        // The client maps guest code without execute permission, so readable
+        // mappings of executable segments count; see Find.
+        if (!fields || perms.empty() || perms[0] != 'r' || !inode)
+            continue;
+        std::getline(fields >> std::ws, path);
+        if (path.empty() || path[0] != '/')
+            continue;
+        mapping.image = GetImage(path);
+        if (mapping.image)
+            mappings.push_back(mapping);
+    }
+    std::sort(mappings.begin(), mappings.end(), [](const Mapping& a, const Mapping& b) {
+        return a.start < b.start;
+    });
+    return true;
+}
+
+const ImageMap::Image* ImageMap::GetImage(const std::string& path) {
+    auto it = images.find(path);
+    if (it == images.end()) {
+        Image image;
+        if (!ReadImage(path, image.id, image.exec_ranges))
+            image.id.clear();
+        it = images.emplace(path, std::move(image)).first;
+    }
+    return it->second.id.empty() ? nullptr : &it->second;
+}
+
+} // namespace instrew
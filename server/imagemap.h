@@ -0,0 +1,52 @@
+
+#ifndef _INSTREW_SERVER_IMAGEMAP_H
+#define _INSTREW_SERVER_IMAGEMAP_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace instrew {
+
+/// File mappings of the client process, to identify code of relocatable images
+/// independent of the address they are loaded at.
+class ImageMap {
+public:
+    /// Find the relocatable ELF image (PIE or shared library) with a build-id
+    /// that contains addr in process pid. offset is the file offset of addr,
+    /// which is the same wherever the image is loaded.
+    bool Find(pid_t pid, uint64_t addr, std::vector<uint8_t>& id, uint64_t& offset);
+
+private:
+    struct Image {
+        std::vector<uint8_t> id;
+        // File ranges of executable segments.
+        std::vector<std::pair<uint64_t, uint64_t>> exec_ranges;
+    };
+    struct Mapping {
+        uint64_t start;
+        uint64_t end;
+        uint64_t file_offset;
+        const Image* image;
+    };
+
+    const Mapping* Lookup(uint64_t addr) const;
+    bool Update();
+    /// Null if not a relocatable image with a build-id and code.
+    const Image* GetImage(const std::string& path);
+
+    std::mutex mutex;
+    pid_t pid = 0;
+    // Sorted by start address.
+    std::vector<Mapping> mappings;
+    // Images by path, with an empty id if unavailable.
+    std::unordered_map<std::string, Image> images;
+};
+
+} // namespace instrew
+
+#endif
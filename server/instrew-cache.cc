@@ -0,0 +1,101 @@
+
+#include "cache.h"
+#include "config.h"
+
+#include <llvm/Support/CommandLine.h>
+
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+
+namespace {
+
+enum class Command {
+    Stats, Prune, Verify, Export, Import,
+};
+
+llvm::cl::OptionCategory ToolCategory("Instrew Cache Tool Options");
+
+llvm::cl::opt<Command> command(llvm::cl::Positional, llvm::cl::Required,
+        llvm::cl::desc("<command>"),
+        llvm::cl::values(
+            clEnumValN(Command::Stats, "stats", "Show number of entries, size and hit ratio"),
+            clEnumValN(Command::Prune, "prune", "Remove entries by size (-max-size) and age (-max-age)"),
+            clEnumValN(Command::Verify, "verify", "Check all entries"),
+            clEnumValN(Command::Export, "export", "Write all entries to a new pack file"),
+            clEnumValN(Command::Import, "import", "Add all entries of a pack file")
+        ), llvm::cl::cat(ToolCategory));
+llvm::cl::opt<std::string> packFile(llvm::cl::Positional, llvm::cl::desc("[pack file]"),
+        llvm::cl::cat(ToolCategory));
+llvm::cl::opt<uint64_t> pruneMaxSize("max-size", llvm::cl::desc("Keep most recently used entries up to this size in MiB"),
+        llvm::cl::init(0), llvm::cl::cat(ToolCategory));
+llvm::cl::opt<uint64_t> pruneMaxAge("max-age", llvm::cl::desc("Remove entries not used for this many days"),
+        llvm::cl::init(0), llvm::cl::cat(ToolCategory));
+
+} // end anonymous namespace
+
+int main(int argc, char** argv) {
+    llvm::cl::HideUnrelatedOptions({&InstrewCategory, &ToolCategory});
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Instrew translation cache maintenance\n");
+
+    bool needs_file = command == Command::Export || command == Command::Import;
+    if (needs_file != !packFile.empty()) {
+        std::cerr << "pack file required for export and import only" << std::endl;
+        return 1;
+    }
+
+    bool write = command == Command::Prune || command == Command::Import;
+    instrew::Cache cache(instrew::Cache::DefaultDir(), true, write);
+
+    instrew::Cache::Stats stats;
+    if (!cache.GetStats(stats)) {
+        std::cerr << "unable to open cache in " << instrew::Cache::DefaultDir() << std::endl;
+        return 1;
+    }
+
+    switch (command) {
+    case Command::Stats: {
+        uint64_t lookups = stats.hits + stats.misses;
+        std::cout << "entries:   " << stats.entries << "\n"
+                  << "bytes:     " << stats.bytes << "\n"
+                  << "file size: " << stats.file_size << "\n"
+                  << "hits:      " << stats.hits << "\n"
+                  << "misses:    " << stats.misses << "\n"
+                  << "hit ratio: " << std::fixed << std::setprecision(1)
+                  << (lookups ? 100.0 * stats.hits / lookups : 0.0) << "%\n";
+        return 0;
+    }
+    case Command::Prune:
+        if (!pruneMaxSize && !pruneMaxAge) {
+            std::cerr << "prune requires -max-size or -max-age" << std::endl;
+            return 1;
+        }
+        if (!cache.Prune(pruneMaxSize << 20, pruneMaxAge * 24 * 60 * 60)) {
+            std::cerr << "unable to prune cache" << std::endl;
+            return 1;
+        }
+        cache.GetStats(stats);
+        std::cout << stats.entries << " entries, " << stats.bytes << " bytes remaining\n";
+        return 0;
+    case Command::Verify: {
+        size_t invalid = cache.Verify(std::cout);
+        std::cout << stats.entries << " entries, " << invalid << " invalid\n";
+        return invalid ? 1 : 0;
+    }
+    case Command::Export:
+        if (!cache.Export(static_cast<std::string>(packFile))) {
+            std::cerr << "unable to export cache to " << packFile << std::endl;
+            return 1;
+        }
+        return 0;
+    case Command::Import:
+        if (!cache.Import(static_cast<std::string>(packFile))) {
+            std::cerr << "unable to import cache from " << packFile << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,347 @@
+
+#include "linker.h"
+
+#include "instrew-link.h"
+
+#include <algorithm>
+#include <cstring>
+#include <elf.h>
+
+namespace instrew {
+
+namespace {
+
+// Same minimum alignment as allocations in the client.
+constexpr uint64_t MIN_ALIGN = 0x40;
+
+uint64_t AlignUp(uint64_t val, uint64_t align) {
+    return (val + align - 1) & ~(align - 1);
+}
+
+template<typename T>
+T Load(const char* base, size_t offset) {
+    T t;
+    std::memcpy(&t, base + offset, sizeof(T));
+    return t;
+}
+
+bool SignedRange(int64_t val, unsigned bits) {
+    return val >= -(int64_t{1} << (bits - 1)) && val < (int64_t{1} << (bits - 1));
+}
+
+void Blend(uint8_t* loc, uint64_t mask, uint64_t data) {
+    size_t size = mask > UINT32_MAX ? 8 : mask > UINT16_MAX ? 4 : mask > UINT8_MAX ? 2 : 1;
+    uint64_t val = 0;
+    std::memcpy(&val, loc, size); // little-endian hosts only
+    val = (data & mask) | (val & ~mask);
+    std::memcpy(loc, &val, size);
+}
+
+/// Decode the guest address of a Z<oct> or S<oct> name, see rtld.c.
+bool DecodeName(const char* name, uint64_t skew, uint64_t& addr) {
+    if (name[0] != 'Z' && name[0] != 'S')
+        return false;
+    addr = 0;
+    for (unsigned k = 1; name[k] && name[k] != '_'; k++) {
+        if (name[k] < '0' || name[k] >= '8')
+            return false;
+        addr = (addr << 3) | (name[k] - '0');
+    }
+    if (name[0] == 'S')
+        addr += skew;
+    return true;
+}
+
+} // end anonymous namespace
+
+bool Linker::Configure(uint16_t machine, const std::vector<char>& info) {
+    InstrewLinkInfo li;
+    if (info.size() < sizeof(li) || info.back() != 0)
+        return false;
+    if (machine != EM_X86_64 && machine != EM_AARCH64)
+        return false;
+    std::memcpy(&li, info.data(), sizeof(li));
+
+    this->machine = machine;
+    code_cur = li.code_addr;
+    code_end = li.code_addr + li.code_size;
+    data_cur = li.data_addr;
+    data_end = li.data_addr + li.data_size;
+    plt.clear();
+    uint64_t plt_addr = li.plt_addr;
+    for (size_t off = sizeof(li); off < info.size(); ) {
+        std::string name(info.data() + off);
+        off += name.size() + 1;
+        plt[name] = plt_addr;
+        plt_addr += li.plt_entry_size;
+    }
+    active = true;
+    return true;
+}
+
+bool Linker::Relocate(unsigned type, uint8_t* loc, uint64_t pc, uint64_t syma) {
+    int64_t prel_syma = syma - pc;
+    if (machine == EM_X86_64) {
+        switch (type) {
+        case R_X86_64_PC64: Blend(loc, UINT64_MAX, prel_syma); return true;
+        case R_X86_64_64: Blend(loc, UINT64_MAX, syma); return true;
+        case R_X86_64_PC32:
+        case R_X86_64_PLT32:
+            if (!SignedRange(prel_syma, 32))
+                return false;
+            Blend(loc, 0xffffffff, prel_syma);
+            return true;
+        case R_X86_64_32S:
+            if (!SignedRange(syma, 32))
+                return false;
+            Blend(loc, 0xffffffff, syma);
+            return true;
+        case R_X86_64_32:
+            if (syma > UINT32_MAX)
+                return false;
+            Blend(loc, 0xffffffff, syma);
+            return true;
+        }
+    } else if (machine == EM_AARCH64) {
+        switch (type) {
+        case R_AARCH64_PREL64: Blend(loc, UINT64_MAX, prel_syma); return true;
+        case R_AARCH64_PREL32:
+            if (!SignedRange(prel_syma, 32))
+                return false;
+            Blend(loc, 0xffffffff, prel_syma);
+            return true;
+        case R_AARCH64_JUMP26:
+        case R_AARCH64_CALL26:
+            // The client would need a stub, so leave the object to the client.
+            if (!SignedRange(prel_syma, 28))
+                return false;
+            Blend(loc, 0x03ffffff, prel_syma >> 2);
+            return true;
+        case R_AARCH64_ADR_PREL_PG_HI21:
+            prel_syma = (int64_t) ((syma & ~uint64_t{0xfff}) - (pc & ~uint64_t{0xfff})) >> 12;
+            if (!SignedRange(prel_syma, 21))
+                return false;
+            Blend(loc, 0x60ffffe0, ((prel_syma & 3) << 29) |
+                                   (((prel_syma >> 2) & 0x7ffff) << 5));
+            return true;
+        case R_AARCH64_ADD_ABS_LO12_NC:
+        case R_AARCH64_LDST8_ABS_LO12_NC:
+            Blend(loc, 0xfff << 10, syma << 10);
+            return true;
+        case R_AARCH64_LDST16_ABS_LO12_NC:
+            Blend(loc, 0xfff >> 1 << 10, syma >> 1 << 10);
+            return true;
+        case R_AARCH64_LDST32_ABS_LO12_NC:
+            Blend(loc, 0xfff >> 2 << 10, syma >> 2 << 10);
+            return true;
+        case R_AARCH64_LDST64_ABS_LO12_NC:
+            Blend(loc, 0xfff >> 3 << 10, syma >> 3 << 10);
+            return true;
+        case R_AARCH64_LDST128_ABS_LO12_NC:
+            Blend(loc, 0xfff >> 4 << 10, syma >> 4 << 10);
+            return true;
+        case R_AARCH64_MOVW_UABS_G0_NC: Blend(loc, 0xffff << 5, syma >> 0 << 5); return true;
+        case R_AARCH64_MOVW_UABS_G1_NC: Blend(loc, 0xffff << 5, syma >> 16 << 5); return true;
+        case R_AARCH64_MOVW_UABS_G2_NC: Blend(loc, 0xffff << 5, syma >> 32 << 5); return true;
+        case R_AARCH64_MOVW_UABS_G3: Blend(loc, 0xffff << 5, syma >> 48 << 5); return true;
+        }
+    }
+    return false;
+}
+
+bool Linker::Link(const char* obj, size_t size, uint64_t skew,
+                  std::vector<char>& out) {
+    if (!active || size < sizeof(Elf64_Ehdr))
+        return false;
+    auto ehdr = Load<Elf64_Ehdr>(obj, 0);
+    if (std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_type != ET_REL ||
+        ehdr.e_machine != machine || ehdr.e_shentsize != sizeof(Elf64_Shdr) ||
+        ehdr.e_shoff > size || ehdr.e_shnum > (size - ehdr.e_shoff) / sizeof(Elf64_Shdr))
+        return false;
+
+    std::vector<Elf64_Shdr> shdrs(ehdr.e_shnum);
+    std::memcpy(shdrs.data(), obj + ehdr.e_shoff, shdrs.size() * sizeof(Elf64_Shdr));
+    for (const auto& shdr : shdrs)
+        if (shdr.sh_type != SHT_NOBITS && (shdr.sh_offset > size || shdr.sh_size > size - shdr.sh_offset))
+            return false;
+
+    // Layout, like rtld_add_object: writable sections go to the data region.
+    uint64_t code_size = 0, data_size = 0;
+    uint64_t code_align = MIN_ALIGN, data_align = MIN_ALIGN;
+    std::vector<uint64_t> sec_offset(shdrs.size());
+    for (size_t i = 0; i < shdrs.size(); i++) {
+        const auto& shdr = shdrs[i];
+        if (shdr.sh_flags & ~uint64_t{SHF_ALLOC|SHF_WRITE|SHF_EXECINSTR|SHF_MERGE|SHF_STRINGS|SHF_INFO_LINK})
+            return false;
+        if (!(shdr.sh_flags & SHF_ALLOC))
+            continue;
+        uint64_t align = std::max<uint64_t>(shdr.sh_addralign, 1);
+        if (align & (align - 1))
+            return false;
+        bool write = shdr.sh_flags & SHF_WRITE;
+        uint64_t& cur = write ? data_size : code_size;
+        uint64_t& max_align = write ? data_align : code_align;
+        cur = AlignUp(cur, align);
+        sec_offset[i] = cur;
+        cur += shdr.sh_size;
+        max_align = std::max(max_align, align);
+    }
+
+    uint64_t code_addr = AlignUp(code_cur, code_align);
+    uint64_t data_addr = AlignUp(data_cur, data_align);
+    if (code_addr > code_end || code_size > code_end - code_addr ||
+        data_addr > data_end || data_size > data_end - data_addr)
+        return false;
+
+    // Relocations patch up to 8 bytes, also at the end of a section.
+    std::vector<uint8_t> code(code_size + 8), data(data_size + 8);
+    std::vector<uint64_t> sec_addr(shdrs.size());
+    for (size_t i = 0; i < shdrs.size(); i++) {
+        const auto& shdr = shdrs[i];
+        if (!(shdr.sh_flags & SHF_ALLOC))
+            continue;
+        bool write = shdr.sh_flags & SHF_WRITE;
+        sec_addr[i] = (write ? data_addr : code_addr) + sec_offset[i];
+        if (shdr.sh_type != SHT_NOBITS)
+            std::memcpy((write ? data : code).data() + sec_offset[i],
+                        obj + shdr.sh_offset, shdr.sh_size);
+    }
+
+    auto get_str = [&](size_t strtab, size_t idx) -> const char* {
+        if (strtab == 0 || strtab >= shdrs.size() || shdrs[strtab].sh_type != SHT_STRTAB)
+            return nullptr;
+        if (idx >= shdrs[strtab].sh_size)
+            return nullptr;
+        const char* str = obj + shdrs[strtab].sh_offset + idx;
+        if (!std::memchr(str, 0, shdrs[strtab].sh_size - idx))
+            return nullptr;
+        return str;
+    };
+
+    std::vector<InstrewLinkEntry> link_entries;
+    std::vector<InstrewLinkFixup> link_fixups;
+    for (const auto& rela_shdr : shdrs) {
+        if (rela_shdr.sh_type != SHT_RELA)
+            continue;
+        if (rela_shdr.sh_entsize != sizeof(Elf64_Rela))
+            return false;
+        if (rela_shdr.sh_info == 0 || rela_shdr.sh_info >= shdrs.size())
+            return false;
+        const auto& tgt_shdr = shdrs[rela_shdr.sh_info];
+        if (!(tgt_shdr.sh_flags & SHF_ALLOC) || tgt_shdr.sh_type == SHT_NOBITS)
+            return false;
+        size_t symtab = rela_shdr.sh_link;
+        if (symtab == 0 || symtab >= shdrs.size())
+            return false;
+        const auto& sym_shdr = shdrs[symtab];
+        if (sym_shdr.sh_type != SHT_SYMTAB || sym_shdr.sh_entsize != sizeof(Elf64_Sym))
+            return false;
+        bool write = tgt_shdr.sh_flags & SHF_WRITE;
+        uint8_t* sec_buf = (write ? data : code).data() + sec_offset[rela_shdr.sh_info];
+
+        size_t rela_count = rela_shdr.sh_size / sizeof(Elf64_Rela);
+        for (size_t j = 0; j < rela_count; j++) {
+            auto rela = Load<Elf64_Rela>(obj, rela_shdr.sh_offset + j * sizeof(Elf64_Rela));
+            if (rela.r_offset >= tgt_shdr.sh_size)
+                return false;
+            uint64_t pc = sec_addr[rela_shdr.sh_info] + rela.r_offset;
+            unsigned type = ELF64_R_TYPE(rela.r_info);
+
+            size_t sym_idx = ELF64_R_SYM(rela.r_info);
+            if (sym_idx == 0 || sym_idx >= sym_shdr.sh_size / sizeof(Elf64_Sym))
+                return false;
+            auto sym = Load<Elf64_Sym>(obj, sym_shdr.sh_offset + sym_idx * sizeof(Elf64_Sym));
+            uint64_t sym_val;
+            if (sym.st_shndx == SHN_UNDEF) {
+                const char* name = get_str(sym_shdr.sh_link, sym.st_name);
+                if (!name || !std::strncmp(name, "glob_", 5))
+                    return false;
+                uint64_t addr;
+                if (!std::strcmp(name, "instrew_baseaddr")) {
+                    sym_val = skew;
+                } else if (DecodeName(name, skew, addr)) {
+                    auto entry_it = entries.find(addr);
+                    if (entry_it == entries.end()) {
+                        link_fixups.push_back(InstrewLinkFixup{pc, addr, rela.r_addend, type, 0});
+                        continue;
+                    }
+                    sym_val = entry_it->second;
+                } else if (!std::strcmp(name, "instrew_ic_miss")) {
+                    // Inline cache; the client creates a stub for each slot.
+                    link_fixups.push_back(InstrewLinkFixup{pc, 0, rela.r_addend, type, 0});
+                    continue;
+                } else {
+                    auto plt_it = plt.find(name);
+                    if (plt_it == plt.end())
+                        return false;
+                    sym_val = plt_it->second;
+                }
+            } else if (sym.st_shndx == SHN_ABS) {
+                sym_val = sym.st_value;
+            } else if (sym.st_shndx < shdrs.size()) {
+                sym_val = sec_addr[sym.st_shndx] + sym.st_value;
+            } else {
+                return false;
+            }
+
+            if (!Relocate(type, sec_buf + rela.r_offset, pc, sym_val + rela.r_addend))
+                return false;
+        }
+    }
+
+    for (const auto& sym_shdr : shdrs) {
+        if (sym_shdr.sh_type != SHT_SYMTAB)
+            continue;
+        if (sym_shdr.sh_entsize != sizeof(Elf64_Sym))
+            return false;
+        size_t sym_count = sym_shdr.sh_size / sizeof(Elf64_Sym);
+        for (size_t j = 0; j < sym_count; j++) {
+            auto sym = Load<Elf64_Sym>(obj, sym_shdr.sh_offset + j * sizeof(Elf64_Sym));
+            if (ELF64_ST_BIND(sym.st_info) != STB_GLOBAL ||
+                ELF64_ST_TYPE(sym.st_info) != STT_FUNC ||
+                ELF64_ST_VISIBILITY(sym.st_other) != STV_DEFAULT ||
+                sym.st_shndx == SHN_UNDEF)
+                continue;
+            if (sym.st_shndx >= shdrs.size())
+                return false;
+            const char* name = get_str(sym_shdr.sh_link, sym.st_name);
+            uint64_t addr;
+            if (!name || !DecodeName(name, skew, addr) || !addr)
+                return false;
+            link_entries.push_back(InstrewLinkEntry{addr, sec_addr[sym.st_shndx] + sym.st_value, sym.st_size});
+        }
+    }
+
+    InstrewLinkHdr hdr{};
+    hdr.magic = INSTREW_LINK_MAGIC;
+    hdr.code_addr = code_addr;
+    hdr.code_size = code_size;
+    hdr.data_addr = data_addr;
+    hdr.data_size = data_size;
+    hdr.entry_count = link_entries.size();
+    hdr.fixup_count = link_fixups.size();
+
+    size_t entries_size = link_entries.size() * sizeof(InstrewLinkEntry);
+    size_t fixups_size = link_fixups.size() * sizeof(InstrewLinkFixup);
+    out.resize(sizeof(hdr) + entries_size + fixups_size + code_size + data_size);
+    char* dst = out.data();
+    std::memcpy(dst, &hdr, sizeof(hdr));
+    dst += sizeof(hdr);
+    std::memcpy(dst, link_entries.data(), entries_size);
+    dst += entries_size;
+    std::memcpy(dst, link_fixups.data(), fixups_size);
+    dst += fixups_size;
+    std::memcpy(dst, code.data(), code_size);
+    dst += code_size;
+    std::memcpy(dst, data.data(), data_size);
+
+    // Commit only now, failures above leave the regions untouched.
+    code_cur = code_addr + code_size;
+    data_cur = data_addr + data_size;
+    for (const auto& entry : link_entries)
+        entries[entry.addr] = entry.entry;
+    return true;
+}
+
+} // namespace instrew
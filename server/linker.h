@@ -0,0 +1,42 @@
+
+#ifndef _INSTREW_SERVER_LINKER_H
+#define _INSTREW_SERVER_LINKER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace instrew {
+
+/// Links objects for the memory regions the client reserved for this purpose,
+/// so that the client only needs to copy code and data into place and add the
+/// entries to its table. See instrew-link.h for the format.
+class Linker {
+public:
+    /// Configure with InstrewLinkInfo and PLT names from the client.
+    bool Configure(uint16_t machine, const std::vector<char>& info);
+    bool Active() const { return active; }
+
+    /// Link an ELF object, where S<oct> names are relative to skew. On success,
+    /// out holds the linked object with code and data bytes at the end. Fails
+    /// if the object doesn't fit or uses unsupported features; the caller
+    /// sends the ELF object instead.
+    bool Link(const char* obj, size_t size, uint64_t skew, std::vector<char>& out);
+
+private:
+    bool Relocate(unsigned type, uint8_t* loc, uint64_t pc, uint64_t syma);
+
+    bool active = false;
+    uint16_t machine = 0;
+    uint64_t code_cur = 0, code_end = 0;
+    uint64_t data_cur = 0, data_end = 0;
+    std::unordered_map<std::string, uint64_t> plt;
+    // Entries of all functions linked so far, by guest address.
+    std::unordered_map<uint64_t, uint64_t> entries;
+};
+
+} // namespace instrew
+
+#endif
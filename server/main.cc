@@ -0,0 +1,20 @@
+
+#include "config.h"
+#include "connection.h"
+#include "version.h"
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/raw_ostream.h>
+
+
+int main(int argc, char** argv) {
+    llvm::cl::HideUnrelatedOptions({&InstrewCategory, &CodeGenCategory});
+    auto& optionMap = llvm::cl::getRegisteredOptions();
+    optionMap["time-passes"]->setHiddenFlag(llvm::cl::Hidden);
+    llvm::cl::SetVersionPrinter([](llvm::raw_ostream& os) {
+        os << "Instrew " << instrew::instrewVersion << "\n";
+    });
+    llvm::cl::ParseCommandLineOptions(argc, argv);
+
+    return iw_run_server(&iw_rewrite_functions, argc, argv);
+}
@@ -0,0 +1,102 @@
+#include "manifest.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+namespace instrew {
+
+// Format: magic, entry count, then for each entry the address, the hash, the
+// number of ranges and the ranges. All integers are 64-bit little-endian.
+namespace {
+
+constexpr char MANIFEST_MAGIC[8] = {'I', 'W', 'M', 'A', 'N', 'I', '0', '1'};
+// Functions have few ranges; more indicates a corrupt file.
+constexpr uint64_t MANIFEST_MAX_RANGES = 1 << 16;
+
+bool ReadU64(std::istream& is, uint64_t& val) {
+    return static_cast<bool>(is.read(reinterpret_cast<char*>(&val), sizeof(val)));
+}
+
+void WriteU64(std::ostream& os, uint64_t val) {
+    os.write(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+
+} // end anonymous namespace
+
+bool Manifest::Load(const std::filesystem::path& path) {
+    Clear();
+    std::ifstream is(path, std::ios::binary);
+    if (!is)
+        return false;
+
+    char magic[sizeof(MANIFEST_MAGIC)];
+    uint64_t count;
+    if (!is.read(magic, sizeof(magic)) ||
+        std::memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) || !ReadU64(is, count))
+        return false;
+    for (uint64_t i = 0; i < count; i++) {
+        Entry entry;
+        uint64_t range_count;
+        if (!ReadU64(is, entry.addr) ||
+            !is.read(reinterpret_cast<char*>(entry.hash.data()), entry.hash.size()) ||
+            !ReadU64(is, range_count) || range_count > MANIFEST_MAX_RANGES) {
+            Clear();
+            return false;
+        }
+        entry.ranges.resize(range_count);
+        for (auto& range : entry.ranges) {
+            if (!ReadU64(is, range.first) || !ReadU64(is, range.second) ||
+                range.first > range.second) {
+                Clear();
+                return false;
+            }
+        }
+        Add(std::move(entry));
+    }
+    return true;
+}
+
+bool Manifest::Save(const std::filesystem::path& path) const {
+    std::filesystem::path tmp = path;
+    tmp += ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+        os.write(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+        WriteU64(os, entries.size());
+        for (const Entry& entry : entries) {
+            WriteU64(os, entry.addr);
+            os.write(reinterpret_cast<const char*>(entry.hash.data()), entry.hash.size());
+            WriteU64(os, entry.ranges.size());
+            for (const auto& range : entry.ranges) {
+                WriteU64(os, range.first);
+                WriteU64(os, range.second);
+            }
+        }
+        if (!os.flush()) {
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Manifest::Add(Entry entry) {
+    if (!addrs.insert(entry.addr).second)
+        return false;
+    entries.push_back(std::move(entry));
+    return true;
+}
+
+void Manifest::Clear() {
+    entries.clear();
+    addrs.clear();
+}
+
+} // namespace instrew
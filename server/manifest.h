@@ -0,0 +1,43 @@
+#ifndef _INSTREW_SERVER_MANIFEST_H
+#define _INSTREW_SERVER_MANIFEST_H
+
+#include "cache.h"
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace instrew {
+
+/// Functions a binary executed, in order, with their cache keys and the code
+/// ranges the keys cover. A later run checks the code and receives all cached
+/// objects at once (-prewarm).
+class Manifest {
+public:
+    struct Entry {
+        uint64_t addr;
+        std::array<uint8_t, Cache::HASH_SIZE> hash;
+        std::vector<std::pair<uint64_t, uint64_t>> ranges; // [start, end)
+    };
+
+    /// Read a manifest; a missing or malformed file gives an empty manifest.
+    bool Load(const std::filesystem::path& path);
+    /// Replace the file atomically, other servers may read it concurrently.
+    bool Save(const std::filesystem::path& path) const;
+
+    /// Append an entry, unless there is one for its address already.
+    bool Add(Entry entry);
+    const std::vector<Entry>& Entries() const { return entries; }
+    void Clear();
+
+private:
+    std::vector<Entry> entries;
+    std::unordered_set<uint64_t> addrs;
+};
+
+} // namespace instrew
+
+#endif
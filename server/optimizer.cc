@@ -27,7 +27,7 @@
 #include <llvm/Transforms/Scalar/SimplifyCFG.h>
 
 
-void Optimizer::Optimize(llvm::Function* fn) {
+void Optimizer::Optimize(llvm::Function* fn, bool fast) {
     llvm::PassBuilder pb;
     llvm::FunctionPassManager fpm{};
 
@@ -54,6 +54,10 @@ void Optimizer::Optimize(llvm::Function* fn) {
 
     // fpm.addPass(llvm::ADCEPass());
     fpm.addPass(llvm::DCEPass());
+    if (fast) {
+        fpm.run(*fn, fam);
+        return;
+    }
     fpm.addPass(llvm::EarlyCSEPass(/*MemorySSA=*/false));
     // fpm.addPass(llvm::NewGVNPass());
     // fpm.addPass(llvm::DSEPass());
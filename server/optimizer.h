@@ -11,7 +11,8 @@
 
 class Optimizer {
 public:
-    void Optimize(llvm::Function* fn);
+    /// With fast set, only run a minimal pipeline for quick compilation.
+    void Optimize(llvm::Function* fn, bool fast = false);
 
     /// Dump optimizer configuration into the buffer.
     void appendConfig(llvm::SmallVectorImpl<uint8_t>& buffer) const;
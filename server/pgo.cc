@@ -0,0 +1,214 @@
+
+#include "pgo.h"
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/Module.h>
+#include <sstream>
+
+
+namespace {
+
+// Each dispatcher call has TARGET_SLOTS pairs of target and count, followed by
+// the number of calls to other targets. The client updates the histogram.
+constexpr unsigned TARGET_SLOTS = 4;
+constexpr unsigned TARGET_WORDS = 2 * TARGET_SLOTS + 1;
+
+// Devirtualize only calls executed at least this often, where one target has
+// at least DEVIRT_PERCENT of all calls.
+constexpr uint64_t DEVIRT_MIN_CALLS = 16;
+constexpr uint64_t DEVIRT_PERCENT = 80;
+
+struct ProfileSites {
+    llvm::SmallVector<llvm::BranchInst*, 32> branches;
+    llvm::SmallVector<llvm::CallInst*, 8> calls;
+
+    size_t Size() const {
+        return branches.size() * 2 + calls.size() * TARGET_WORDS;
+    }
+};
+
+/// Sites are numbered in instruction order, so the numbering is the same for
+/// tier-0 code and its recompilation.
+ProfileSites CollectSites(llvm::Function* fn, int pc_arg) {
+    ProfileSites sites;
+    for (llvm::BasicBlock& bb : *fn) {
+        for (llvm::Instruction& inst : bb) {
+            if (auto* br = llvm::dyn_cast<llvm::BranchInst>(&inst)) {
+                if (br->isConditional())
+                    sites.branches.push_back(br);
+            } else if (auto* call = llvm::dyn_cast<llvm::CallInst>(&inst)) {
+                if (IsDispatchCall(call, pc_arg))
+                    sites.calls.push_back(call);
+            }
+        }
+    }
+    return sites;
+}
+
+llvm::MDNode* CreateBranchWeights(llvm::LLVMContext& ctx, uint64_t taken,
+                                  uint64_t not_taken) {
+    // Branch weights are 32-bit, keep the ratio.
+    while (taken > UINT32_MAX || not_taken > UINT32_MAX) {
+        taken >>= 1;
+        not_taken >>= 1;
+    }
+    return llvm::MDBuilder(ctx).createBranchWeights(taken, not_taken);
+}
+
+void DevirtualizeCall(llvm::CallInst* call, unsigned pc_arg, uint64_t target,
+                      uint64_t hits, uint64_t misses, uint64_t addr,
+                      llvm::Constant* pc_base) {
+    llvm::Function* fn = call->getFunction();
+    llvm::Module* mod = fn->getParent();
+    llvm::LLVMContext& ctx = fn->getContext();
+    llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+
+    // Same naming as direct calls with a constant target, see callconv.cc.
+    std::stringstream namebuf;
+    llvm::Constant* expected;
+    if (pc_base) {
+        namebuf << "S" << std::oct << target - addr;
+        expected = llvm::ConstantExpr::getAdd(pc_base,
+                                              llvm::ConstantInt::get(i64, target - addr));
+    } else {
+        namebuf << "Z" << std::oct << target;
+        expected = llvm::ConstantInt::get(i64, target);
+    }
+    auto fnc = mod->getOrInsertFunction(namebuf.str(), call->getFunctionType());
+    auto* tgt = llvm::cast<llvm::Function>(fnc.getCallee());
+    tgt->copyAttributesFrom(fn);
+    tgt->setDSOLocal(true);
+
+    // bb: cond branch; dispatch_bb: original call; direct_bb: call of target.
+    // Calls which return to this function continue in cont_bb.
+    llvm::BasicBlock* bb = call->getParent();
+    llvm::BasicBlock* dispatch_bb = bb->splitBasicBlock(call);
+    llvm::BasicBlock* cont_bb = nullptr;
+    if (!call->isMustTailCall())
+        cont_bb = dispatch_bb->splitBasicBlock(call->getNextNode());
+    auto* direct_bb = llvm::BasicBlock::Create(ctx, "", fn, dispatch_bb);
+
+    bb->getTerminator()->eraseFromParent();
+    llvm::IRBuilder<> irb(bb);
+    llvm::Value* is_target = irb.CreateICmpEQ(call->getArgOperand(pc_arg), expected);
+    irb.CreateCondBr(is_target, direct_bb, dispatch_bb,
+                     CreateBranchWeights(ctx, hits, misses));
+
+    auto* direct_call = llvm::cast<llvm::CallInst>(call->clone());
+    direct_call->setCalledFunction(tgt);
+    direct_call->setCallingConv(tgt->getCallingConv());
+    llvm::Type* pc_ty = direct_call->getArgOperand(pc_arg)->getType();
+    direct_call->setArgOperand(pc_arg, llvm::UndefValue::get(pc_ty));
+    irb.SetInsertPoint(direct_bb);
+    irb.Insert(direct_call);
+
+    if (!cont_bb) {
+        if (direct_call->getType()->isVoidTy())
+            irb.CreateRetVoid();
+        else
+            irb.CreateRet(direct_call);
+        return;
+    }
+
+    irb.CreateBr(cont_bb);
+    if (!call->getType()->isVoidTy()) {
+        irb.SetInsertPoint(&cont_bb->front());
+        llvm::PHINode* phi = irb.CreatePHI(call->getType(), 2);
+        call->replaceAllUsesWith(phi);
+        phi->addIncoming(call, dispatch_bb);
+        phi->addIncoming(direct_call, direct_bb);
+    }
+}
+
+} // end anonymous namespace
+
+llvm::GlobalVariable* InstrumentProfile(llvm::Function* fn, CallConv cc) {
+    int pc_arg = GetCallConvPCArg(cc);
+    ProfileSites sites = CollectSites(fn, pc_arg);
+    if (sites.Size() == 0)
+        return nullptr;
+
+    llvm::Module* mod = fn->getParent();
+    llvm::LLVMContext& ctx = fn->getContext();
+    llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+    llvm::Type* void_ty = llvm::Type::getVoidTy(ctx);
+
+    auto* counts_ty = llvm::ArrayType::get(i64, sites.Size());
+    auto* counts = new llvm::GlobalVariable(*mod, counts_ty, false,
+                                            llvm::GlobalValue::InternalLinkage,
+                                            llvm::ConstantAggregateZero::get(counts_ty),
+                                            "instrew_profile");
+
+    llvm::IRBuilder<> irb(ctx);
+    for (size_t i = 0; i < sites.branches.size(); i++) {
+        llvm::BranchInst* br = sites.branches[i];
+        irb.SetInsertPoint(br);
+        // The first counter of a pair counts the true edge.
+        llvm::Value* not_taken = irb.CreateZExt(irb.CreateNot(br->getCondition()), i64);
+        llvm::Value* idx = irb.CreateAdd(irb.getInt64(2 * i), not_taken);
+        llvm::Value* ptr = irb.CreateGEP(counts_ty, counts, {irb.getInt64(0), idx});
+        llvm::Value* count = irb.CreateLoad(i64, ptr);
+        irb.CreateStore(irb.CreateAdd(count, irb.getInt64(1)), ptr);
+    }
+
+    if (sites.calls.empty())
+        return counts;
+
+    llvm::Type* slot_ty = i64->getPointerTo();
+    auto* target_fn_ty = llvm::FunctionType::get(void_ty, {slot_ty, i64, i64}, false);
+    auto target_fn = mod->getOrInsertFunction("instrew_profile_target", target_fn_ty);
+    size_t base = sites.branches.size() * 2;
+    for (size_t i = 0; i < sites.calls.size(); i++) {
+        llvm::CallInst* call = sites.calls[i];
+        irb.SetInsertPoint(call);
+        llvm::Value* slot = irb.CreateConstGEP2_64(counts_ty, counts, 0,
+                                                   base + i * TARGET_WORDS);
+        irb.CreateCall(target_fn, {slot, call->getArgOperand(pc_arg),
+                                   irb.getInt64(TARGET_SLOTS)});
+    }
+
+    return counts;
+}
+
+void ApplyProfile(llvm::Function* fn, CallConv cc,
+                  llvm::ArrayRef<uint64_t> counts, uint64_t addr,
+                  llvm::Constant* pc_base) {
+    int pc_arg = GetCallConvPCArg(cc);
+    ProfileSites sites = CollectSites(fn, pc_arg);
+    if (counts.size() != sites.Size())
+        return;
+
+    llvm::LLVMContext& ctx = fn->getContext();
+    for (size_t i = 0; i < sites.branches.size(); i++) {
+        uint64_t taken = counts[2 * i];
+        uint64_t not_taken = counts[2 * i + 1];
+        if (!taken && !not_taken)
+            continue;
+        sites.branches[i]->setMetadata(llvm::LLVMContext::MD_prof,
+                                       CreateBranchWeights(ctx, taken, not_taken));
+    }
+
+    size_t base = sites.branches.size() * 2;
+    for (size_t i = 0; i < sites.calls.size(); i++) {
+        const uint64_t* hist = &counts[base + i * TARGET_WORDS];
+        uint64_t total = hist[2 * TARGET_SLOTS];
+        uint64_t best_target = 0;
+        uint64_t best_count = 0;
+        for (unsigned j = 0; j < TARGET_SLOTS; j++) {
+            total += hist[2 * j + 1];
+            if (hist[2 * j + 1] > best_count) {
+                best_target = hist[2 * j];
+                best_count = hist[2 * j + 1];
+            }
+        }
+        if (total < DEVIRT_MIN_CALLS || best_count * 100 < total * DEVIRT_PERCENT)
+            continue;
+        DevirtualizeCall(sites.calls[i], pc_arg, best_target, best_count,
+                         total - best_count, addr, pc_base);
+    }
+}
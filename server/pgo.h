@@ -0,0 +1,28 @@
+
+#ifndef _INSTREW_SERVER_PGO_H
+#define _INSTREW_SERVER_PGO_H
+
+#include "callconv.h"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/IR/Constant.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <cstddef>
+#include <cstdint>
+
+
+/// Add counters for all conditional branch edges and a target histogram for
+/// all dispatcher calls to a function after ChangeCallConv. Returns the array
+/// of 64-bit counters or nullptr if there is nothing to profile.
+llvm::GlobalVariable* InstrumentProfile(llvm::Function* fn, CallConv cc);
+
+/// Apply counters collected by InstrumentProfile for the same code: attach
+/// branch weights and call dominant targets of dispatcher calls directly,
+/// guarded by a comparison with the actual target. Addresses are relative to
+/// pc_base when it is set. Profiles that don't match are ignored.
+void ApplyProfile(llvm::Function* fn, CallConv cc,
+                  llvm::ArrayRef<uint64_t> counts, uint64_t addr,
+                  llvm::Constant* pc_base);
+
+#endif
@@ -1,24 +1,32 @@
 
+#include "cache.h"
 #include "callconv.h"
 #include "codegenerator.h"
 #include "config.h"
 #include "connection.h"
 #include "instrew-server-config.h"
+#include "manifest.h"
 #include "optimizer.h"
-#include "version.h"
+#include "pgo.h"
 
 #include <rellume/rellume.h>
 
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/IR/GlobalValue.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/PassTimingInfo.h>
 #include <llvm/Pass.h>
+#include <llvm/Support/BLAKE3.h>
 #include <llvm/Support/CommandLine.h>
-#include <openssl/sha.h>
 
+#include <algorithm>
+#include <array>
 #include <chrono>
 #include <cstddef>
 #include <cstdio>
@@ -28,9 +36,11 @@
 #include <elf.h>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <unistd.h>
 #include <sstream>
 #include <unordered_map>
+#include <vector>
 
 
 namespace {
@@ -48,6 +58,8 @@ llvm::cl::opt<unsigned char> perfSupport("perf", llvm::cl::desc("Enable perf sup
         clEnumVal(2, "write jitdump file")
         ),
     llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<unsigned> quickTlbBits("quick-tlb-bits", llvm::cl::desc("Log2 of the number of sets of the client's quick TLB (default: 9, max: 12); sets are indexed by guest address bits from bit 4 on"), llvm::cl::init(0), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<unsigned> tableBits("table-bits", llvm::cl::desc("Log2 of the initial size of the client's function table (default: 14, max: 24)"), llvm::cl::init(0), llvm::cl::cat(InstrewCategory));
 llvm::cl::opt<bool> verifyLiftedIR("verify-lifted", llvm::cl::desc("Verify lifted IR"), llvm::cl::cat(InstrewCategory));
 llvm::cl::bits<DumpIR> dumpIR("dumpir", llvm::cl::desc("Dump IR after:"),
     llvm::cl::values(
@@ -59,7 +71,19 @@ llvm::cl::bits<DumpIR> dumpIR("dumpir", llvm::cl::desc("Dump IR after:"),
 llvm::cl::opt<bool> safeCallRet("safe-call-ret", llvm::cl::desc("Don't clobber flags on call/ret instructions"), llvm::cl::cat(CodeGenCategory));
 llvm::cl::opt<bool> enableCallret("callret", llvm::cl::desc("Enable call-ret lifting"), llvm::cl::cat(CodeGenCategory));
 llvm::cl::opt<bool> enableFastcc("fastcc", llvm::cl::desc("Enable register-based calling convention (default: true)"), llvm::cl::init(true), llvm::cl::cat(CodeGenCategory));
+llvm::cl::opt<bool> enableSpeculation("speculate", llvm::cl::desc("Translate direct jump and call targets ahead of demand (needs -threads > 1)"), llvm::cl::cat(InstrewCategory));
+llvm::cl::opt<bool> enableTiered("tiered", llvm::cl::desc("Compile quickly first, recompile hot functions with full optimization"), llvm::cl::cat(CodeGenCategory));
+llvm::cl::opt<unsigned> tierThreshold("tier-threshold", llvm::cl::init(1000), llvm::cl::desc("Function entries before recompilation with -tiered; 0 recompiles at the first entry like 1 (default: 1000)"), llvm::cl::cat(CodeGenCategory));
+llvm::cl::opt<bool> enableTierPGO("tier-pgo", llvm::cl::desc("Profile tier-0 code and use the profile for recompilation (needs -tiered)"), llvm::cl::cat(CodeGenCategory));
+llvm::cl::opt<bool> enableShadowStack("shadow-stack", llvm::cl::desc("Predict returns with a shadow stack (x86-64 guests, without -callret)"), llvm::cl::cat(CodeGenCategory));
+llvm::cl::opt<bool> enableInlineCaches("inline-caches", llvm::cl::desc("Cache the target of each indirect jump and call site in the code (needs -callret)"), llvm::cl::cat(CodeGenCategory));
 llvm::cl::opt<bool> enablePIC("pic", llvm::cl::desc("Compile code position-independent"), llvm::cl::cat(CodeGenCategory));
+llvm::cl::opt<bool> enablePICImages("pic-images", llvm::cl::desc("Compile code of PIE binaries and shared libraries position-independent and cache it by build-id and offset"), llvm::cl::cat(CodeGenCategory));
+
+/// The counter of tier-0 code must reach zero after one entry at least.
+unsigned TierThreshold() {
+    return std::max(tierThreshold.getValue(), 1u);
+}
 
 } // end anonymous namespace
 
@@ -86,12 +110,142 @@ static llvm::GlobalVariable* CreatePcBase(llvm::LLVMContext& ctx) {
     return pc_base_var;
 }
 
+/// Translation times, summed over all states of a server process.
+struct TranslationProfile {
+    std::chrono::steady_clock::duration dur_predecode{};
+    std::chrono::steady_clock::duration dur_lifting{};
+    std::chrono::steady_clock::duration dur_instrument{};
+    std::chrono::steady_clock::duration dur_llvm_opt{};
+    std::chrono::steady_clock::duration dur_llvm_codegen{};
+
+    void Add(const TranslationProfile& other) {
+        dur_predecode += other.dur_predecode;
+        dur_lifting += other.dur_lifting;
+        dur_instrument += other.dur_instrument;
+        dur_llvm_opt += other.dur_llvm_opt;
+        dur_llvm_codegen += other.dur_llvm_codegen;
+    }
+};
+
+static std::mutex totalProfileMutex;
+static TranslationProfile totalProfile;
+
+// With -prewarm, the functions translated by all states, saved at finalize.
+static std::mutex manifestMutex;
+static instrew::Manifest manifest;
+static std::string manifestPath;
+
+/// Collect constant targets of direct jumps and calls, i.e. constant values
+/// stored to the PC. For position-independent code, these are relative to the
+/// function address and added to pc_base.
+static void CollectDirectTargets(llvm::Function* fn, uint64_t addr,
+                                 llvm::Constant* pc_base,
+                                 llvm::SmallVectorImpl<uint64_t>& targets) {
+    const llvm::DataLayout& DL = fn->getParent()->getDataLayout();
+    llvm::Argument* sptr = fn->arg_begin();
+
+    auto addTarget = [&](llvm::Value* val) {
+        if (auto* cnst = llvm::dyn_cast<llvm::ConstantInt>(val)) {
+            targets.push_back(cnst->getZExtValue());
+            return;
+        }
+        auto* expr = llvm::dyn_cast<llvm::ConstantExpr>(val);
+        if (!expr || expr->getOpcode() != llvm::Instruction::Add)
+            return;
+        auto* off = llvm::dyn_cast<llvm::ConstantInt>(expr->getOperand(1));
+        if (off && expr->getOperand(0) == pc_base)
+            targets.push_back(addr + off->getZExtValue());
+    };
+
+    for (llvm::BasicBlock& bb : *fn) {
+        for (llvm::Instruction& inst : bb) {
+            auto* store = llvm::dyn_cast<llvm::StoreInst>(&inst);
+            if (!store || store->getPointerAddressSpace() != SPTR_ADDR_SPACE)
+                continue;
+            int64_t offset = 0;
+            llvm::Value* base = llvm::GetPointerBaseWithConstantOffset(
+                    store->getPointerOperand(), offset, DL);
+            if (base != sptr || offset != 0) // PC is always at offset 0
+                continue;
+            llvm::Value* val = store->getValueOperand();
+            if (auto* phi = llvm::dyn_cast<llvm::PHINode>(val)) {
+                for (llvm::Value* incoming : phi->incoming_values())
+                    addTarget(incoming);
+            } else if (auto* select = llvm::dyn_cast<llvm::SelectInst>(val)) {
+                addTarget(select->getTrueValue());
+                addTarget(select->getFalseValue());
+            } else {
+                addTarget(val);
+            }
+        }
+    }
+}
+
+/// Count entries of a tier-0 function and call instrew_tier_up with the guest
+/// address and the profile counters, if any, once the counter, which starts
+/// at threshold, reaches zero. The counter is disarmed before the call, so
+/// that tier-0 code which keeps running, e.g. on other threads or when the
+/// server declines to recompile, doesn't request recompilation again.
+static void InstrumentTierCounter(llvm::Function* fn, llvm::Value* addr,
+                                  llvm::GlobalVariable* profile,
+                                  unsigned threshold) {
+    llvm::Module* mod = fn->getParent();
+    llvm::LLVMContext& ctx = fn->getContext();
+    llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+    llvm::Type* void_ty = llvm::Type::getVoidTy(ctx);
+
+    // The counter ends up in a writable data section of the object. It is 64
+    // bits wide, so that a disarmed counter never reaches zero again.
+    auto* counter = new llvm::GlobalVariable(*mod, i64, false,
+                                             llvm::GlobalValue::InternalLinkage,
+                                             llvm::ConstantInt::get(i64, threshold),
+                                             "instrew_tier_counter");
+    llvm::Type* profile_ty = i64->getPointerTo();
+    auto* tier_up_ty = llvm::FunctionType::get(void_ty, {i64, profile_ty, i64}, false);
+    auto tier_up = mod->getOrInsertFunction("instrew_tier_up", tier_up_ty);
+
+    llvm::BasicBlock* old_entry = &fn->getEntryBlock();
+    llvm::SmallVector<llvm::AllocaInst*, 8> allocas;
+    for (llvm::Instruction& inst : *old_entry)
+        if (auto* alloca = llvm::dyn_cast<llvm::AllocaInst>(&inst))
+            if (llvm::isa<llvm::ConstantInt>(alloca->getArraySize()))
+                allocas.push_back(alloca);
+
+    auto* entry = llvm::BasicBlock::Create(ctx, "", fn, old_entry);
+    auto* tier_up_bb = llvm::BasicBlock::Create(ctx, "", fn, old_entry);
+    llvm::IRBuilder<> irb(entry);
+    // Keep static allocas in the entry block.
+    for (llvm::AllocaInst* alloca : allocas)
+        alloca->moveBefore(*entry, entry->end());
+
+    llvm::Value* count = irb.CreateLoad(i64, counter);
+    count = irb.CreateSub(count, irb.getInt64(1));
+    irb.CreateStore(count, counter);
+    llvm::MDBuilder mdb(ctx);
+    irb.CreateCondBr(irb.CreateICmpEQ(count, irb.getInt64(0)), tier_up_bb,
+                     old_entry, mdb.createBranchWeights(1, threshold));
+
+    irb.SetInsertPoint(tier_up_bb);
+    irb.CreateStore(irb.getInt64(INT64_MAX), counter);
+    llvm::Value* profile_ptr = llvm::Constant::getNullValue(profile_ty);
+    uint64_t profile_size = 0;
+    if (profile) {
+        profile_ptr = irb.CreatePointerCast(profile, profile_ty);
+        profile_size = profile->getValueType()->getArrayNumElements();
+    }
+    irb.CreateCall(tier_up, {addr, profile_ptr, irb.getInt64(profile_size)});
+    irb.CreateBr(old_entry);
+}
+
 struct IWState {
 private:
     IWConnection* iwc;
+    bool primary;
     const IWServerConfig* iwsc = nullptr;
     IWClientConfig* iwcc = nullptr;
     CallConv instrew_cc = CallConv::CDECL;
+    // Calls and returns are only recognized for x86-64 guests.
+    bool useShadowStack = false;
 
     LLConfig* rlcfg;
     llvm::LLVMContext ctx;
@@ -102,40 +256,82 @@ private:
     Optimizer optimizer;
     llvm::SmallVector<char, 4096> obj_buffer;
     CodeGenerator codegen;
+    // Code generator for tier 0 with -tiered.
+    std::unique_ptr<CodeGenerator> codegen_fast;
+    // Code generators for position-independent code with -pic-images.
+    std::unique_ptr<CodeGenerator> codegen_pic;
+    std::unique_ptr<CodeGenerator> codegen_pic_fast;
 
-    llvm::SmallVector<uint8_t, 256> hashBuffer;
+    // Whether objects are cached, i.e. need a key.
+    bool useCache;
+    // Hasher state after the configuration, the start of every key.
+    llvm::BLAKE3 configHasher;
+    llvm::SmallVector<uint8_t, 256> codeBuffer;
 
-    std::chrono::steady_clock::duration dur_predecode{};
-    std::chrono::steady_clock::duration dur_lifting{};
-    std::chrono::steady_clock::duration dur_instrument{};
-    std::chrono::steady_clock::duration dur_llvm_opt{};
-    std::chrono::steady_clock::duration dur_llvm_codegen{};
+    TranslationProfile profile;
 
     void appendConfig(llvm::SmallVectorImpl<uint8_t>& buffer) const {
-        struct {
-            uint32_t version = 2;
-            uint8_t safeCallRet = safeCallRet;
-            uint8_t enableCallret = enableCallret;
-            uint8_t enableFastcc = enableFastcc;
-            uint8_t enablePIC = enablePIC;
-
-            uint32_t guestArch;
-            uint32_t hostArch;
-            uint32_t stackAlignment;
-        } config;
-        config.guestArch = iwsc->tsc_guest_arch;
-        config.hostArch = iwsc->tsc_host_arch;
-        config.stackAlignment = iwsc->tsc_stack_alignment;
-
-        std::size_t start = buffer.size();
-        buffer.resize_for_overwrite(buffer.size() + sizeof(config));
-        std::memcpy(&buffer[start], &config, sizeof(config));
+        // Fields are appended one by one, as padding of a struct would add
+        // undefined bytes to the key.
+        auto append = [&buffer](auto val) {
+            const auto* bytes = reinterpret_cast<const uint8_t*>(&val);
+            buffer.append(bytes, bytes + sizeof(val));
+        };
+        append(uint32_t{8}); // version
+        // Format of the key: BLAKE3 of this configuration, followed by the
+        // address and code ranges.
+        append(uint32_t{1}); // key format
+        append(uint8_t{safeCallRet});
+        append(uint8_t{enableCallret});
+        append(uint8_t{enableFastcc});
+        append(uint8_t{enablePIC});
+        append(uint8_t{enablePICImages});
+        append(uint8_t{enableTiered});
+        append(uint32_t{TierThreshold()});
+        append(uint8_t{enableTierPGO});
+        append(uint8_t{enableInlineCaches});
+        append(uint8_t{enableShadowStack});
+
+        append(static_cast<uint32_t>(iwsc->tsc_guest_arch));
+        append(static_cast<uint32_t>(iwsc->tsc_host_arch));
+        append(static_cast<uint32_t>(iwsc->tsc_stack_alignment));
+    }
+
+    /// Add the code ranges of the function at addr to a key and optionally
+    /// collect their bytes, which the client checks them with. Returns false
+    /// if the code can't be read completely.
+    bool HashRanges(llvm::BLAKE3& hasher, uint64_t addr,
+                    const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+                    llvm::SmallVectorImpl<uint8_t>& buffer,
+                    std::vector<uint8_t>* code = nullptr) const {
+        if (code)
+            code->clear();
+        for (const auto& range : ranges) {
+            uint64_t range_hdr[2] = {range.first - addr, range.second - range.first};
+            hasher.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<uint8_t*>(range_hdr), sizeof(range_hdr)));
+            buffer.resize_for_overwrite(range_hdr[1]);
+            if (iw_readmem(iwc, range.first, range.second, buffer.data()) != range_hdr[1])
+                return false;
+            hasher.update(buffer);
+            if (code)
+                code->insert(code->end(), buffer.begin(), buffer.end());
+        }
+        return true;
+    }
+
+    /// Key of a value that only depends on the configuration. Function keys
+    /// continue with an address and code ranges instead.
+    void ConfigKey(llvm::StringRef name,
+                   std::array<uint8_t, instrew::Cache::HASH_SIZE>& hash) const {
+        llvm::BLAKE3 hasher = configHasher;
+        hasher.update(llvm::ArrayRef<uint8_t>(name.bytes_begin(), name.size()));
+        hasher.final(hash);
     }
 
 public:
 
-    IWState(IWConnection* iwc)
-            : codegen(*iw_get_sc(iwc), enablePIC, obj_buffer) {
+    IWState(IWConnection* iwc, bool primary)
+            : primary(primary), codegen(*iw_get_sc(iwc), enablePIC, obj_buffer) {
         this->iwc = iwc;
         iwsc = iw_get_sc(iwc);
         iwcc = iw_get_cc(iwc);
@@ -145,6 +341,16 @@ public:
         ctx.setDiscardValueNames(true);
 #endif
 
+        if (enableTiered)
+            codegen_fast = std::make_unique<CodeGenerator>(*iwsc, enablePIC,
+                                                           obj_buffer, true);
+        if (enablePICImages && !enablePIC) {
+            codegen_pic = std::make_unique<CodeGenerator>(*iwsc, true, obj_buffer);
+            if (enableTiered)
+                codegen_pic_fast = std::make_unique<CodeGenerator>(*iwsc, true,
+                                                                   obj_buffer, true);
+        }
+
         rlcfg = ll_config_new();
         ll_config_enable_verify_ir(rlcfg, verifyLiftedIR);
         ll_config_set_call_ret_clobber_flags(rlcfg, !safeCallRet);
@@ -194,10 +400,17 @@ public:
             instrew_cc = GetFastCC(iwsc->tsc_host_arch, iwsc->tsc_guest_arch);
         else
             instrew_cc = CallConv::CDECL;
-        iwcc->tc_callconv = GetCallConvClientNumber(instrew_cc);
-        iwcc->tc_profile = enableProfiling;
-        iwcc->tc_perf = perfSupport;
-        iwcc->tc_print_trace = enableTracing;
+        useShadowStack = enableShadowStack && !enableCallret &&
+                         iwsc->tsc_guest_arch == EM_X86_64;
+        if (primary) {
+            iwcc->tc_callconv = GetCallConvClientNumber(instrew_cc);
+            iwcc->tc_profile = enableProfiling;
+            iwcc->tc_perf = perfSupport;
+            iwcc->tc_print_trace = enableTracing;
+            iwcc->tc_quick_tlb_bits = quickTlbBits;
+            iwcc->tc_table_bits = tableBits;
+            iwcc->tc_tiered = enableTiered;
+        }
 
         llvm::GlobalVariable* pc_base_var = CreatePcBase(ctx);
         pc_base = llvm::ConstantExpr::getPtrToInt(pc_base_var,
@@ -211,7 +424,6 @@ public:
 #if LL_LLVM_MAJOR >= 19
         mod->setIsNewDbgInfoFormat(true);
 #endif
-
 #if LL_LLVM_MAJOR < 17
         mod->getGlobalList().push_back(pc_base_var);
 #else
@@ -234,43 +446,143 @@ public:
                 llvm::ConstantArray::get(used_ty, used), "llvm.used");
         llvm_used->setSection("llvm.metadata");
 
-        codegen.GenerateCode(mod.get());
-        iw_sendobj(iwc, 0, obj_buffer.data(), obj_buffer.size(), nullptr);
+        useCache = iw_cache_enabled(iwc);
+        if (useCache || primary) {
+            llvm::SmallVector<uint8_t, 256> configBuffer;
+            appendConfig(configBuffer);
+            optimizer.appendConfig(configBuffer);
+            codegen.appendConfig(configBuffer);
+            configHasher.update(configBuffer);
+            // Snapshots of client code depend on the same configuration.
+            if (primary)
+                iw_set_code_config(iwc, configBuffer.data(), configBuffer.size());
+        }
+
+        // Lifting and optimization need the data layout of the target before
+        // the first translation. It only depends on the configuration, so it
+        // is cached like the initial object; with both cached, the code
+        // generator isn't set up before the first translation miss.
+        std::vector<char> layout;
+        std::array<uint8_t, instrew::Cache::HASH_SIZE> layout_hash;
+        if (useCache)
+            ConfigKey("instrew-data-layout", layout_hash);
+        if (useCache && iw_cache_get(iwc, layout_hash.data(), layout)) {
+            mod->setDataLayout(llvm::StringRef(layout.data(), layout.size()));
+        } else {
+            mod->setDataLayout(codegen.GetDataLayout());
+            if (useCache) {
+                const std::string& str = mod->getDataLayoutStr();
+                iw_cache_put(iwc, layout_hash.data(), str.data(), str.size());
+            }
+        }
+
+        // Only the primary state provides the initial object to the client.
+        if (primary) {
+            std::array<uint8_t, instrew::Cache::HASH_SIZE> hash;
+            if (useCache)
+                ConfigKey("instrew-initial-object", hash);
+            if (!useCache || !iw_cache_probe(iwc, 0, hash.data())) {
+                codegen.GenerateCode(mod.get());
+                iw_sendobj(iwc, 0, obj_buffer.data(), obj_buffer.size(),
+                           useCache ? hash.data() : nullptr);
+            }
+        }
 
         for (llvm::Function& fn : mod->functions())
             if (fn.hasExternalLinkage() && !fn.empty())
                 fn.deleteBody();
 
-        appendConfig(hashBuffer);
-        optimizer.appendConfig(hashBuffer);
-        codegen.appendConfig(hashBuffer);
     }
     ~IWState() {
         if (enableProfiling) {
+            std::lock_guard<std::mutex> lock(totalProfileMutex);
+            totalProfile.Add(profile);
+        }
+        // Other states are finalized before the primary state, which reports
+        // the totals of all of them.
+        if (enableProfiling && primary) {
+            const TranslationProfile& tp = totalProfile;
+            uint64_t obj_hits, obj_misses;
+            iw_object_cache_stats(iwc, obj_hits, obj_misses);
             std::cerr << "Server profile: " << std::dec
-                      << std::chrono::duration_cast<std::chrono::milliseconds>(dur_predecode).count()
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(tp.dur_predecode).count()
                       << "ms predecode; "
-                      << std::chrono::duration_cast<std::chrono::milliseconds>(dur_lifting).count()
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(tp.dur_lifting).count()
                       << "ms lifting; "
-                      << std::chrono::duration_cast<std::chrono::milliseconds>(dur_instrument).count()
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(tp.dur_instrument).count()
                       << "ms instrumentation; "
-                      << std::chrono::duration_cast<std::chrono::milliseconds>(dur_llvm_opt).count()
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(tp.dur_llvm_opt).count()
                       << "ms llvm_opt; "
-                      << std::chrono::duration_cast<std::chrono::milliseconds>(dur_llvm_codegen).count()
-                      << "ms llvm_codegen"
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(tp.dur_llvm_codegen).count()
+                      << "ms llvm_codegen; "
+                      << obj_hits << " object cache hits, "
+                      << obj_misses << " misses"
                       << std::endl;
         }
-        llvm::reportAndResetTimings(&llvm::errs());
+        if (primary && !manifestPath.empty()) {
+            std::lock_guard<std::mutex> lock(manifestMutex);
+            if (!manifest.Save(manifestPath))
+                std::cerr << "warning: unable to save manifest " << manifestPath << std::endl;
+        }
+        if (primary)
+            llvm::reportAndResetTimings(&llvm::errs());
         ll_config_free(rlcfg);
     }
 
-    void Translate(uintptr_t addr) {
+    /// Push the cached objects of the manifest whose code is unchanged, and
+    /// record translations from now on.
+    void Prewarm(const char* path) {
+        if (!useCache)
+            return;
+        instrew::Manifest old;
+        old.Load(path);
+
+        std::lock_guard<std::mutex> lock(manifestMutex);
+        manifestPath = path;
+        llvm::SmallVector<uint8_t, 256> buffer;
+        for (const instrew::Manifest::Entry& entry : old.Entries()) {
+            // Same key as tier-0 code in Translate.
+            llvm::BLAKE3 hasher = configHasher;
+            uint64_t hashAddr = enablePIC ? 0 : entry.addr;
+            uint8_t hashFast = enableTiered;
+            hasher.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<uint8_t*>(&hashAddr), sizeof(hashAddr)));
+            hasher.update(llvm::ArrayRef<uint8_t>(&hashFast, 1));
+            if (!HashRanges(hasher, entry.addr, entry.ranges, buffer))
+                continue;
+            std::array<uint8_t, instrew::Cache::HASH_SIZE> hash;
+            hasher.final(hash);
+            if (hash == entry.hash && iw_push_cached(iwc, entry.addr, hash.data()))
+                manifest.Add(entry);
+        }
+    }
+
+    void Translate(uintptr_t addr, unsigned tier) {
+        // With -tiered, tier 0 is compiled quickly and counts its executions;
+        // otherwise, all code is compiled at full optimization.
+        bool fast = enableTiered && tier == 0;
+        // Recompilations use the profile of the tier-0 code, which is specific
+        // to this run and therefore not cached.
+        std::vector<uint64_t> profile_counts;
+        bool use_profile = enableTiered && enableTierPGO && tier > 0 &&
+                           iw_take_profile(iwc, addr, profile_counts);
+
         auto time_predecode_start = std::chrono::steady_clock::now();
 
+        // With -pic-images, code of relocatable images is identified by the
+        // image and its offset therein, and can be reused wherever the image
+        // is loaded.
+        std::vector<uint8_t> image_id;
+        uint64_t image_offset = 0;
+        bool in_image = enablePICImages && !enablePIC &&
+                        iw_find_image(iwc, addr, image_id, image_offset);
+
         // Optionally generate position-independent code, where the offset
         // can be adjusted using relocations.
-        if (enablePIC)
+        bool pic = enablePIC || in_image;
+        if (pic)
             ll_config_set_pc_base(rlcfg, addr, llvm::wrap(pc_base));
+        else if (enablePICImages)
+            ll_config_set_pc_base(rlcfg, 0, nullptr);
 
         LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
         RellumeMemAccessCb accesscb = [](size_t addr, uint8_t* buf, size_t bufsz, void* user_arg) {
@@ -285,33 +597,50 @@ public:
             return;
         }
 
-        size_t hashConfigEnd = hashBuffer.size();
-
-        // Store address only for non-PIC code, other addresses are relative.
-        uint64_t hashAddr = enablePIC ? 0 : addr;
-        hashBuffer.resize_for_overwrite(hashConfigEnd + sizeof(hashAddr));
-        memcpy(&hashBuffer[hashConfigEnd], &hashAddr, sizeof(hashAddr));
-
-        const struct RellumeCodeRange* ranges = ll_func_ranges(rlfn);
-        for (; ranges->start || ranges->end; ranges++) {
-            uint64_t rel_start = ranges->start - addr;
-            uint64_t size = ranges->end - ranges->start;
-
-            size_t bufEnd = hashBuffer.size();
-            hashBuffer.resize_for_overwrite(bufEnd + 2 * sizeof(uint64_t) + size);
-            memcpy(&hashBuffer[bufEnd], &rel_start, sizeof(uint64_t));
-            memcpy(&hashBuffer[bufEnd + sizeof(uint64_t)], &size, sizeof(uint64_t));
-            iw_readmem(iwc, ranges->start, ranges->end, &hashBuffer[bufEnd + 2 * sizeof(uint64_t)]);
+        // Recompilations with a profile aren't cached, so they need no key.
+        bool cacheable = useCache && !use_profile;
+        std::array<uint8_t, instrew::Cache::HASH_SIZE> hash;
+        if (cacheable) {
+            llvm::BLAKE3 hasher = configHasher;
+            // Store address only for non-PIC code, other addresses are relative.
+            uint64_t hashAddr = pic ? 0 : addr;
+            uint8_t hashFast = fast;
+            hasher.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<uint8_t*>(&hashAddr), sizeof(hashAddr)));
+            hasher.update(llvm::ArrayRef<uint8_t>(&hashFast, 1));
+            if (in_image) {
+                uint64_t id_size = image_id.size();
+                hasher.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<uint8_t*>(&id_size), sizeof(id_size)));
+                hasher.update(image_id);
+                hasher.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<uint8_t*>(&image_offset), sizeof(image_offset)));
+            }
+
+            std::vector<std::pair<uint64_t, uint64_t>> code_ranges;
+            const struct RellumeCodeRange* ranges = ll_func_ranges(rlfn);
+            for (; ranges->start || ranges->end; ranges++)
+                code_ranges.emplace_back(ranges->start, ranges->end);
+            // The code was read for decoding, so this is served from the page
+            // cache.
+            std::vector<uint8_t> code;
+            bool record = tier == 0 && iwcc->tc_client_index;
+            bool complete = HashRanges(hasher, addr, code_ranges, codeBuffer,
+                                       record ? &code : nullptr);
+            hasher.final(hash);
+            if (record && complete)
+                iw_record_code(iwc, addr, hash.data(), code, code_ranges);
+
+            // Keys of relocatable images don't depend on the address, so they
+            // can't be checked from the manifest.
+            if (tier == 0 && !in_image) {
+                std::lock_guard<std::mutex> lock(manifestMutex);
+                if (!manifestPath.empty())
+                    manifest.Add({addr, hash, std::move(code_ranges)});
+            }
         }
 
-        uint8_t hash[SHA_DIGEST_LENGTH];
-        SHA1(hashBuffer.data(), hashBuffer.size(), hash);
-        hashBuffer.truncate(hashConfigEnd);
-
-        if (iw_cache_probe(iwc, addr, hash)) {
+        if (cacheable && iw_cache_probe(iwc, addr, hash.data())) {
             ll_func_dispose(rlfn);
             if (enableProfiling)
-                dur_predecode += std::chrono::steady_clock::now() - time_predecode_start;
+                profile.dur_predecode += std::chrono::steady_clock::now() - time_predecode_start;
             return;
         }
 
@@ -324,6 +653,15 @@ public:
             return;
         }
 
+        // Without call-ret, a call ends the decoded code, so the return
+        // address of a call is the end of a code range.
+        llvm::SmallVector<uint64_t, 16> call_ends;
+        if (useShadowStack) {
+            const struct RellumeCodeRange* ranges = ll_func_ranges(rlfn);
+            for (; ranges->start || ranges->end; ranges++)
+                call_ends.push_back(ranges->end);
+        }
+
         llvm::Function* fn = llvm::unwrap<llvm::Function>(fn_wrapped);
         fn->setName("S0_" + llvm::Twine::utohexstr(addr));
         ll_func_dispose(rlfn);
@@ -331,60 +669,103 @@ public:
         if (dumpIR.isSet(DumpIR::Lift))
             mod->print(llvm::errs(), nullptr);
 
+        if (enableSpeculation || iw_follow_targets(iwc)) {
+            llvm::SmallVector<uint64_t, 16> targets;
+            CollectDirectTargets(fn, addr, pc_base, targets);
+            for (uint64_t target : targets)
+                if (target != addr)
+                    iw_speculate(iwc, target);
+        }
+
         auto time_instrument_start = std::chrono::steady_clock::now();
-        fn = ChangeCallConv(fn, instrew_cc);
+        fn = ChangeCallConv(fn, instrew_cc, useShadowStack, addr, call_ends);
+        if (fast) {
+            llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+            llvm::Value* addr_val = pic ? pc_base : llvm::ConstantInt::get(i64, addr);
+            llvm::GlobalVariable* profile_var = nullptr;
+            if (enableTierPGO)
+                profile_var = InstrumentProfile(fn, instrew_cc);
+            InstrumentTierCounter(fn, addr_val, profile_var, TierThreshold());
+        } else if (use_profile) {
+            ApplyProfile(fn, instrew_cc, profile_counts, addr,
+                         pic ? pc_base : nullptr);
+        }
+        // After profiling, so that sites are the same for tier-0 code and its
+        // recompilation.
+        if (enableInlineCaches)
+            InsertInlineCaches(fn, instrew_cc);
         if (dumpIR.isSet(DumpIR::CC))
             mod->print(llvm::errs(), nullptr);
 
         auto time_llvm_opt_start = std::chrono::steady_clock::now();
-        optimizer.Optimize(fn);
+        optimizer.Optimize(fn, fast);
         if (dumpIR.isSet(DumpIR::Opt))
             mod->print(llvm::errs(), nullptr);
 
         auto time_llvm_codegen_start = std::chrono::steady_clock::now();
-        codegen.GenerateCode(mod.get());
+        CodeGenerator* fn_codegen = fast ? codegen_fast.get() : &codegen;
+        if (pic && !enablePIC)
+            fn_codegen = fast ? codegen_pic_fast.get() : codegen_pic.get();
+        fn_codegen->GenerateCode(mod.get());
         if (dumpIR.isSet(DumpIR::CodeGen))
             mod->print(llvm::errs(), nullptr);
 
-        iw_sendobj(iwc, addr, obj_buffer.data(), obj_buffer.size(), hash);
+        iw_sendobj(iwc, addr, obj_buffer.data(), obj_buffer.size(),
+                   cacheable ? hash.data() : nullptr);
 
         // Remove unused functions and dead prototypes. Having many prototypes
         // causes some compile-time overhead.
         for (auto& glob_fn : llvm::make_early_inc_range(*mod))
             if (glob_fn.use_empty())
                 glob_fn.eraseFromParent();
+        for (auto& glob_var : llvm::make_early_inc_range(mod->globals()))
+            if (glob_var.hasLocalLinkage() && glob_var.use_empty())
+                glob_var.eraseFromParent();
 
         if (enableProfiling) {
-            dur_predecode += time_lifting_start - time_predecode_start;
-            dur_lifting += time_instrument_start - time_lifting_start;
-            dur_instrument += time_llvm_opt_start - time_instrument_start;
-            dur_llvm_opt += time_llvm_codegen_start - time_llvm_opt_start;
-            dur_llvm_codegen += std::chrono::steady_clock::now() - time_llvm_codegen_start;
+            profile.dur_predecode += time_lifting_start - time_predecode_start;
+            profile.dur_lifting += time_instrument_start - time_lifting_start;
+            profile.dur_instrument += time_llvm_opt_start - time_instrument_start;
+            profile.dur_llvm_opt += time_llvm_codegen_start - time_llvm_opt_start;
+            profile.dur_llvm_codegen += std::chrono::steady_clock::now() - time_llvm_codegen_start;
         }
     }
 };
 
 
-int main(int argc, char** argv) {
-    llvm::cl::HideUnrelatedOptions({&InstrewCategory, &CodeGenCategory});
-    auto& optionMap = llvm::cl::getRegisteredOptions();
-    optionMap["time-passes"]->setHiddenFlag(llvm::cl::Hidden);
-    llvm::cl::SetVersionPrinter([](llvm::raw_ostream& os) {
-        os << "Instrew " << instrew::instrewVersion << "\n";
-    });
-    llvm::cl::ParseCommandLineOptions(argc, argv);
-
-    static const IWFunctions iwf = {
-        /*.init=*/[](IWConnection* iwc) {
-            return new IWState(iwc);
-        },
-        /*.translate=*/[](IWState* state, uintptr_t addr) {
-            state->Translate(addr);
-        },
-        /*.finalize=*/[](IWState* state) {
-            delete state;
-        },
-    };
-
-    return iw_run_server(&iwf, argc, argv);
-}
+const struct IWFunctions iw_rewrite_functions = {
+    /*.init=*/[](IWConnection* iwc, bool primary) {
+        return new IWState(iwc, primary);
+    },
+    /*.translate=*/[](IWState* state, uintptr_t addr, unsigned tier) {
+        state->Translate(addr, tier);
+    },
+    /*.prewarm=*/[](IWState* state, const char* manifest) {
+        state->Prewarm(manifest);
+    },
+    /*.warmup=*/[]() {
+        // Set up the targets of the primary state for clients of the host's
+        // architecture, with the stack alignment the client sends, so that
+        // servers forked by the daemon start with them.
+        IWServerConfig sc{};
+#if defined(__x86_64__)
+        sc.tsc_host_arch = EM_X86_64;
+        sc.tsc_stack_alignment = 8;
+#elif defined(__aarch64__)
+        sc.tsc_host_arch = EM_AARCH64;
+#else
+        return;
+#endif
+        CodeGenerator::Prepare(sc, enablePIC);
+        if (enableTiered)
+            CodeGenerator::Prepare(sc, enablePIC, true);
+        if (enablePICImages && !enablePIC) {
+            CodeGenerator::Prepare(sc, true);
+            if (enableTiered)
+                CodeGenerator::Prepare(sc, true, true);
+        }
+    },
+    /*.finalize=*/[](IWState* state) {
+        delete state;
+    },
+};
@@ -0,0 +1,26 @@
+
+#ifndef _INSTREW_SHARED_HASH_H
+#define _INSTREW_SHARED_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hash of code or other data, starting with zero and continued over several
+// pieces: FNV-1a on words, not cryptographic, but fast for whole code
+// segments. Pieces with a size that is a multiple of 8 hash like their
+// concatenation.
+static inline uint64_t
+instrew_hash(uint64_t h, const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        uint64_t word;
+        __builtin_memcpy(&word, bytes, sizeof(word));
+        h = (h ^ word) * 0x100000001b3ull;
+        h ^= h >> 32;
+    }
+    for (; size; bytes++, size--)
+        h = (h ^ *bytes) * 0x100000001b3ull;
+    return h;
+}
+
+#endif
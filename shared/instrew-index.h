@@ -0,0 +1,38 @@
+
+#ifndef _INSTREW_SHARED_INDEX_H
+#define _INSTREW_SHARED_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Objects of a binary that the client loads itself (-client-index), without
+// asking the server. The header is followed by the entries sorted by address,
+// the code ranges, and the code and object of each entry. An entry is only
+// valid if the guest code in its ranges is the same as the code stored with
+// it, which holds the bytes of all ranges, in order.
+
+#define INSTREW_INDEX_MAGIC 0x33786469 // "idx3"
+
+struct InstrewIndexHdr {
+    uint32_t magic;
+    uint32_t entry_count;
+    uint64_t range_count;
+    uint64_t file_size;
+};
+
+struct InstrewIndexEntry {
+    uint64_t addr;
+    uint32_t range_idx;
+    uint32_t range_count;
+    uint64_t code_offset; // from the start of the file
+    uint64_t obj_offset; // from the start of the file, 8-byte aligned
+    uint64_t obj_size;
+    uint64_t stamp; // seconds since the epoch when the server last sent it
+};
+
+struct InstrewIndexRange {
+    uint64_t start;
+    uint64_t end;
+};
+
+#endif
@@ -0,0 +1,56 @@
+
+#ifndef _INSTREW_SHARED_LINK_H
+#define _INSTREW_SHARED_LINK_H
+
+#include <stdint.h>
+
+// Objects linked by the server (-server-link) for the memory regions which the
+// client announced with C_LINKINFO. They are sent instead of ELF objects and
+// are told apart by their magic. The header is followed by the entries, the
+// fixups and, unless the server already wrote them into the client, the code
+// and data bytes.
+
+#define INSTREW_LINK_MAGIC 0x6b6e6c49 // "Ilnk"
+// Code and data are already in place, only entries and fixups follow.
+#define INSTREW_LINK_WRITTEN 1
+
+struct InstrewLinkInfo {
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t data_addr;
+    uint64_t data_size;
+    uint64_t plt_addr;
+    uint64_t plt_entry_size;
+    // Followed by the NUL-terminated names of the PLT entries.
+};
+
+struct InstrewLinkHdr {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t data_addr;
+    uint64_t data_size;
+    uint32_t entry_count;
+    uint32_t fixup_count;
+};
+
+// A function of the object, to be added to the client's table.
+struct InstrewLinkEntry {
+    uint64_t addr;
+    uint64_t entry;
+    uint64_t size;
+};
+
+// A reference to a guest address the server doesn't know a translation for;
+// the client resolves it or creates a patch stub. Without sym_addr, the stub
+// fills an inline cache.
+struct InstrewLinkFixup {
+    uint64_t patch_addr;
+    uint64_t sym_addr;
+    int64_t addend;
+    uint32_t rel_type;
+    uint32_t pad;
+};
+
+#endif
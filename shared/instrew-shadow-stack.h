@@ -0,0 +1,26 @@
+
+#ifndef _INSTREW_SHARED_SHADOW_STACK_H
+#define _INSTREW_SHARED_SHADOW_STACK_H
+
+#include <stdint.h>
+
+// Return addresses of guest calls with their entries, kept by translated code
+// without -callret (-shadow-stack). Calls push the return address; returns
+// continue at the entry on top if it is the actual target, instead of going
+// back to the dispatcher. It is a ring, so overflows and mismatched returns
+// only cost predictions. The stack is at a fixed offset from the register data
+// in the CpuState of the client.
+
+#define INSTREW_SHADOW_STACK_OFFSET 0x400
+#define INSTREW_SHADOW_STACK_ENTRIES 64 // power of two
+
+struct InstrewShadowStack {
+    uint64_t top; // pushes minus pops, the index of the next entry
+    uint64_t _unused[7];
+    struct {
+        uint64_t addr;
+        uint64_t entry;
+    } entries[INSTREW_SHADOW_STACK_ENTRIES];
+};
+
+#endif
@@ -0,0 +1,24 @@
+#!/bin/sh
+# usage: daemon-run.sh <instrew> <program> [daemon options...]
+# Start a daemon in another working directory and run the program with a
+# server of it, using a relative program path.
+instrew=$(realpath "$1")
+program=$(realpath "$2")
+shift 2
+
+dir=$(mktemp -d)
+(cd / && exec "$instrew" -daemon="$dir/socket" "$@") &
+daemon=$!
+trap 'kill $daemon 2>/dev/null; rm -rf "$dir"' EXIT
+
+tries=0
+while [ ! -S "$dir/socket" ]; do
+    tries=$((tries + 1))
+    if [ $tries -gt 100 ] || ! kill -0 $daemon 2>/dev/null; then
+        echo "daemon did not start" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+cd "$(dirname "$program")" && "$instrew" -connect="$dir/socket" "./$(basename "$program")"
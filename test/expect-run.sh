@@ -0,0 +1,87 @@
+#!/bin/sh
+# usage: expect-run.sh [options] -- <command> [args...]
+# Run a command and check its exit status and its output (stdout and stderr).
+#   -e <regex>  a line of the output must match the extended regex
+#   -x <regex>  no line of the output may match the extended regex
+#   -t <path>   instrew-cache tool for -c
+#   -c <dir>    start with an empty cache in <dir> and append its statistics
+#               to the output, with the hits and misses of this run as
+#               "run hits:" and "run misses:"
+#   -w          run the command once before, e.g. to fill the cache
+# The output is only complete once all processes writing to it exited, so
+# servers forked by the command have finished with the cache at that point.
+expect=
+reject=
+tool=
+cachedir=
+warm=
+while getopts "e:x:t:c:w" opt; do
+    case $opt in
+    e) expect="$expect$OPTARG
+";;
+    x) reject="$reject$OPTARG
+";;
+    t) tool=$OPTARG;;
+    c) cachedir=$OPTARG;;
+    w) warm=1;;
+    *) exit 2;;
+    esac
+done
+shift $((OPTIND - 1))
+
+# Print a counter of the cache statistics, 0 if there is no cache yet.
+counter() {
+    value=$("$tool" stats -cachedir="$cachedir" 2>/dev/null | sed -n "s/^$1: *//p")
+    echo "${value:-0}"
+}
+
+if [ -n "$cachedir" ]; then
+    rm -rf "$cachedir"
+    mkdir -p "$cachedir"
+fi
+if [ -n "$warm" ]; then
+    if ! output=$("$@" 2>&1); then
+        printf '%s\n' "$output"
+        echo "warm-up run failed" >&2
+        exit 1
+    fi
+fi
+if [ -n "$cachedir" ]; then
+    hits=$(counter hits)
+    misses=$(counter misses)
+fi
+
+output=$("$@" 2>&1)
+status=$?
+if [ -n "$cachedir" ]; then
+    output="$output
+$("$tool" stats -cachedir="$cachedir" 2>&1)
+run hits: $(($(counter hits) - hits))
+run misses: $(($(counter misses) - misses))"
+fi
+printf '%s\n' "$output"
+if [ $status -ne 0 ]; then
+    echo "command failed with status $status" >&2
+    exit 1
+fi
+
+result=0
+while IFS= read -r regex; do
+    [ -z "$regex" ] && continue
+    if ! printf '%s\n' "$output" | grep -Eq -- "$regex"; then
+        echo "missing in output: $regex" >&2
+        result=1
+    fi
+done <<EOF
+$expect
+EOF
+while IFS= read -r regex; do
+    [ -z "$regex" ] && continue
+    if printf '%s\n' "$output" | grep -Eq -- "$regex"; then
+        echo "unexpected in output: $regex" >&2
+        result=1
+    fi
+done <<EOF
+$reject
+EOF
+exit $result